@@ -65,6 +65,98 @@ neat_error_code neat_accept(struct neat_ctx *ctx, struct neat_flow *flow,
                                                                  // from MW: yes I think port should be int
 neat_error_code neat_shutdown(struct neat_ctx *ctx, struct neat_flow *flow);
 
+// How new flows are spread over the source interfaces of a multi-homed host.
+// With the default policy, candidates are attempted in resolver order.
+typedef enum {
+    NEAT_SOURCE_POLICY_DEFAULT = 0,
+    NEAT_SOURCE_POLICY_ROUND_ROBIN,   // rotate the first interface per flow
+    NEAT_SOURCE_POLICY_LEAST_LOADED   // prefer interface with fewest flows
+} neat_source_policy;
+
+void neat_set_source_policy(struct neat_ctx *ctx, neat_source_policy policy);
+// Interfaces used for lookups and flows. include and exclude are lists of
+// shell patterns (like "eth*,wlan0"), separated by commas or spaces. An
+// interface is used if it matches include and does not match exclude. NULL
+// clears a list. Useful to leave out bridges, tunnels, ifb devices and such.
+neat_error_code neat_set_interface_filter(struct neat_ctx *ctx,
+                                          const char *include,
+                                          const char *exclude);
+// Upper bound on the number of DNS queries sent for one lookup, 0 means no
+// limit, and whether only one address per interface and family sends them.
+// Defaults are 16 queries and one address per interface.
+void neat_resolver_set_fanout(struct neat_ctx *ctx, uint32_t max_queries,
+                              uint8_t per_interface);
+// Number of times a DNS query is sent before a name server is given up on, 0
+// for the attempts option of resolv.conf (default 2), and the time (in ms)
+// before the first retransmission (0 for the default of 500 ms). The time
+// doubles for every retransmission. A lookup asks the name server that has
+// answered fastest first, and asks the next one as well if no reply has come
+// by the time it was expected, or by the first retransmission at the latest.
+void neat_resolver_set_retransmit(struct neat_ctx *ctx, uint8_t attempts,
+                                  uint32_t initial_timeout);
+// Which addresses of a DNS reply are raced, when it has more than max_answers
+// of them (0 races all). Default is 3 addresses picked at random, so that
+// clients spread over all the servers behind a name.
+typedef enum {
+    NEAT_ANSWER_POLICY_RANDOM = 0,  // a random sample of the addresses
+    NEAT_ANSWER_POLICY_ORDER,       // the first ones, in the order of the reply
+    NEAT_ANSWER_POLICY_RTT          // lowest expected cost, from earlier flows
+} neat_answer_policy;
+
+void neat_resolver_set_answer_policy(struct neat_ctx *ctx,
+                                     neat_answer_policy policy,
+                                     uint8_t max_answers);
+// Look names up in the background, while the event loop runs, so that their
+// answers are cached by the time flows to them are opened.
+neat_error_code neat_resolver_prefetch(struct neat_ctx *ctx,
+                                       const char *names[],
+                                       uint32_t num_names);
+// Cached DNS answers that have been used at least min_hits times are looked
+// up again shortly before their TTL runs out, so that neat_open does not have
+// to wait for them. 0 disables it. Default is 1.
+void neat_resolver_set_refresh(struct neat_ctx *ctx, uint32_t min_hits);
+
+// Policy table of RFC 6724 address selection, which orders the Happy Eyeballs
+// candidates. Adds an entry for prefix (like "fc00::/7", IPv4 prefixes are
+// given mapped, like "::ffff:10.0.0.0/104") or replaces it. The default is the
+// table of RFC 6724, section 2.1, which neat_reset_address_policy restores.
+neat_error_code neat_set_address_policy(struct neat_ctx *ctx,
+                                        const char *prefix,
+                                        uint8_t precedence, uint8_t label);
+void neat_reset_address_policy(struct neat_ctx *ctx);
+// Whether temporary (privacy) IPv6 source addresses are preferred over public
+// ones, rule 7 of RFC 6724. Default is to prefer them.
+void neat_set_prefer_temporary(struct neat_ctx *ctx, uint8_t prefer);
+
+// Delay (in ms) between starting two Happy Eyeballs connection attempts. A
+// failed attempt starts the next one right away. Default is 250 ms.
+void neat_he_set_delay(struct neat_ctx *ctx, uint32_t delay);
+// Timeout (in ms) for a single connection attempt, and deadline (in ms) for
+// neat_open to resolve and connect the flow. When it expires, on_error is
+// called with NEAT_ERROR_IO. 0 disables a timer. Defaults are 3 s and 10 s.
+void neat_he_set_timeouts(struct neat_ctx *ctx, uint32_t attempt_timeout,
+                          uint32_t deadline);
+
+
+// Connection pools. A pool keeps up to size idle, connected flows towards name
+// and port with the given properties, and opens new ones ahead of demand. Idle
+// flows are closed after idle_timeout ms (default 30 s), or when the peer
+// closes them. A size of 0 removes the pool.
+neat_error_code neat_pool_set_size(struct neat_ctx *ctx, const char *name,
+                                   const char *port, uint64_t propertyMask,
+                                   uint32_t size);
+void neat_pool_set_idle_timeout(struct neat_ctx *ctx, uint32_t idle_timeout);
+// Get a flow towards name and port that uses ops. A pooled flow is handed out
+// if there is one, and its on_connected is called by the next loop iteration.
+// Otherwise a new flow is opened, like with neat_open.
+neat_error_code neat_pool_acquire(struct neat_ctx *ctx,
+                                  struct neat_flow_operations *ops,
+                                  const char *name, const char *port,
+                                  uint64_t propertyMask,
+                                  struct neat_flow **flow);
+// Give a flow back. It is kept for reuse if its pool has room, otherwise it is
+// freed. The flow must not be used after this.
+void neat_pool_release(struct neat_ctx *ctx, struct neat_flow *flow);
 
 // do we also need a set property with a void * or an int (e.g. timeouts) or should
 // we create higher level named functions for such things?
@@ -89,6 +181,9 @@ neat_error_code neat_shutdown(struct neat_ctx *ctx, struct neat_flow *flow);
 #define NEAT_PROPERTY_CONGESTION_CONTROL_BANNED   (1 << 16)
 #define NEAT_PROPERTY_RETRANSMISSIONS_REQUIRED    (1 << 17)
 #define NEAT_PROPERTY_RETRANSMISSIONS_BANNED      (1 << 18)
+#define NEAT_PROPERTY_TCP_FASTOPEN                (1 << 19) // data goes in the SYN, write before read
+#define NEAT_PROPERTY_MPTCP_REQUIRED              (1 << 20)
+#define NEAT_PROPERTY_MPTCP_BANNED                (1 << 21)
 
 #define NEAT_ERROR_OK (0)
 #define NEAT_OK NEAT_ERROR_OK
@@ -57,7 +57,8 @@ uint8_t neat_addr_cmp_ip6_addr(struct in6_addr aAddr,
 //Add/remove/update a source address based on information received from OS
 void neat_addr_update_src_list(struct neat_ctx *nc,
         struct sockaddr_storage *src_addr, uint32_t if_idx,
-        uint8_t newaddr, uint32_t ifa_pref, uint32_t ifa_valid)
+        uint8_t newaddr, uint32_t ifa_pref, uint32_t ifa_valid,
+        uint8_t temporary)
 {
     struct sockaddr_in *src_addr4 = NULL, *org_addr4 = NULL;
     struct sockaddr_in6 *src_addr6 = NULL, *org_addr6 = NULL;
@@ -109,6 +110,7 @@ void neat_addr_update_src_list(struct neat_ctx *nc,
             //use it with new pref/valid times
             nsrc_addr->u.v6.ifa_pref = ifa_pref;
             nsrc_addr->u.v6.ifa_valid = ifa_valid;
+            nsrc_addr->temporary = temporary;
             //neat_addr_print_src_addrs(nc);
             neat_run_event_cb(nc, NEAT_UPDATEADDR, nsrc_addr);
         }
@@ -129,11 +131,16 @@ void neat_addr_update_src_list(struct neat_ctx *nc,
     nsrc_addr->family = src_addr->ss_family;
     nsrc_addr->if_idx = if_idx;
 
+    //Filters then match no patterns but "*"
+    if (if_indextoname(if_idx, nsrc_addr->if_name) == NULL)
+        nsrc_addr->if_name[0] = '\0';
+
     memcpy(&(nsrc_addr->u.generic.addr), src_addr, sizeof(*src_addr));
     
     if (nsrc_addr->family == AF_INET6) {
         nsrc_addr->u.v6.ifa_pref = ifa_pref;
         nsrc_addr->u.v6.ifa_valid = ifa_valid;
+        nsrc_addr->temporary = temporary;
     }
 
     LIST_INSERT_HEAD(&(nc->src_addrs), nsrc_addr, next_addr);
@@ -8,6 +8,10 @@
     #include <inaddr.h>
     #include <in6addr.h>
 #endif
+#ifndef _WIN32
+    #include <sys/socket.h>
+    #include <net/if.h>
+#endif
 
 #include "neat_queue.h"
 
@@ -32,17 +36,21 @@ struct neat_addr {
             uint32_t ifa_valid;
         } v6;
     } u;
+    //Used to match the interface filters of the context
+    char if_name[IF_NAMESIZE];
     LIST_ENTRY(neat_addr) next_addr;
     //Keep unaligned gap at the end of structure
     uint8_t family;
-    uint8_t __pad;
+    //Temporary (RFC 4941) IPv6 address, see RFC 6724 rule 7
+    uint8_t temporary;
     uint16_t __pad2;
 };
 
 //Add/remove addresses from src. address list
 void neat_addr_update_src_list(struct neat_ctx *nc,
         struct sockaddr_storage *src_addr, uint32_t if_idx,
-        uint8_t newaddr, uint32_t ifa_pref, uint32_t ifa_valid);
+        uint8_t newaddr, uint32_t ifa_pref, uint32_t ifa_valid,
+        uint8_t temporary);
 
 //Utility function for comparing two v6 addresses
 uint8_t neat_addr_cmp_ip6_addr(struct in6_addr aAddr,
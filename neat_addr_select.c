@@ -0,0 +1,345 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <uv.h>
+
+#include "neat.h"
+#include "neat_internal.h"
+#include "neat_core.h"
+
+//Destination address selection of RFC 6724, used to order the candidates of
+//Happy Eyeballs. Every candidate already has its source, so the rules compare
+//(source, destination) paths. Rules 1, 3, 4 and 7 are left out: candidates
+//always have a source, deprecated sources are not used by the resolver, and
+//mobility and encapsulation are not known here. Source address rule 7
+//(temporary addresses) decides between paths the destination rules do not
+//tell apart
+
+//Scopes of RFC 4291, section 2.7, which RFC 6724, section 3.2 also gives IPv4
+#define NEAT_SCOPE_LINK_LOCAL   0x2
+#define NEAT_SCOPE_SITE_LOCAL   0x5
+#define NEAT_SCOPE_GLOBAL       0xe
+//Rule 9 does not look past the subnet prefix
+#define NEAT_ADDR_SELECT_MAX_PREFIX 64
+
+//Default policy table, RFC 6724, section 2.1
+static const struct {
+    const char *prefix;
+    uint8_t precedence;
+    uint8_t label;
+} neat_addr_policy_defaults[] = {
+    {"::1/128", 50, 0},
+    {"::/0", 40, 1},
+    {"::ffff:0:0/96", 35, 4},
+    {"2002::/16", 30, 2},
+    {"2001::/32", 5, 5},
+    {"fc00::/7", 3, 13},
+    {"::/96", 1, 3},
+    {"fec0::/10", 1, 11},
+    {"3ffe::/16", 1, 12},
+};
+
+//What the rules look at for one candidate
+struct neat_addr_select_key {
+    uint32_t index;
+    uint8_t family;
+    uint8_t scope_match;    // rule 2
+    uint8_t label_match;    // rule 5
+    uint8_t precedence;     // rule 6
+    uint8_t scope;          // rule 8
+    uint8_t prefix_len;     // rule 9
+    uint8_t temporary_rank; // source address rule 7, 0 is preferred
+};
+
+//Parse "address/length"
+static uint8_t neat_addr_policy_parse(const char *str,
+                                      struct neat_addr_policy *entry)
+{
+    char addr[INET6_ADDRSTRLEN];
+    const char *slash = strchr(str, '/');
+    char *end;
+    long prefix_len;
+
+    if (slash == NULL || slash - str >= INET6_ADDRSTRLEN)
+        return RETVAL_FAILURE;
+
+    memcpy(addr, str, slash - str);
+    addr[slash - str] = '\0';
+    prefix_len = strtol(slash + 1, &end, 10);
+
+    if (end == slash + 1 || *end || prefix_len < 0 || prefix_len > 128 ||
+        inet_pton(AF_INET6, addr, &(entry->prefix)) != 1)
+        return RETVAL_FAILURE;
+
+    entry->prefix_len = prefix_len;
+    return RETVAL_SUCCESS;
+}
+
+static uint8_t neat_addr_prefix_match(const struct in6_addr *addr,
+                                      const struct in6_addr *prefix,
+                                      uint8_t prefix_len)
+{
+    uint8_t bytes = prefix_len / 8, bits = prefix_len % 8;
+
+    if (memcmp(addr->s6_addr, prefix->s6_addr, bytes))
+        return 0;
+
+    return !bits || !((addr->s6_addr[bytes] ^ prefix->s6_addr[bytes]) &
+                      (0xff << (8 - bits)));
+}
+
+static uint8_t neat_addr_common_prefix(const struct in6_addr *addr1,
+                                       const struct in6_addr *addr2)
+{
+    uint8_t i, len = 0, diff;
+
+    for (i = 0; i < sizeof(struct in6_addr); i++) {
+        if ((diff = addr1->s6_addr[i] ^ addr2->s6_addr[i]) == 0) {
+            len += 8;
+            continue;
+        }
+
+        for (; !(diff & 0x80); diff <<= 1)
+            len++;
+
+        break;
+    }
+
+    return len;
+}
+
+//Build the default table, unless the context has one
+static uint8_t neat_addr_policy_init(struct neat_ctx *ctx)
+{
+    uint32_t i, num_entries = sizeof(neat_addr_policy_defaults) /
+        sizeof(neat_addr_policy_defaults[0]);
+
+    if (ctx->addr_policy != NULL)
+        return RETVAL_SUCCESS;
+
+    ctx->addr_policy = calloc(num_entries, sizeof(struct neat_addr_policy));
+    if (ctx->addr_policy == NULL)
+        return RETVAL_FAILURE;
+
+    for (i = 0; i < num_entries; i++) {
+        neat_addr_policy_parse(neat_addr_policy_defaults[i].prefix,
+                               &(ctx->addr_policy[i]));
+        ctx->addr_policy[i].precedence =
+            neat_addr_policy_defaults[i].precedence;
+        ctx->addr_policy[i].label = neat_addr_policy_defaults[i].label;
+    }
+
+    ctx->addr_policy_cnt = num_entries;
+    return RETVAL_SUCCESS;
+}
+
+//Entry with the longest prefix matching addr
+static const struct neat_addr_policy *neat_addr_policy_lookup(
+        struct neat_ctx *ctx, const struct in6_addr *addr)
+{
+    const struct neat_addr_policy *entry = NULL;
+    uint32_t i;
+
+    for (i = 0; i < ctx->addr_policy_cnt; i++) {
+        if ((entry == NULL ||
+             ctx->addr_policy[i].prefix_len > entry->prefix_len) &&
+            neat_addr_prefix_match(addr, &(ctx->addr_policy[i].prefix),
+                                   ctx->addr_policy[i].prefix_len))
+            entry = &(ctx->addr_policy[i]);
+    }
+
+    return entry;
+}
+
+//IPv4 addresses are represented as IPv4-mapped IPv6 addresses
+static void neat_addr_to_in6(uint8_t family, const union neat_sockaddr *addr,
+                             struct in6_addr *addr6)
+{
+    if (family == AF_INET6) {
+        *addr6 = addr->v6.sin6_addr;
+        return;
+    }
+
+    memset(addr6, 0, sizeof(struct in6_addr));
+    addr6->s6_addr[10] = 0xff;
+    addr6->s6_addr[11] = 0xff;
+    memcpy(&(addr6->s6_addr[12]), &(addr->v4.sin_addr), 4);
+}
+
+static uint8_t neat_addr_scope(const struct in6_addr *addr)
+{
+    static const struct in6_addr loopback = IN6ADDR_LOOPBACK_INIT;
+
+    if (addr->s6_addr[0] == 0xff)
+        return addr->s6_addr[1] & 0x0f;
+
+    //Loopback and auto-configured IPv4 addresses are link-local, the rest is
+    //global. This includes private addresses
+    if (IN6_IS_ADDR_V4MAPPED(addr))
+        return (addr->s6_addr[12] == 127 ||
+                (addr->s6_addr[12] == 169 && addr->s6_addr[13] == 254)) ?
+            NEAT_SCOPE_LINK_LOCAL : NEAT_SCOPE_GLOBAL;
+
+    if (!memcmp(addr, &loopback, sizeof(struct in6_addr)) ||
+        IN6_IS_ADDR_LINKLOCAL(addr))
+        return NEAT_SCOPE_LINK_LOCAL;
+
+    if (IN6_IS_ADDR_SITELOCAL(addr))
+        return NEAT_SCOPE_SITE_LOCAL;
+
+    return NEAT_SCOPE_GLOBAL;
+}
+
+static void neat_addr_select_fill_key(struct neat_ctx *ctx,
+                                      const struct neat_resolver_res *candidate,
+                                      struct neat_addr_select_key *key)
+{
+    const struct neat_addr_policy *src_policy, *dst_policy;
+    struct in6_addr src, dst;
+    uint8_t prefix_len;
+
+    neat_addr_to_in6(candidate->ai_family, &(candidate->src->addr), &src);
+    neat_addr_to_in6(candidate->ai_family, &(candidate->dst_addr), &dst);
+    src_policy = neat_addr_policy_lookup(ctx, &src);
+    dst_policy = neat_addr_policy_lookup(ctx, &dst);
+
+    key->family = candidate->ai_family;
+    key->scope = neat_addr_scope(&dst);
+    key->scope_match = key->scope == neat_addr_scope(&src);
+    key->label_match = src_policy != NULL && dst_policy != NULL &&
+        src_policy->label == dst_policy->label;
+    key->precedence = dst_policy != NULL ? dst_policy->precedence : 0;
+
+    if (candidate->ai_family == AF_INET6) {
+        prefix_len = neat_addr_common_prefix(&src, &dst);
+        key->prefix_len = prefix_len < NEAT_ADDR_SELECT_MAX_PREFIX ?
+            prefix_len : NEAT_ADDR_SELECT_MAX_PREFIX;
+        key->temporary_rank = candidate->src->temporary !=
+            ctx->prefer_temporary;
+    }
+}
+
+//The rules, in the order of RFC 6724, sections 6 and 5. Returns 0 if they do
+//not tell the candidates apart
+static int neat_addr_select_rules(const struct neat_addr_select_key *key_a,
+                                  const struct neat_addr_select_key *key_b)
+{
+    //Rule 2: Prefer matching scope
+    if (key_a->scope_match != key_b->scope_match)
+        return key_a->scope_match ? -1 : 1;
+    //Rule 5: Prefer matching label
+    if (key_a->label_match != key_b->label_match)
+        return key_a->label_match ? -1 : 1;
+    //Rule 6: Prefer higher precedence
+    if (key_a->precedence != key_b->precedence)
+        return key_a->precedence > key_b->precedence ? -1 : 1;
+    //Rule 8: Prefer smaller scope
+    if (key_a->scope != key_b->scope)
+        return key_a->scope < key_b->scope ? -1 : 1;
+    //Rule 9: Use longest matching prefix, between IPv6 addresses only
+    if (key_a->family == AF_INET6 && key_b->family == AF_INET6 &&
+        key_a->prefix_len != key_b->prefix_len)
+        return key_a->prefix_len > key_b->prefix_len ? -1 : 1;
+    //Source rule 7: Prefer temporary addresses, or public ones if so configured
+    if (key_a->temporary_rank != key_b->temporary_rank)
+        return key_a->temporary_rank < key_b->temporary_rank ? -1 : 1;
+
+    return 0;
+}
+
+//Rule 10: Otherwise, leave the order unchanged
+static int neat_addr_select_cmp(const void *a, const void *b)
+{
+    const struct neat_addr_select_key *key_a = a;
+    const struct neat_addr_select_key *key_b = b;
+    int retval = neat_addr_select_rules(key_a, key_b);
+
+    if (retval)
+        return retval;
+
+    return key_a->index < key_b->index ? -1 : (key_a->index > key_b->index);
+}
+
+void neat_addr_select_rank(struct neat_ctx *ctx,
+                           struct neat_resolver_res **candidates,
+                           uint32_t num_candidates, uint32_t *ranks)
+{
+    struct neat_addr_select_key *keys;
+    uint32_t i, rank = 0;
+
+    keys = calloc(num_candidates, sizeof(struct neat_addr_select_key));
+
+    //Without memory, or a table, every candidate is as good as the others
+    if (keys == NULL || neat_addr_policy_init(ctx) != RETVAL_SUCCESS) {
+        memset(ranks, 0, num_candidates * sizeof(uint32_t));
+        free(keys);
+        return;
+    }
+
+    for (i = 0; i < num_candidates; i++) {
+        keys[i].index = i;
+        neat_addr_select_fill_key(ctx, candidates[i], &(keys[i]));
+    }
+
+    qsort(keys, num_candidates, sizeof(struct neat_addr_select_key),
+          neat_addr_select_cmp);
+
+    for (i = 0; i < num_candidates; i++) {
+        if (i && neat_addr_select_rules(&(keys[i - 1]), &(keys[i])))
+            rank++;
+
+        ranks[keys[i].index] = rank;
+    }
+
+    free(keys);
+}
+
+neat_error_code neat_set_address_policy(struct neat_ctx *ctx,
+                                        const char *prefix,
+                                        uint8_t precedence, uint8_t label)
+{
+    struct neat_addr_policy entry, *addr_policy;
+    uint32_t i;
+
+    if (prefix == NULL || neat_addr_policy_parse(prefix, &entry))
+        return NEAT_ERROR_BAD_ARGUMENT;
+
+    if (neat_addr_policy_init(ctx) != RETVAL_SUCCESS)
+        return NEAT_ERROR_INTERNAL;
+
+    entry.precedence = precedence;
+    entry.label = label;
+
+    for (i = 0; i < ctx->addr_policy_cnt; i++) {
+        if (ctx->addr_policy[i].prefix_len == entry.prefix_len &&
+            neat_addr_prefix_match(&(entry.prefix),
+                                   &(ctx->addr_policy[i].prefix),
+                                   entry.prefix_len)) {
+            ctx->addr_policy[i] = entry;
+            return NEAT_OK;
+        }
+    }
+
+    addr_policy = realloc(ctx->addr_policy, (ctx->addr_policy_cnt + 1) *
+                          sizeof(struct neat_addr_policy));
+    if (addr_policy == NULL)
+        return NEAT_ERROR_INTERNAL;
+
+    addr_policy[ctx->addr_policy_cnt++] = entry;
+    ctx->addr_policy = addr_policy;
+    return NEAT_OK;
+}
+
+void neat_reset_address_policy(struct neat_ctx *ctx)
+{
+    free(ctx->addr_policy);
+    ctx->addr_policy = NULL;
+    ctx->addr_policy_cnt = 0;
+}
+
+void neat_set_prefer_temporary(struct neat_ctx *ctx, uint8_t prefer)
+{
+    ctx->prefer_temporary = prefer ? 1 : 0;
+}
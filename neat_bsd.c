@@ -33,6 +33,23 @@ neat_time(void)
 #endif
 }
 
+/* Temporary (RFC 4941) addresses are preferred as source by RFC 6724. */
+static uint8_t
+neat_bsd_addr_temporary(struct neat_ctx *ctx,
+                        const char *if_name,
+                        const struct sockaddr *addr)
+{
+    struct in6_ifreq ifr6;
+
+    memset(&ifr6, 0, sizeof(struct in6_ifreq));
+    strncpy(ifr6.ifr_name, if_name, IF_NAMESIZE);
+    memcpy(&ifr6.ifr_addr, addr, sizeof(struct sockaddr_in6));
+    if (ioctl(ctx->udp6_fd, SIOCGIFAFLAG_IN6, &ifr6) < 0) {
+        return (0);
+    }
+    return ((ifr6.ifr_ifru.ifru_flags6 & IN6_IFF_TEMPORARY) ? 1 : 0);
+}
+
 static void neat_bsd_get_addresses(struct neat_ctx *ctx)
 {
     struct ifaddrs *ifp, *ifa;
@@ -43,6 +60,7 @@ static void neat_bsd_get_addresses(struct neat_ctx *ctx)
     time_t now;
     struct in6_addrlifetime *lifetime;
     uint32_t preferred_lifetime, valid_lifetime;
+    uint8_t temporary;
 
     if (getifaddrs(&ifp) < 0) {
         fprintf(stderr,
@@ -94,7 +112,10 @@ static void neat_bsd_get_addresses(struct neat_ctx *ctx)
         if (ifa->ifa_addr->sa_family == AF_INET) {
             preferred_lifetime = 0;
             valid_lifetime = 0;
+            temporary = 0;
         } else {
+            temporary = neat_bsd_addr_temporary(ctx, cached_ifname,
+                                                ifa->ifa_addr);
             memset(&ifr6, 0, sizeof(struct in6_ifreq));
             strncpy(ifr6.ifr_name, cached_ifname, IF_NAMESIZE);
             memcpy(&ifr6.ifr_addr, ifa->ifa_addr, sizeof(struct sockaddr_in6));
@@ -123,7 +144,8 @@ static void neat_bsd_get_addresses(struct neat_ctx *ctx)
                                   cached_ifindex,
                                   1,
                                   preferred_lifetime,
-                                  valid_lifetime);
+                                  valid_lifetime,
+                                  temporary);
     }
     freeifaddrs(ifp);
 }
@@ -185,6 +207,7 @@ static void neat_bsd_route_recv(uv_udp_t *handle,
     time_t now;
     struct in6_addrlifetime *lifetime;
     uint32_t preferred_lifetime, valid_lifetime;
+    uint8_t temporary;
 
     ctx = (struct neat_ctx *)handle->data;
     ifa = (struct ifa_msghdr *)buf->base;
@@ -196,6 +219,7 @@ static void neat_bsd_route_recv(uv_udp_t *handle,
         (ifa->ifam_type == RTM_DELADDR)) {
         preferred_lifetime = 0;
         valid_lifetime = 0;
+        temporary = 0;
     } else {
         if (if_indextoname(ifa->ifam_index, if_name) == NULL) {
             fprintf(stderr,
@@ -203,6 +227,7 @@ static void neat_bsd_route_recv(uv_udp_t *handle,
                     ifa->ifam_index);
             return;
         }
+        temporary = neat_bsd_addr_temporary(ctx, if_name, rti_info[RTAX_IFA]);
         lifetime = &ifr6.ifr_ifru.ifru_lifetime;
         strncpy(ifr6.ifr_name, if_name, IF_NAMESIZE);
         memcpy(&ifr6.ifr_addr, rti_info[RTAX_IFA], sizeof(struct sockaddr_in6));
@@ -234,7 +259,8 @@ static void neat_bsd_route_recv(uv_udp_t *handle,
                               ifa->ifam_index,
                               ifa->ifam_type == RTM_NEWADDR ? 1 : 0,
                               preferred_lifetime,
-                              valid_lifetime);
+                              valid_lifetime,
+                              temporary);
 }
 
 static void neat_bsd_cleanup(struct neat_ctx *ctx)
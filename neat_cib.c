@@ -0,0 +1,377 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#ifdef HAVE_NETINET_SCTP_H
+#include <netinet/sctp.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+
+#include "neat.h"
+#include "neat_internal.h"
+#include "neat_core.h"
+
+//RTT (ms) assumed for paths we know nothing about
+#define NEAT_CIB_DEFAULT_RTT 100
+//Counters are halved once they pass these limits, so that old observations
+//fade out
+#define NEAT_CIB_MAX_ATTEMPTS 64
+#define NEAT_CIB_MAX_SAMPLED (60 * 1000)
+
+//Smooth like the RTT estimator of RFC 6298, with alpha 1/8
+static uint32_t neat_cib_smooth(uint32_t old, uint32_t sample)
+{
+    if (old == 0)
+        return sample ? sample : 1;
+
+    return old - old / 8 + sample / 8;
+}
+
+static void neat_cib_set_key(struct neat_cib_entry *entry,
+                             const struct neat_resolver_res *candidate)
+{
+    entry->family = candidate->ai_family;
+    entry->protocol = candidate->ai_protocol;
+
+    if (candidate->ai_family == AF_INET) {
+        entry->src.v4 = candidate->src->addr.v4.sin_addr;
+        entry->dst.v4 = candidate->dst_addr.v4.sin_addr;
+    } else {
+        entry->src.v6 = candidate->src->addr.v6.sin6_addr;
+        entry->dst.v6 = candidate->dst_addr.v6.sin6_addr;
+    }
+}
+
+//Find the entry of the path used by candidate. If create is set, a missing
+//entry is added and the entry is moved to the head of the list, the least
+//recently updated path is forgotten when the CIB is full
+static struct neat_cib_entry *neat_cib_lookup(struct neat_ctx *ctx,
+        const struct neat_resolver_res *candidate, uint8_t create)
+{
+    struct neat_cib *cib = &ctx->cib;
+    struct neat_cib_entry key, *entry;
+
+    if (candidate->ai_family != AF_INET && candidate->ai_family != AF_INET6)
+        return NULL;
+
+    memset(&key, 0, sizeof(key));
+    neat_cib_set_key(&key, candidate);
+
+    TAILQ_FOREACH(entry, &cib->entries, next_entry) {
+        if (entry->family == key.family &&
+            entry->protocol == key.protocol &&
+            !memcmp(&entry->src, &key.src, sizeof(key.src)) &&
+            !memcmp(&entry->dst, &key.dst, sizeof(key.dst)))
+            break;
+    }
+
+    if (!create)
+        return entry;
+
+    if (entry != NULL) {
+        TAILQ_REMOVE(&cib->entries, entry, next_entry);
+        TAILQ_INSERT_HEAD(&cib->entries, entry, next_entry);
+        return entry;
+    }
+
+    if (cib->entry_cnt >= NEAT_CIB_SIZE) {
+        entry = TAILQ_LAST(&cib->entries, neat_cib_entries);
+        TAILQ_REMOVE(&cib->entries, entry, next_entry);
+        free(entry);
+        cib->entry_cnt--;
+    }
+
+    entry = calloc(1, sizeof(struct neat_cib_entry));
+    if (entry == NULL)
+        return NULL;
+
+    neat_cib_set_key(entry, candidate);
+    TAILQ_INSERT_HEAD(&cib->entries, entry, next_entry);
+    cib->entry_cnt++;
+    return entry;
+}
+
+void neat_cib_connect_result(struct neat_ctx *ctx,
+                             const struct neat_resolver_res *candidate,
+                             uint8_t success, uint32_t rtt)
+{
+    struct neat_cib_entry *entry = neat_cib_lookup(ctx, candidate, 1);
+
+    if (entry == NULL)
+        return;
+
+    if (success) {
+        entry->successes++;
+        entry->connect_rtt = neat_cib_smooth(entry->connect_rtt, rtt);
+    } else {
+        entry->failures++;
+    }
+
+    if (entry->successes + entry->failures > NEAT_CIB_MAX_ATTEMPTS) {
+        entry->successes /= 2;
+        entry->failures /= 2;
+    }
+}
+
+//Read smoothed RTT (ms) and total number of retransmissions from the
+//transport. Returns RETVAL_FAILURE if the protocol or OS has no statistics
+static uint8_t neat_cib_read_stats(neat_flow *flow, uint32_t *rtt,
+                                   uint32_t *retrans)
+{
+#ifdef TCP_INFO
+    struct tcp_info tcpi;
+#endif
+#if defined(IPPROTO_SCTP) && defined(SCTP_STATUS)
+    struct sctp_status status;
+#ifdef SCTP_GET_ASSOC_STATS
+    struct sctp_assoc_stats stats;
+#endif
+#endif
+    socklen_t len;
+
+    switch (flow->sockProtocol) {
+#ifdef TCP_INFO
+#ifdef IPPROTO_MPTCP
+    case IPPROTO_MPTCP: // reports the first subflow
+#endif
+    case IPPROTO_TCP:
+        len = sizeof(tcpi);
+        if (getsockopt(flow->fd, IPPROTO_TCP, TCP_INFO, &tcpi, &len) < 0)
+            return RETVAL_FAILURE;
+
+        *rtt = tcpi.tcpi_rtt / 1000;
+#if defined(__linux__)
+        *retrans = tcpi.tcpi_total_retrans;
+#elif defined(__FreeBSD__)
+        *retrans = tcpi.tcpi_snd_rexmitpack;
+#else
+        *retrans = flow->cibRetrans;
+#endif
+        return RETVAL_SUCCESS;
+#endif
+#if defined(IPPROTO_SCTP) && defined(SCTP_STATUS)
+    case IPPROTO_SCTP:
+        len = sizeof(status);
+        memset(&status, 0, sizeof(status));
+        if (getsockopt(flow->fd, IPPROTO_SCTP, SCTP_STATUS, &status, &len) < 0)
+            return RETVAL_FAILURE;
+
+        *rtt = status.sstat_primary.spinfo_srtt;
+        *retrans = flow->cibRetrans;
+#ifdef SCTP_GET_ASSOC_STATS
+        len = sizeof(stats);
+        memset(&stats, 0, sizeof(stats));
+        if (getsockopt(flow->fd, IPPROTO_SCTP, SCTP_GET_ASSOC_STATS, &stats,
+                       &len) == 0)
+            *retrans = stats.sas_rtxchunks;
+#endif
+        return RETVAL_SUCCESS;
+#endif
+    default:
+        return RETVAL_FAILURE;
+    }
+}
+
+void neat_cib_sample_flow(struct neat_ctx *ctx, neat_flow *flow, uint8_t force)
+{
+    struct neat_cib_entry *entry;
+    uint64_t now;
+    uint32_t rtt = 0, retrans = 0;
+
+    //Accepted flows did not pick a path, there is nothing to compare against
+    if (flow->cibPath == NULL || flow->fd == -1)
+        return;
+
+    now = uv_now(ctx->loop);
+
+    if (!force && now - flow->cibSampled < NEAT_CIB_SAMPLE_INTERVAL)
+        return;
+
+    if (neat_cib_read_stats(flow, &rtt, &retrans) != RETVAL_SUCCESS)
+        return;
+
+    entry = neat_cib_lookup(ctx, flow->cibPath, 1);
+    if (entry == NULL)
+        return;
+
+    if (rtt)
+        entry->srtt = neat_cib_smooth(entry->srtt, rtt);
+
+    if (retrans > flow->cibRetrans)
+        entry->retrans += retrans - flow->cibRetrans;
+    entry->sampled += now - flow->cibSampled;
+
+    if (entry->sampled > NEAT_CIB_MAX_SAMPLED) {
+        entry->retrans /= 2;
+        entry->sampled /= 2;
+    }
+
+    flow->cibRetrans = retrans;
+    flow->cibSampled = now;
+}
+
+//The score is the RTT of the path, plus one RTT for every retransmission per
+//second, plus the attempt timeout weighted by the share of failed attempts
+uint32_t neat_cib_score(struct neat_ctx *ctx,
+                        const struct neat_resolver_res *candidate)
+{
+    struct neat_cib_entry *entry = neat_cib_lookup(ctx, candidate, 0);
+    uint64_t rtt, score;
+    uint32_t attempts, timeout;
+
+    if (entry == NULL)
+        return NEAT_CIB_DEFAULT_RTT;
+
+    if (entry->srtt)
+        rtt = entry->srtt;
+    else if (entry->connect_rtt)
+        rtt = entry->connect_rtt;
+    else
+        rtt = NEAT_CIB_DEFAULT_RTT;
+
+    score = rtt;
+
+    if (entry->sampled)
+        score += rtt * entry->retrans * 1000 / entry->sampled;
+
+    attempts = entry->successes + entry->failures;
+    if (attempts) {
+        timeout = ctx->he_attempt_timeout ?
+            ctx->he_attempt_timeout : NEAT_HE_ATTEMPT_TIMEOUT;
+        score += (uint64_t) timeout * entry->failures / attempts;
+    }
+
+    return score > UINT32_MAX ? UINT32_MAX : (uint32_t) score;
+}
+
+static struct neat_cib_failure *neat_cib_failure_lookup(struct neat_ctx *ctx,
+        const char *name, int protocol)
+{
+    struct neat_cib_failure *failure;
+
+    TAILQ_FOREACH(failure, &ctx->cib.failures, next_failure) {
+        if (failure->protocol != protocol)
+            continue;
+
+        if (name == NULL ? failure->name == NULL :
+            (failure->name != NULL && !strcmp(failure->name, name)))
+            return failure;
+    }
+
+    return NULL;
+}
+
+static void neat_cib_failure_remove(struct neat_ctx *ctx,
+                                    struct neat_cib_failure *failure)
+{
+    TAILQ_REMOVE(&ctx->cib.failures, failure, next_failure);
+    free(failure);
+    ctx->cib.failure_cnt--;
+}
+
+void neat_cib_protocol_failed(struct neat_ctx *ctx, const char *name,
+                              int protocol)
+{
+    struct neat_cib_failure *failure;
+    size_t name_len = name ? strlen(name) + 1 : 0;
+    uint64_t backoff = NEAT_CIB_BACKOFF_MIN;
+
+    failure = neat_cib_failure_lookup(ctx, name, protocol);
+
+    if (failure != NULL) {
+        TAILQ_REMOVE(&ctx->cib.failures, failure, next_failure);
+    } else {
+        if (ctx->cib.failure_cnt >= NEAT_CIB_SIZE)
+            neat_cib_failure_remove(ctx,
+                    TAILQ_LAST(&ctx->cib.failures, neat_cib_failures));
+
+        //Name is stored right after the entry
+        failure = calloc(1, sizeof(struct neat_cib_failure) + name_len);
+        if (failure == NULL)
+            return;
+
+        if (name != NULL) {
+            failure->name = (char *) (failure + 1);
+            memcpy(failure->name, name, name_len);
+        }
+
+        failure->protocol = protocol;
+        ctx->cib.failure_cnt++;
+    }
+
+    if (failure->failures < 32)
+        failure->failures++;
+
+    backoff <<= failure->failures - 1;
+    if (backoff > NEAT_CIB_BACKOFF_MAX)
+        backoff = NEAT_CIB_BACKOFF_MAX;
+
+    failure->until = uv_now(ctx->loop) + 1000 * backoff;
+    TAILQ_INSERT_HEAD(&ctx->cib.failures, failure, next_failure);
+}
+
+void neat_cib_protocol_usable(struct neat_ctx *ctx, const char *name,
+                              int protocol)
+{
+    struct neat_cib_failure *failure;
+
+    if ((failure = neat_cib_failure_lookup(ctx, name, protocol)) != NULL)
+        neat_cib_failure_remove(ctx, failure);
+    if ((failure = neat_cib_failure_lookup(ctx, NULL, protocol)) != NULL)
+        neat_cib_failure_remove(ctx, failure);
+}
+
+//Expired entries are kept, so that the backoff keeps growing if the protocol
+//fails again when it is retried
+static uint8_t neat_cib_protocol_blocked(struct neat_ctx *ctx,
+                                         const char *name, int protocol,
+                                         uint64_t now)
+{
+    struct neat_cib_failure *failure;
+
+    failure = neat_cib_failure_lookup(ctx, NULL, protocol);
+    if (failure != NULL && failure->until > now)
+        return 1;
+
+    failure = neat_cib_failure_lookup(ctx, name, protocol);
+    return failure != NULL && failure->until > now;
+}
+
+uint8_t neat_cib_prune_protocols(struct neat_ctx *ctx, const char *name,
+                                 int protocols[], uint8_t proto_count)
+{
+    int usable[NEAT_MAX_NUM_PROTO];
+    uint64_t now = uv_now(ctx->loop);
+    uint8_t i, usable_cnt = 0;
+
+    if (TAILQ_EMPTY(&ctx->cib.failures))
+        return proto_count;
+
+    for (i = 0; i < proto_count; i++)
+        if (!neat_cib_protocol_blocked(ctx, name, protocols[i], now))
+            usable[usable_cnt++] = protocols[i];
+
+    //Better to retry early than to not try at all
+    if (usable_cnt == 0)
+        return proto_count;
+
+    memcpy(protocols, usable, usable_cnt * sizeof(int));
+    return usable_cnt;
+}
+
+void neat_cib_cleanup(struct neat_ctx *ctx)
+{
+    struct neat_cib_entry *entry;
+    struct neat_cib_failure *failure;
+
+    while ((entry = TAILQ_FIRST(&ctx->cib.entries)) != NULL) {
+        TAILQ_REMOVE(&ctx->cib.entries, entry, next_entry);
+        free(entry);
+    }
+
+    while ((failure = TAILQ_FIRST(&ctx->cib.failures)) != NULL)
+        neat_cib_failure_remove(ctx, failure);
+
+    ctx->cib.entry_cnt = 0;
+}
@@ -55,6 +55,33 @@ struct neat_ctx *neat_init_ctx()
                    1000 * NEAT_ADDRESS_LIFETIME_TIMEOUT,
                    1000 * NEAT_ADDRESS_LIFETIME_TIMEOUT);
 
+    nc->he_delay = NEAT_HE_DELAY;
+    nc->he_attempt_timeout = NEAT_HE_ATTEMPT_TIMEOUT;
+    nc->he_deadline = NEAT_HE_DEADLINE;
+    TAILQ_INIT(&(nc->he_cache));
+    LIST_INIT(&(nc->if_loads));
+    TAILQ_INIT(&(nc->cib.entries));
+    TAILQ_INIT(&(nc->cib.failures));
+    LIST_INIT(&(nc->pools));
+    TAILQ_INIT(&(nc->dns_cache));
+    nc->dns_refresh_hits = NEAT_RESOLVER_REFRESH_HITS;
+    uv_timer_init(nc->loop, &(nc->dns_refresh_handle));
+    nc->dns_refresh_handle.data = nc;
+    LIST_INIT(&(nc->resolver_prefetches));
+    LIST_INIT(&(nc->dns_sockets));
+    TAILQ_INIT(&(nc->dns_servers));
+    nc->resolver_max_queries = NEAT_RESOLVER_MAX_QUERIES;
+    nc->resolver_per_if = 1;
+    nc->dns_rto = NEAT_RESOLVER_RTO;
+    nc->max_answers = NEAT_RESOLVER_MAX_ANSWERS;
+    nc->prefer_temporary = 1;
+    LIST_INIT(&(nc->resolver_lookups));
+    TAILQ_INIT(&(nc->resolver_deliveries));
+    nc->pool_idle_timeout = NEAT_POOL_IDLE_TIMEOUT;
+    uv_timer_init(nc->loop, &(nc->pool_handle));
+    nc->pool_handle.data = nc;
+    neat_resolver_conf_init(nc);
+
 #if defined(__linux__)
     return neat_linux_init_ctx(nc);
 #elif defined(__FreeBSD__) || defined(__NetBSD__) || defined(__APPLE__)
@@ -114,6 +141,10 @@ static void neat_core_cleanup(struct neat_ctx *nc)
 //TODO: Consider adding callback, like for resolver
 void neat_free_ctx(struct neat_ctx *nc)
 {
+    //Pooled flows and DNS sockets are closed by the loop, so this has to come
+    //first
+    neat_pool_cleanup(nc);
+    neat_resolver_sockets_close(nc);
     neat_core_cleanup(nc);
 
     if (nc->resolver) {
@@ -121,9 +152,20 @@ void neat_free_ctx(struct neat_ctx *nc)
         free(nc->resolver);
     }
 
+    neat_resolver_prefetch_cleanup(nc);
+
     if(nc->event_cbs)
         free(nc->event_cbs);
 
+    neat_he_cleanup(nc);
+    neat_cib_cleanup(nc);
+    neat_resolver_cache_flush(nc);
+    neat_resolver_servers_flush(nc);
+    neat_resolver_conf_cleanup(nc);
+    free(nc->if_include);
+    free(nc->if_exclude);
+    free(nc->addr_policy);
+
     free(nc->loop);
     free(nc);
 }
@@ -216,9 +258,8 @@ void neat_run_event_cb(struct neat_ctx *nc, uint8_t event_type,
         cb_itr->event_cb(nc, cb_itr->data, data);
 }
 
-static void free_cb(uv_handle_t *handle)
+static void free_flow(neat_flow *flow)
 {
-    neat_flow *flow = handle->data;
     flow->closefx(flow->ctx, flow);
     free((char *)flow->name);
     free((char *)flow->port);
@@ -240,16 +281,26 @@ static void free_cb(uv_handle_t *handle)
     free(flow);
 }
 
+static void free_cb(uv_handle_t *handle)
+{
+    free_flow((neat_flow *) handle->data);
+}
+
 void neat_free_flow(neat_flow *flow)
 {
     //struct neat_buffered_message *msg, *next_msg;
 
+    neat_he_flow_closed(flow);
+    neat_cib_sample_flow(flow->ctx, flow, 1);
+
     if (flow->isPolling)
         uv_poll_stop(flow->handle);
 
     if ((flow->handle != NULL) &&
         (flow->handle->type != UV_UNKNOWN_HANDLE))
         uv_close((uv_handle_t *)flow->handle, free_cb);
+    else
+        free_flow(flow); // never connected, nothing for libuv to clean up
 
     return;
 }
@@ -290,6 +341,11 @@ static void io_error(neat_ctx *ctx, neat_flow *flow,
     flow->operations->on_error(flow->operations);
 }
 
+void neat_io_error(neat_ctx *ctx, neat_flow *flow, neat_error_code code)
+{
+    io_error(ctx, flow, code);
+}
+
 static void io_connected(neat_ctx *ctx, neat_flow *flow,
                          neat_error_code code)
 {
@@ -395,7 +451,9 @@ static void updatePollHandle(neat_ctx *ctx, neat_flow *flow, uv_poll_t *handle)
     }
 
     int newEvents = 0;
-    if (flow->operations && flow->operations->on_readable) {
+    //Nothing can be read before the first write has connected the flow
+    if (flow->operations && flow->operations->on_readable &&
+        !flow->isTFODeferred) {
         newEvents |= UV_READABLE;
     }
     if (flow->operations && flow->operations->on_writable) {
@@ -420,11 +478,19 @@ he_connected_cb(uv_poll_t *handle, int status, int events)
 {
     struct he_cb_ctx *he_ctx = (struct he_cb_ctx *) handle->data;
     neat_flow *flow = he_ctx->flow;
+    int so_error = 0;
+    socklen_t len = sizeof(so_error);
+
+    //A refused or unreachable connect is also signalled as writable, the
+    //outcome is only available through SO_ERROR
+    if ((status == 0) &&
+        (getsockopt(he_ctx->fd, SOL_SOCKET, SO_ERROR, &so_error, &len) < 0))
+        so_error = errno;
 
     //TODO: Final place to filter based on policy
-    //TODO: This one uses the first result, so is wrong
-    if (flow->hefirstConnect && (status == 0)) {
+    if (flow->hefirstConnect && (status == 0) && (so_error == 0)) {
         flow->hefirstConnect = 0;
+        neat_he_attempt_won(he_ctx);
         flow->family = he_ctx->candidate->ai_family;
         flow->sockType = he_ctx->candidate->ai_socktype;
         flow->sockProtocol = he_ctx->candidate->ai_protocol;
@@ -437,8 +503,12 @@ he_connected_cb(uv_poll_t *handle, int status, int events)
         flow->writeLimit = he_ctx->writeLimit;
         flow->readSize = he_ctx->readSize;
         flow->isSCTPExplicitEOR = he_ctx->isSCTPExplicitEOR;
+        flow->isTFODeferred = he_ctx->isTFODeferred;
+        flow->sockAddr = (struct sockaddr *) &(he_ctx->candidate->dst_addr);
         flow->firstWritePending = 1;
         flow->isPolling = 1;
+        flow->cibPath = he_ctx->candidate;
+        flow->cibSampled = uv_now(flow->ctx->loop);
 
         free(he_ctx);
 
@@ -446,10 +516,7 @@ he_connected_cb(uv_poll_t *handle, int status, int events)
 
         uvpollable_cb(handle, NEAT_OK, UV_WRITABLE);
     } else {
-        flow->closefx(he_ctx->nc, flow);
-        uv_poll_stop(handle);
-        uv_close((uv_handle_t*)handle, NULL);
-        free(he_ctx);
+        neat_he_attempt_failed(he_ctx);
     }
 }
 
@@ -463,6 +530,8 @@ static void uvpollable_cb(uv_poll_t *handle, int status, int events)
         return;
     }
 
+    neat_cib_sample_flow(ctx, flow, 0);
+
     // TODO: Check error in status
     if ((events & UV_WRITABLE) && flow->firstWritePending) {
         flow->firstWritePending = 0;
@@ -487,6 +556,19 @@ static void uvpollable_cb(uv_poll_t *handle, int status, int events)
     updatePollHandle(ctx, flow, flow->handle);
 }
 
+void neat_flow_update_poll(neat_flow *flow)
+{
+    updatePollHandle(flow->ctx, flow, flow->handle);
+}
+
+void neat_flow_resume(neat_flow *flow)
+{
+    //The socket is writable, so on_connected is called by the next iteration
+    flow->firstWritePending = 1;
+    flow->isPolling = 1;
+    uv_poll_start(flow->handle, UV_WRITABLE, uvpollable_cb);
+}
+
 static void do_accept(neat_ctx *ctx, neat_flow *flow)
 {
     neat_flow *newFlow = neat_new_flow(ctx);
@@ -540,12 +622,20 @@ neat_open(neat_ctx *mgr, neat_flow *flow, const char *name, const char *port)
     return neat_he_lookup(mgr, flow, he_connected_cb);
 }
 
+static void accept_resolver_cleanup_cb(struct neat_resolver *resolver)
+{
+    free(resolver);
+}
+
 static void
 accept_resolve_cb(struct neat_resolver *resolver, struct neat_resolver_results *results, uint8_t code)
 {
     neat_flow *flow = (neat_flow *)resolver->userData1;
     struct neat_ctx *ctx = flow->ctx;
 
+    neat_resolver_release(resolver);
+    flow->resolver = NULL;
+
     if (code != NEAT_RESOLVER_OK) {
         io_error(ctx, flow, code);
         return;
@@ -565,12 +655,7 @@ accept_resolve_cb(struct neat_resolver *resolver, struct neat_resolver_results *
     flow->handle->data = flow;
     uv_poll_init(ctx->loop, flow->handle, flow->fd);
 
-#if defined (IPPROTO_SCTP)
-    if ((flow->sockProtocol == IPPROTO_SCTP) ||
-        (flow->sockProtocol == IPPROTO_TCP)) {
-#else
-    if (flow->sockProtocol == IPPROTO_TCP) {
-#endif
+    if (flow->sockType == SOCK_STREAM) {
         flow->isPolling = 1;
         flow->acceptPending = 1;
         uv_poll_start(flow->handle, UV_READABLE, uvpollable_cb);
@@ -583,7 +668,7 @@ accept_resolve_cb(struct neat_resolver *resolver, struct neat_resolver_results *
 neat_error_code neat_accept(struct neat_ctx *ctx, struct neat_flow *flow,
                             const char *name, const char *port)
 {
-    int protocols[NEAT_MAX_NUM_PROTO]; /* We only support SCTP, TCP, UDP, and UDPLite */
+    int protocols[NEAT_MAX_NUM_PROTO]; /* We only support SCTP, MPTCP, TCP, UDP, and UDPLite */
     uint8_t nr_of_protocols = neat_property_translate_protocols(
             flow->propertyMask, protocols);
 
@@ -603,13 +688,19 @@ neat_error_code neat_accept(struct neat_ctx *ctx, struct neat_flow *flow,
     flow->handle = (uv_poll_t *) malloc(sizeof(uv_poll_t));
     assert(flow->handle != NULL);
 
-    if (!ctx->resolver)
-        ctx->resolver = neat_resolver_init(ctx, accept_resolve_cb, NULL);
+    flow->resolver = neat_resolver_init(ctx, accept_resolve_cb,
+                                        accept_resolver_cleanup_cb);
+    if (flow->resolver == NULL)
+        return NEAT_ERROR_INTERNAL;
 
-    ctx->resolver->userData1 = (void *)flow;
+    flow->resolver->userData1 = (void *)flow;
 
-    neat_getaddrinfo(ctx->resolver, AF_INET, flow->name, flow->port,
-                     protocols, nr_of_protocols);
+    if (neat_getaddrinfo(flow->resolver, AF_INET, flow->name, flow->port,
+                         protocols, nr_of_protocols)) {
+        neat_resolver_release(flow->resolver);
+        flow->resolver = NULL;
+        return NEAT_ERROR_BAD_ARGUMENT;
+    }
     return NEAT_OK;
 }
 
@@ -731,7 +822,12 @@ neat_write_via_kernel_fillbuffer(struct neat_ctx *ctx, struct neat_flow *flow,
         return NEAT_OK;
     }
 
-    if ((flow->sockProtocol != IPPROTO_TCP) || TAILQ_EMPTY(&flow->bufferedMessages)) {
+    //Byte streams (TCP and MPTCP) keep appending to the last message
+    if ((flow->sockType != SOCK_STREAM) ||
+#ifdef IPPROTO_SCTP
+        (flow->sockProtocol == IPPROTO_SCTP) ||
+#endif
+        TAILQ_EMPTY(&flow->bufferedMessages)) {
         msg = malloc(sizeof(struct neat_buffered_message));
         if (msg == NULL) {
             return NEAT_ERROR_INTERNAL;
@@ -776,6 +872,38 @@ neat_write_via_kernel_fillbuffer(struct neat_ctx *ctx, struct neat_flow *flow,
     return NEAT_OK;
 }
 
+#ifdef MSG_FASTOPEN
+//First write on a flow that has not connected yet. If the server gave us a
+//cookie earlier, the data goes out in the SYN. Otherwise only the SYN is sent,
+//and the data is buffered until the handshake is done
+static ssize_t
+neat_write_fastopen(struct neat_flow *flow, struct msghdr *msghdr)
+{
+    ssize_t rv;
+    socklen_t slen =
+            (flow->family == AF_INET) ? sizeof (struct sockaddr_in) : sizeof (struct sockaddr_in6);
+
+    flow->isTFODeferred = 0;
+    msghdr->msg_name = (void *) flow->sockAddr;
+    msghdr->msg_namelen = slen;
+
+    rv = sendmsg(flow->fd, (const struct msghdr *)msghdr, MSG_FASTOPEN);
+    if (rv >= 0)
+        return rv;
+
+    //Fast Open is disabled on this host, connect the regular way
+    if (errno == EOPNOTSUPP &&
+        connect(flow->fd, flow->sockAddr, slen) == -1 &&
+        errno != EINPROGRESS)
+        return -1;
+
+    if (errno == EOPNOTSUPP || errno == EINPROGRESS)
+        errno = EWOULDBLOCK;
+
+    return -1;
+}
+#endif
+
 static neat_error_code
 neat_write_via_kernel(struct neat_ctx *ctx, struct neat_flow *flow,
                       const unsigned char *buffer, uint32_t amt)
@@ -798,6 +926,9 @@ neat_write_via_kernel(struct neat_ctx *ctx, struct neat_flow *flow,
 
     switch (flow->sockProtocol) {
     case IPPROTO_TCP:
+#ifdef IPPROTO_MPTCP
+    case IPPROTO_MPTCP:
+#endif
         atomic = 0;
         break;
 #ifdef IPPROTO_SCTP
@@ -888,6 +1019,11 @@ neat_write_via_kernel(struct neat_ctx *ctx, struct neat_flow *flow,
         msghdr.msg_controllen = 0;
 #endif
         msghdr.msg_flags = 0;
+#ifdef MSG_FASTOPEN
+        if (flow->isTFODeferred)
+            rv = neat_write_fastopen(flow, &msghdr);
+        else
+#endif
         rv = sendmsg(flow->fd, (const struct msghdr *)&msghdr, 0);
         if (rv < 0 ) {
             if (errno != EWOULDBLOCK) {
@@ -961,6 +1097,8 @@ neat_connect_via_kernel(struct he_cb_ctx *he_ctx, uv_poll_cb callback_fx)
             (he_ctx->candidate->ai_family == AF_INET) ? sizeof (struct sockaddr_in) : sizeof (struct sockaddr_in6);
 
     he_ctx->fd = socket(he_ctx->candidate->ai_family, he_ctx->candidate->ai_socktype, he_ctx->candidate->ai_protocol);
+    if (he_ctx->fd == -1)
+        return -1;
     len = (socklen_t)sizeof(int);
     if (getsockopt(he_ctx->fd, SOL_SOCKET, SO_SNDBUF, &size, &len) == 0) {
         he_ctx->writeSize = size;
@@ -976,7 +1114,35 @@ neat_connect_via_kernel(struct he_cb_ctx *he_ctx, uv_poll_cb callback_fx)
     switch (he_ctx->candidate->ai_protocol) {
         case IPPROTO_TCP:
             setsockopt(he_ctx->fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(int));
+            if ((he_ctx->flow->propertyMask & NEAT_PROPERTY_TCP_FASTOPEN) == 0)
+                break;
+#ifdef TCP_FASTOPEN_CONNECT
+            //connect returns at once when we hold a cookie for the server, and
+            //the SYN goes out with the first write. Without a cookie the kernel
+            //does a regular handshake
+            if (setsockopt(he_ctx->fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &enable, sizeof(int)) == 0)
+                break;
+#endif
+#ifdef MSG_FASTOPEN
+            //Older kernels, connect with MSG_FASTOPEN on the first write. The
+            //attempt then completes without a round trip, so this is only done
+            //for the last candidate. Others do a regular handshake
+            if (he_ctx->mayDefer)
+                he_ctx->isTFODeferred = 1;
+#endif
+            break;
+#ifdef IPPROTO_MPTCP
+        case IPPROTO_MPTCP:
+            //The kernel falls back to plain TCP on the same socket if the
+            //peer or a middlebox does not support MPTCP
+            setsockopt(he_ctx->fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(int));
+#ifdef TCP_FASTOPEN_CONNECT
+            //Kernels without Fast Open for MPTCP do a regular handshake
+            if (he_ctx->flow->propertyMask & NEAT_PROPERTY_TCP_FASTOPEN)
+                setsockopt(he_ctx->fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &enable, sizeof(int));
+#endif
             break;
+#endif
 #ifdef IPPROTO_SCTP
         case IPPROTO_SCTP:
             he_ctx->writeLimit =  he_ctx->writeSize / 4;
@@ -992,9 +1158,28 @@ neat_connect_via_kernel(struct he_cb_ctx *he_ctx, uv_poll_cb callback_fx)
         default:
             break;
     }
+#ifdef IP_BIND_ADDRESS_NO_PORT
+    //Leave port selection to connect, so that binding the source address
+    //does not reserve one ephemeral port per source address
+    setsockopt(he_ctx->fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &enable, sizeof(int));
+#endif
+    //Use the source address the candidate was resolved for, instead of the one
+    //picked by the routing table. SCTP is left unbound, so that the association
+    //can use all local addresses
+#ifdef IPPROTO_SCTP
+    if (he_ctx->candidate->ai_protocol != IPPROTO_SCTP)
+#endif
+        if (bind(he_ctx->fd, (struct sockaddr *) &(he_ctx->candidate->src->addr),
+                 he_ctx->candidate->src->addr_len) == -1)
+            return -1;
     uv_poll_init(he_ctx->nc->loop, he_ctx->handle, he_ctx->fd); // makes fd nb as side effect
-    if ((he_ctx->fd == -1) ||
-        (connect(he_ctx->fd, (struct sockaddr *) &(he_ctx->candidate->dst_addr), slen) && (errno != EINPROGRESS))) {
+    //The unconnected socket is writable right away, so the attempt completes
+    //without a round trip
+    if (he_ctx->isTFODeferred) {
+        uv_poll_start(he_ctx->handle, UV_WRITABLE, callback_fx);
+        return 0;
+    }
+    if (connect(he_ctx->fd, (struct sockaddr *) &(he_ctx->candidate->dst_addr), slen) && (errno != EINPROGRESS)) {
         return -1;
     }
     uv_poll_start(he_ctx->handle, UV_WRITABLE, callback_fx);
@@ -1022,6 +1207,13 @@ neat_listen_via_kernel(struct neat_ctx *ctx, struct neat_flow *flow)
         (flow->family == AF_INET) ? sizeof (struct sockaddr_in) : sizeof (struct sockaddr_in6);
 
     flow->fd = socket(flow->family, flow->sockType, flow->sockProtocol);
+#ifdef IPPROTO_MPTCP
+    //Listen for plain TCP if the kernel does not support MPTCP
+    if ((flow->fd == -1) && (flow->sockProtocol == IPPROTO_MPTCP)) {
+        flow->sockProtocol = IPPROTO_TCP;
+        flow->fd = socket(flow->family, flow->sockType, flow->sockProtocol);
+    }
+#endif
     len = (socklen_t)sizeof(int);
     if (getsockopt(flow->fd, SOL_SOCKET, SO_SNDBUF, &size, &len) == 0) {
         flow->writeSize = size;
@@ -1036,6 +1228,9 @@ neat_listen_via_kernel(struct neat_ctx *ctx, struct neat_flow *flow)
     }
     switch (flow->sockProtocol) {
     case IPPROTO_TCP:
+#ifdef IPPROTO_MPTCP
+    case IPPROTO_MPTCP:
+#endif
         setsockopt(flow->fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(int));
         break;
 #ifdef IPPROTO_SCTP
@@ -1113,5 +1308,6 @@ neat_flow *neat_new_flow(neat_ctx *mgr)
     rv->listenfx = neat_listen_via_kernel;
     rv->shutdownfx = neat_shutdown_via_kernel;
     TAILQ_INIT(&rv->bufferedMessages);
+    LIST_INIT(&rv->heAttempts);
     return rv;
 }
@@ -5,10 +5,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <errno.h>
 #include <unistd.h>
 
 #include "neat.h"
 #include "neat_internal.h"
+#include "neat_core.h"
 #include "neat_property_helpers.h"
 
 static void he_print_results(struct neat_resolver_results *results)
@@ -26,6 +28,11 @@ static void he_print_results(struct neat_resolver_results *results)
         case IPPROTO_TCP:
             fprintf(stderr, "TCP/");
             break;
+#ifdef IPPROTO_MPTCP
+        case IPPROTO_MPTCP:
+            fprintf(stderr, "MPTCP/");
+            break;
+#endif
 #ifdef IPPROTO_SCTP
         case IPPROTO_SCTP:
             fprintf(stderr, "SCTP/");
@@ -51,7 +58,7 @@ static void he_print_results(struct neat_resolver_results *results)
             fprintf(stderr, "family%d", result->ai_family);
             break;
         }
-        getnameinfo((struct sockaddr *)&result->src_addr, result->src_addr_len,
+        getnameinfo((struct sockaddr *)&result->src->addr, result->src->addr_len,
                     addr_name, sizeof(addr_name),
                     serv_name, sizeof(serv_name),
                     NI_NUMERICHOST | NI_NUMERICSERV);
@@ -80,7 +87,6 @@ pm_filter(struct neat_resolver_results *results)
             (tmp_itr1->ai_family != AF_INET)) {
 
             LIST_REMOVE(tmp_itr1, next_res);
-            free(tmp_itr1);
 
         } else {
 
@@ -91,10 +97,9 @@ pm_filter(struct neat_resolver_results *results)
                 if ((tmp_itr1->ai_protocol == tmp_itr2->ai_protocol) &&
                     (memcmp(&tmp_itr1->dst_addr,
                             &tmp_itr2->dst_addr,
-                            sizeof(struct sockaddr_storage)) == 0)) {
+                            sizeof(tmp_itr1->dst_addr)) == 0)) {
 
                     LIST_REMOVE(tmp_itr1, next_res);
-                    free(tmp_itr1);
                     break;
 
                 }
@@ -107,61 +112,762 @@ pm_filter(struct neat_resolver_results *results)
 }
 #endif
 
-static void
-he_resolve_cb(struct neat_resolver *resolver, struct neat_resolver_results *results, uint8_t code)
+//Sort key used when ordering the Happy Eyeballs candidates
+struct he_candidate_key {
+    struct neat_resolver_res *candidate;
+    uint32_t rank;
+    uint32_t bucket;
+    uint32_t pref;
+    uint32_t addr_rank;
+    uint32_t score;
+    uint32_t bucket_score;
+    uint32_t index;
+};
+
+//Order within a bucket, most preferred first
+static int he_candidate_pref_cmp(const void *a, const void *b)
 {
-    neat_flow *flow = (neat_flow *)resolver->userData1;
-    uv_poll_cb callback_fx;
-    callback_fx = (uv_poll_cb) (neat_flow *)resolver->userData2;
+    const struct he_candidate_key *key_a = a;
+    const struct he_candidate_key *key_b = b;
 
-    assert (results->lh_first);
-    assert (!flow->resolver_results);
+    if (key_a->bucket != key_b->bucket)
+        return key_a->bucket < key_b->bucket ? -1 : 1;
+    if (key_a->pref != key_b->pref)
+        return key_a->pref < key_b->pref ? -1 : 1;
+    if (key_a->addr_rank != key_b->addr_rank)
+        return key_a->addr_rank < key_b->addr_rank ? -1 : 1;
+    if (key_a->score != key_b->score)
+        return key_a->score < key_b->score ? -1 : 1;
+    return key_a->index < key_b->index ? -1 : (key_a->index > key_b->index);
+}
 
-    /* TODO: Used by Karl-Johan Grinnemo during test. Remove in final version. */
-#if 0
-    pm_filter(results);
-    he_print_results(results);
-#endif
+//Order of the attempts, interleaving the buckets
+static int he_candidate_cmp(const void *a, const void *b)
+{
+    const struct he_candidate_key *key_a = a;
+    const struct he_candidate_key *key_b = b;
 
-    flow->resolver_results = results;
-    flow->hefirstConnect = 1;
-    struct neat_resolver_res *candidate;
+    if (key_a->rank != key_b->rank)
+        return key_a->rank < key_b->rank ? -1 : 1;
+    if (key_a->bucket_score != key_b->bucket_score)
+        return key_a->bucket_score < key_b->bucket_score ? -1 : 1;
+    if (key_a->bucket != key_b->bucket)
+        return key_a->bucket < key_b->bucket ? -1 : 1;
+    return key_a->index < key_b->index ? -1 : (key_a->index > key_b->index);
+}
+
+static struct neat_if_load *he_if_load_lookup(struct neat_ctx *ctx,
+                                              uint32_t if_idx)
+{
+    struct neat_if_load *if_load;
+
+    LIST_FOREACH(if_load, &ctx->if_loads, next_if_load)
+        if (if_load->if_idx == if_idx)
+            return if_load;
+
+    return NULL;
+}
+
+//Preference (lower is better) of the source interface of a candidate,
+//according to the source policy of the context
+static uint32_t he_source_pref(struct neat_ctx *ctx,
+                               struct neat_resolver_res *candidate,
+                               uint32_t *if_idxs, uint32_t num_ifs,
+                               uint32_t rr_offset)
+{
+    struct neat_if_load *if_load;
+    uint32_t i;
+
+    switch (ctx->source_policy) {
+    case NEAT_SOURCE_POLICY_ROUND_ROBIN:
+        for (i = 0; i < num_ifs; i++)
+            if (if_idxs[i] == candidate->src->if_idx)
+                break;
+        return (i + num_ifs - rr_offset) % num_ifs;
+    case NEAT_SOURCE_POLICY_LEAST_LOADED:
+        if_load = he_if_load_lookup(ctx, candidate->src->if_idx);
+        return if_load ? if_load->flows : 0;
+    default:
+        return 0;
+    }
+}
+
+//Order the candidates the way they will be attempted (RFC 8305, section 4).
+//Candidates are grouped in buckets by protocol (in the preference order
+//returned by neat_property_translate_protocols) and family (the family of the
+//path RFC 6724 prefers first), and ordered within a bucket by the source
+//policy, then by RFC 6724 address selection and then by the CIB score. The
+//buckets are then interleaved, starting with the bucket holding the
+//historically fastest path, so that the first attempts cover as many
+//different protocols and families as possible
+static void he_order_candidates(neat_flow *flow,
+                                struct neat_resolver_results *results)
+{
+    struct neat_ctx *ctx = flow->ctx;
+    int protocols[NEAT_MAX_NUM_PROTO];
+    struct he_candidate_key *keys;
+    struct neat_resolver_res *candidate, **candidates;
+    uint32_t bucket_scores[NEAT_MAX_NUM_PROTO * 2];
+    uint32_t *if_idxs, *addr_ranks;
+    uint8_t nr_of_protocols, first_family = AF_INET6, i;
+    uint32_t num_candidates = 0, num_ifs = 0, rr_offset = 0, rank = 0, j;
+
+    nr_of_protocols = neat_property_translate_protocols(flow->propertyMask,
+            protocols);
+
+    LIST_FOREACH(candidate, results, next_res)
+        num_candidates++;
+
+    if (num_candidates < 2)
+        return;
+
+    //Keep resolver order if we can't sort, it is still a valid order
+    keys = calloc(num_candidates, sizeof(struct he_candidate_key));
+    if_idxs = calloc(num_candidates, sizeof(uint32_t));
+    addr_ranks = calloc(num_candidates, sizeof(uint32_t));
+    candidates = calloc(num_candidates, sizeof(struct neat_resolver_res *));
+
+    if (keys == NULL || if_idxs == NULL || addr_ranks == NULL ||
+        candidates == NULL) {
+        free(keys);
+        free(if_idxs);
+        free(addr_ranks);
+        free(candidates);
+        return;
+    }
+
+    num_candidates = 0;
+    LIST_FOREACH(candidate, results, next_res)
+        candidates[num_candidates++] = candidate;
+
+    neat_addr_select_rank(ctx, candidates, num_candidates, addr_ranks);
+
+    for (j = 0; j < num_candidates; j++) {
+        if (!addr_ranks[j]) {
+            first_family = candidates[j]->ai_family;
+            break;
+        }
+    }
+
+    //Round-robin rotates over the interfaces seen among the candidates, the
+    //start interface moves one step for every race
     LIST_FOREACH(candidate, results, next_res) {
+        for (j = 0; j < num_ifs; j++)
+            if (if_idxs[j] == candidate->src->if_idx)
+                break;
+
+        if (j == num_ifs)
+            if_idxs[num_ifs++] = candidate->src->if_idx;
+    }
+
+    if (ctx->source_policy == NEAT_SOURCE_POLICY_ROUND_ROBIN)
+        rr_offset = ctx->source_rr_cnt++ % num_ifs;
+
+    for (j = 0; j < NEAT_MAX_NUM_PROTO * 2; j++)
+        bucket_scores[j] = UINT32_MAX;
+
+    num_candidates = 0;
+
+    LIST_FOREACH(candidate, results, next_res) {
+        for (i = 0; i < nr_of_protocols; i++)
+            if (protocols[i] == candidate->ai_protocol)
+                break;
+
+        if (i == nr_of_protocols)
+            i = NEAT_MAX_NUM_PROTO - 1;
+
+        keys[num_candidates].candidate = candidate;
+        keys[num_candidates].bucket =
+            i * 2 + (candidate->ai_family == first_family ? 0 : 1);
+        keys[num_candidates].pref = he_source_pref(ctx, candidate, if_idxs,
+                num_ifs, rr_offset);
+        keys[num_candidates].addr_rank = addr_ranks[num_candidates];
+        keys[num_candidates].score = neat_cib_score(ctx, candidate);
+        keys[num_candidates].index = num_candidates;
+
+        j = keys[num_candidates].bucket;
+        if (keys[num_candidates].score < bucket_scores[j])
+            bucket_scores[j] = keys[num_candidates].score;
+
+        num_candidates++;
+    }
+
+    qsort(keys, num_candidates, sizeof(struct he_candidate_key),
+          he_candidate_pref_cmp);
+
+    for (j = 0; j < num_candidates; j++) {
+        if (j && keys[j].bucket != keys[j - 1].bucket)
+            rank = 0;
+
+        keys[j].rank = rank++;
+        keys[j].bucket_score = bucket_scores[keys[j].bucket];
+    }
+
+    qsort(keys, num_candidates, sizeof(struct he_candidate_key),
+          he_candidate_cmp);
+
+    LIST_INIT(results);
+    while (num_candidates--)
+        LIST_INSERT_HEAD(results, keys[num_candidates].candidate, next_res);
+
+    free(if_idxs);
+    free(addr_ranks);
+    free(candidates);
+    free(keys);
+}
+
+static void he_free_handle_cb(uv_handle_t *handle)
+{
+    free(handle);
+}
+
+//Release the socket and poll handle of an attempt that will not be used. The
+//attempt must not be in the registry of the flow
+static void he_close_attempt(struct he_cb_ctx *he_ctx)
+{
+    if (he_ctx->timer != NULL)
+        uv_close((uv_handle_t *) he_ctx->timer, he_free_handle_cb);
+
+    //Closing the handle also stops polling, so fd can be closed right after
+    if (he_ctx->handle->type != UV_UNKNOWN_HANDLE)
+        uv_close((uv_handle_t *) he_ctx->handle, he_free_handle_cb);
+    else
+        free(he_ctx->handle);
+
+    if (he_ctx->fd != -1)
+        close(he_ctx->fd);
+
+    free(he_ctx);
+}
+
+//Index of protocol in the attempt counters of the current race, -1 if there is
+//no room for it
+static int he_protocol_idx(neat_flow *flow, int protocol)
+{
+    uint8_t i;
+
+    for (i = 0; i < flow->heProtocolCnt; i++)
+        if (flow->heProtocols[i] == protocol)
+            return i;
+
+    if (flow->heProtocolCnt >= NEAT_MAX_NUM_PROTO)
+        return -1;
+
+    flow->heProtocols[i] = protocol;
+    flow->heStarted[i] = 0;
+    flow->heFailed[i] = 0;
+    flow->heProtocolCnt++;
+    return i;
+}
+
+//Count an attempt of protocol in the current race, and whether it failed. An
+//attempt can be counted as started, and later again as failed
+static void he_note_attempt(neat_flow *flow, int protocol, uint8_t started,
+                            uint8_t failed)
+{
+    int i = he_protocol_idx(flow, protocol);
+
+    if (i < 0)
+        return;
+
+    flow->heStarted[i] += started;
+    flow->heFailed[i] += failed;
+}
+
+static void he_delay_timeout_cb(uv_timer_t *handle);
+static void he_attempt_timeout_cb(uv_timer_t *handle);
+static void he_stop_race(neat_flow *flow);
+static void he_cache_remove(neat_flow *flow);
+static void he_cache_store(neat_flow *flow, struct neat_resolver_res *winner);
+static neat_error_code he_resolve(neat_ctx *ctx, neat_flow *flow);
+
+//Start a connection attempt for the next candidate. Candidates that can't even
+//be started are skipped. If no candidates are left and all attempts have
+//failed, the flow is told that it could not be connected
+static void he_start_next_attempt(neat_flow *flow)
+{
+    struct neat_resolver_res *candidate;
+    struct he_cb_ctx *he_ctx;
+
+    while ((candidate = flow->heNextCandidate) != NULL) {
+        flow->heNextCandidate = candidate->next_res.le_next;
+
         //TODO: Potential place to filter based on policy
-        struct he_cb_ctx *he_ctx = (struct he_cb_ctx *) malloc(sizeof(struct he_cb_ctx));
-        assert(he_ctx !=NULL);
-        he_ctx->handle = (uv_poll_t *) malloc(sizeof(uv_poll_t));
+        he_ctx = (struct he_cb_ctx *) calloc(1, sizeof(struct he_cb_ctx));
+        assert(he_ctx != NULL);
+        he_ctx->handle = (uv_poll_t *) calloc(1, sizeof(uv_poll_t));
         assert(he_ctx->handle != NULL);
         he_ctx->handle->data = (void *)he_ctx;
-        he_ctx->nc = resolver->nc;
+        he_ctx->nc = flow->ctx;
         he_ctx->candidate = candidate;
         he_ctx->flow = flow;
         he_ctx->fd = -1;
+        he_ctx->start = uv_now(flow->ctx->loop);
+        //A deferred connect completes before anything has been sent, so it
+        //would win against any other attempt. It is only allowed when there
+        //is nothing left to race it against
+        he_ctx->mayDefer = flow->heNextCandidate == NULL &&
+            LIST_EMPTY(&flow->heAttempts) && flow->resolver == NULL;
+
+        if (flow->connectfx(he_ctx, flow->heCallback) == -1) {
+            //The kernel lacks the protocol, or has it disabled (like MPTCP
+            //with net.mptcp.enabled=0), no destination will do better
+            if (errno == EPROTONOSUPPORT || errno == ESOCKTNOSUPPORT ||
+                errno == EPROTOTYPE || errno == ENOPROTOOPT)
+                neat_cib_protocol_failed(flow->ctx, NULL,
+                                         candidate->ai_protocol);
 
-        if (flow->connectfx(he_ctx, callback_fx) == -1) {
-            /* TODO: Some error handling? */
+            he_note_attempt(flow, candidate->ai_protocol, 1, 1);
+            he_close_attempt(he_ctx);
             continue;
         }
 
+        he_note_attempt(flow, candidate->ai_protocol, 1, 0);
+        LIST_INSERT_HEAD(&flow->heAttempts, he_ctx, next_attempt);
+
+        //Do not depend on the SYN retry timing of the kernel, which can keep a
+        //blackholed attempt alive for minutes
+        if (flow->ctx->he_attempt_timeout) {
+            he_ctx->timer = (uv_timer_t *) malloc(sizeof(uv_timer_t));
+            assert(he_ctx->timer != NULL);
+            uv_timer_init(flow->ctx->loop, he_ctx->timer);
+            he_ctx->timer->data = he_ctx;
+            uv_timer_start(he_ctx->timer, he_attempt_timeout_cb,
+                           flow->ctx->he_attempt_timeout, 0);
+        }
+
+        if (flow->heNextCandidate)
+            uv_timer_start(flow->heTimer, he_delay_timeout_cb,
+                           flow->ctx->he_delay, 0);
+        else
+            uv_timer_stop(flow->heTimer);
+
+        return;
+    }
+
+    if (!LIST_EMPTY(&flow->heAttempts))
+        return;
+
+    //The lookup is still in progress, later replies can bring new candidates
+    if (flow->resolver != NULL)
+        return;
+
+    flow->hefirstConnect = 0;
+    he_stop_race(flow);
+
+    //The cached winner did not work this time, forget it and race everything
+    if (flow->heFromCache) {
+        flow->heFromCache = 0;
+        he_cache_remove(flow);
+        neat_resolver_free_results(flow->resolver_results);
+        flow->resolver_results = NULL;
+
+        if (he_resolve(flow->ctx, flow) == NEAT_OK)
+            return;
     }
 
+    neat_he_stop(flow);
+    neat_io_error(flow->ctx, flow, NEAT_ERROR_IO);
 }
 
-neat_error_code neat_he_lookup(neat_ctx *ctx, neat_flow *flow, uv_poll_cb callback_fx)
+//No attempt has succeeded within the delay, so start the next one in parallel
+static void he_delay_timeout_cb(uv_timer_t *handle)
+{
+    he_start_next_attempt((neat_flow *) handle->data);
+}
+
+//The attempt did not connect in time, count it as failed
+static void he_attempt_timeout_cb(uv_timer_t *handle)
+{
+    neat_he_attempt_failed((struct he_cb_ctx *) handle->data);
+}
+
+//The flow did not connect before its deadline. Give up on every attempt, and
+//on a lookup that may still be in progress
+static void he_deadline_timeout_cb(uv_timer_t *handle)
+{
+    neat_flow *flow = handle->data;
+
+    flow->hefirstConnect = 0;
+    neat_he_stop(flow);
+    neat_io_error(flow->ctx, flow, NEAT_ERROR_IO);
+}
+
+//The winner is taken over by the flow, every sibling attempt still in flight is
+//cancelled so that no sockets are left behind
+void neat_he_attempt_won(struct he_cb_ctx *he_ctx)
+{
+    neat_flow *flow = he_ctx->flow;
+    struct neat_if_load *if_load;
+    int protocol = he_ctx->candidate->ai_protocol;
+    uint8_t i;
+
+    if (he_ctx->timer != NULL) {
+        uv_close((uv_handle_t *) he_ctx->timer, he_free_handle_cb);
+        he_ctx->timer = NULL;
+    }
+
+    LIST_REMOVE(he_ctx, next_attempt);
+
+    flow->heNextCandidate = NULL;
+    neat_he_stop(flow);
+
+    //Used by the least-loaded source policy
+    if_load = he_if_load_lookup(flow->ctx, he_ctx->candidate->src->if_idx);
+    if (if_load == NULL &&
+        (if_load = calloc(1, sizeof(struct neat_if_load))) != NULL) {
+        if_load->if_idx = he_ctx->candidate->src->if_idx;
+        LIST_INSERT_HEAD(&flow->ctx->if_loads, if_load, next_if_load);
+    }
+    if (if_load != NULL) {
+        if_load->flows++;
+        flow->heIfLoad = if_load;
+    }
+
+    //A deferred connect took no round trip, and says nothing about the path or
+    //the protocol. Whether it works is only known after the first write, so it
+    //is not cached as the winner either
+    if (he_ctx->isTFODeferred)
+        return;
+
+    //Only blame protocols when another one worked, if nothing works the
+    //problem is more likely the network than the protocol. A protocol is only
+    //blamed if every attempt of it failed or timed out. An attempt that is
+    //still pending may just be slower, and another may have failed because of
+    //its address
+    for (i = 0; i < flow->heProtocolCnt; i++)
+        if (flow->heProtocols[i] != protocol &&
+            flow->heFailed[i] == flow->heStarted[i])
+            neat_cib_protocol_failed(flow->ctx, flow->name,
+                                     flow->heProtocols[i]);
+
+    neat_cib_protocol_usable(flow->ctx, flow->name, protocol);
+
+    if (!flow->heFromCache)
+        he_cache_store(flow, he_ctx->candidate);
+
+    neat_cib_connect_result(flow->ctx, he_ctx->candidate, 1,
+                            uv_now(flow->ctx->loop) - he_ctx->start);
+}
+
+void neat_he_attempt_failed(struct he_cb_ctx *he_ctx)
+{
+    neat_flow *flow = he_ctx->flow;
+
+    //Cancelled attempts never get here, so this says something about the path
+    neat_cib_connect_result(flow->ctx, he_ctx->candidate, 0, 0);
+    he_note_attempt(flow, he_ctx->candidate->ai_protocol, 0, 1);
+
+    LIST_REMOVE(he_ctx, next_attempt);
+    he_close_attempt(he_ctx);
+
+    //Race is already decided, this was one of the losers
+    if (!flow->hefirstConnect)
+        return;
+
+    he_start_next_attempt(flow);
+}
+
+//Cancel all attempts of the current race, but keep the deadline running
+static void he_stop_race(neat_flow *flow)
 {
-    int protocols[NEAT_MAX_NUM_PROTO]; /* We only support SCTP, TCP, UDP, and UDPLite */
+    struct he_cb_ctx *he_ctx;
+
+    while ((he_ctx = LIST_FIRST(&flow->heAttempts)) != NULL) {
+        LIST_REMOVE(he_ctx, next_attempt);
+        he_close_attempt(he_ctx);
+    }
+
+    if (flow->heTimer == NULL)
+        return;
+
+    uv_close((uv_handle_t *) flow->heTimer, he_free_handle_cb);
+    flow->heTimer = NULL;
+}
+
+void neat_he_stop(neat_flow *flow)
+{
+    he_stop_race(flow);
+
+    //Lookup is still in progress, the resolver will not call us after this
+    if (flow->resolver) {
+        neat_resolver_release(flow->resolver);
+        flow->resolver = NULL;
+    }
+
+    if (flow->heDeadline == NULL)
+        return;
+
+    uv_close((uv_handle_t *) flow->heDeadline, he_free_handle_cb);
+    flow->heDeadline = NULL;
+}
+
+void neat_he_flow_closed(neat_flow *flow)
+{
+    neat_he_stop(flow);
+
+    if (flow->heIfLoad != NULL) {
+        flow->heIfLoad->flows--;
+        flow->heIfLoad = NULL;
+    }
+}
+
+//Find a cached winner for the destination and properties of flow. Expired
+//entries are dropped on the way
+static struct neat_he_cache_entry *he_cache_lookup(neat_flow *flow)
+{
+    struct neat_ctx *ctx = flow->ctx;
+    struct neat_he_cache_entry *entry, *next_entry;
+    uint64_t now = uv_now(ctx->loop);
+
+    TAILQ_FOREACH_SAFE(entry, &ctx->he_cache, next_entry, next_entry) {
+        if (entry->expires <= now) {
+            TAILQ_REMOVE(&ctx->he_cache, entry, next_entry);
+            free(entry);
+            ctx->he_cache_cnt--;
+            continue;
+        }
+
+        if (entry->propertyMask == flow->propertyMask &&
+            !strcmp(entry->port, flow->port) &&
+            !strcmp(entry->name, flow->name))
+            return entry;
+    }
+
+    return NULL;
+}
+
+static void he_cache_remove(neat_flow *flow)
+{
+    struct neat_he_cache_entry *entry = he_cache_lookup(flow);
+
+    if (entry == NULL)
+        return;
+
+    TAILQ_REMOVE(&flow->ctx->he_cache, entry, next_entry);
+    free(entry);
+    flow->ctx->he_cache_cnt--;
+}
+
+//Remember the winner of a race, most recent winners are kept at the head
+static void he_cache_store(neat_flow *flow, struct neat_resolver_res *winner)
+{
+    struct neat_ctx *ctx = flow->ctx;
+    struct neat_he_cache_entry *entry;
+    size_t name_len = strlen(flow->name) + 1;
+    size_t port_len = strlen(flow->port) + 1;
+
+    he_cache_remove(flow);
+
+    if (ctx->he_cache_cnt >= NEAT_HE_CACHE_SIZE) {
+        entry = TAILQ_LAST(&ctx->he_cache, neat_he_cache);
+        TAILQ_REMOVE(&ctx->he_cache, entry, next_entry);
+        free(entry);
+        ctx->he_cache_cnt--;
+    }
+
+    //Name and port are stored right after the entry
+    entry = calloc(1, sizeof(struct neat_he_cache_entry) + name_len + port_len);
+    if (entry == NULL)
+        return;
+
+    entry->name = (char *) (entry + 1);
+    entry->port = entry->name + name_len;
+    memcpy(entry->name, flow->name, name_len);
+    memcpy(entry->port, flow->port, port_len);
+    entry->propertyMask = flow->propertyMask;
+    entry->expires = uv_now(ctx->loop) + 1000 * (uint64_t) NEAT_HE_CACHE_TTL;
+    entry->winner_src = *(winner->src);
+    entry->winner = *winner;
+    entry->winner.src = &(entry->winner_src);
+
+    TAILQ_INSERT_HEAD(&ctx->he_cache, entry, next_entry);
+    ctx->he_cache_cnt++;
+}
+
+void neat_he_cleanup(struct neat_ctx *ctx)
+{
+    struct neat_if_load *if_load;
+
+    neat_he_cache_flush(ctx);
+
+    while ((if_load = LIST_FIRST(&ctx->if_loads)) != NULL) {
+        LIST_REMOVE(if_load, next_if_load);
+        free(if_load);
+    }
+}
+
+void neat_he_cache_flush(struct neat_ctx *ctx)
+{
+    struct neat_he_cache_entry *entry;
+
+    while ((entry = TAILQ_FIRST(&ctx->he_cache)) != NULL) {
+        TAILQ_REMOVE(&ctx->he_cache, entry, next_entry);
+        free(entry);
+    }
+
+    ctx->he_cache_cnt = 0;
+}
+
+static void he_start_race(neat_flow *flow, struct neat_resolver_results *results)
+{
+    he_order_candidates(flow, results);
+
+    flow->resolver_results = results;
+    flow->hefirstConnect = 1;
+    flow->heNextCandidate = results->lh_first;
+    flow->heProtocolCnt = 0;
+
+    flow->heTimer = (uv_timer_t *) malloc(sizeof(uv_timer_t));
+    assert(flow->heTimer != NULL);
+    uv_timer_init(flow->ctx->loop, flow->heTimer);
+    flow->heTimer->data = flow;
+
+    he_start_next_attempt(flow);
+}
+
+//Add candidates from a later DNS reply to a running race. They are ordered
+//together with the candidates that have not been attempted yet, while those
+//already attempted keep their place
+static void he_merge_candidates(neat_flow *flow,
+                                struct neat_resolver_results *results)
+{
+    struct neat_resolver_res *candidate, *prev = NULL;
+
+    while ((candidate = flow->heNextCandidate) != NULL) {
+        flow->heNextCandidate = candidate->next_res.le_next;
+        LIST_REMOVE(candidate, next_res);
+
+        if (prev == NULL)
+            LIST_INSERT_HEAD(results, candidate, next_res);
+        else
+            LIST_INSERT_AFTER(prev, candidate, next_res);
+        prev = candidate;
+    }
+
+    he_order_candidates(flow, results);
+
+    prev = NULL;
+    LIST_FOREACH(candidate, flow->resolver_results, next_res)
+        prev = candidate;
+
+    while ((candidate = LIST_FIRST(results)) != NULL) {
+        LIST_REMOVE(candidate, next_res);
+
+        if (prev == NULL)
+            LIST_INSERT_HEAD(flow->resolver_results, candidate, next_res);
+        else
+            LIST_INSERT_AFTER(prev, candidate, next_res);
+        prev = candidate;
+
+        if (flow->heNextCandidate == NULL)
+            flow->heNextCandidate = candidate;
+    }
+
+    //The candidates live in the storage of results, which is freed together
+    //with the list of the flow
+    neat_resolver_results_adopt(flow->resolver_results, results);
+}
+
+//Race only the cached winner, without resolving the name. Returns
+//RETVAL_FAILURE if there is no usable cache entry
+static uint8_t he_start_cached_race(neat_flow *flow)
+{
+    struct neat_he_cache_entry *entry = he_cache_lookup(flow);
+    struct neat_resolver_results *results;
+
+    if (entry == NULL)
+        return RETVAL_FAILURE;
+
+    if ((results = neat_resolver_results_copy(&(entry->winner))) == NULL)
+        return RETVAL_FAILURE;
+
+    flow->heFromCache = 1;
+    he_start_race(flow, results);
+    return RETVAL_SUCCESS;
+}
+
+static void
+he_resolve_cb(struct neat_resolver *resolver, struct neat_resolver_results *results, uint8_t code)
+{
+    neat_flow *flow = (neat_flow *)resolver->userData1;
+
+    //Every lookup has its own resolver, which is done unless more replies can
+    //follow
+    if (code != NEAT_RESOLVER_PARTIAL) {
+        neat_resolver_release(resolver);
+        flow->resolver = NULL;
+    }
+
+    //Nothing was found. If an earlier reply started the race, it goes on with
+    //what it has
+    if (results == NULL) {
+        if (flow->resolver_results == NULL) {
+            neat_he_stop(flow);
+            neat_io_error(flow->ctx, flow, NEAT_ERROR_DNS);
+            return;
+        }
+
+        if (LIST_EMPTY(&flow->heAttempts))
+            he_start_next_attempt(flow);
+        return;
+    }
+
+    assert (results->lh_first);
+
+    /* TODO: Used by Karl-Johan Grinnemo during test. Remove in final version. */
+#if 0
+    pm_filter(results);
+    he_print_results(results);
+#endif
+
+    //Connecting starts with the first reply
+    if (flow->resolver_results == NULL) {
+        he_start_race(flow, results);
+        return;
+    }
+
+    he_merge_candidates(flow, results);
+
+    //Every attempt had already failed, so do not wait for the delay
+    if (LIST_EMPTY(&flow->heAttempts))
+        he_start_next_attempt(flow);
+    else if (!uv_is_active((uv_handle_t *) flow->heTimer))
+        uv_timer_start(flow->heTimer, he_delay_timeout_cb,
+                       flow->ctx->he_delay, 0);
+}
+
+void neat_he_set_delay(struct neat_ctx *ctx, uint32_t delay)
+{
+    ctx->he_delay = delay;
+}
+
+void neat_set_source_policy(struct neat_ctx *ctx, neat_source_policy policy)
+{
+    ctx->source_policy = policy;
+}
+
+void neat_he_set_timeouts(struct neat_ctx *ctx, uint32_t attempt_timeout,
+                          uint32_t deadline)
+{
+    ctx->he_attempt_timeout = attempt_timeout;
+    ctx->he_deadline = deadline;
+}
+
+static void he_resolver_cleanup_cb(struct neat_resolver *resolver)
+{
+    free(resolver);
+}
+
+//Start resolving the name of flow, the race starts in he_resolve_cb. Every
+//lookup gets a resolver of its own, so that any number of flows can resolve
+//and race in parallel on one context
+static neat_error_code he_resolve(neat_ctx *ctx, neat_flow *flow)
+{
+    int protocols[NEAT_MAX_NUM_PROTO]; /* We only support SCTP, MPTCP, TCP, UDP, and UDPLite */
     uint8_t nr_of_protocols;
     uint8_t family;
 
-    if ((flow->propertyMask & NEAT_PROPERTY_IPV4_REQUIRED) &&
-        (flow->propertyMask & NEAT_PROPERTY_IPV4_BANNED))
-        return NEAT_ERROR_UNABLE;
-    if ((flow->propertyMask & NEAT_PROPERTY_IPV6_REQUIRED) &&
-        (flow->propertyMask & NEAT_PROPERTY_IPV6_BANNED))
-        return NEAT_ERROR_UNABLE;
-    if ((flow->propertyMask & NEAT_PROPERTY_IPV4_BANNED) &&
-        (flow->propertyMask & NEAT_PROPERTY_IPV6_BANNED))
-        return NEAT_ERROR_UNABLE;
     if ((flow->propertyMask & NEAT_PROPERTY_IPV4_REQUIRED) &&
         (flow->propertyMask & NEAT_PROPERTY_IPV6_BANNED))
         family = AF_INET;
@@ -173,20 +879,71 @@ neat_error_code neat_he_lookup(neat_ctx *ctx, neat_flow *flow, uv_poll_cb callba
 
     nr_of_protocols = neat_property_translate_protocols(flow->propertyMask,
             protocols);
-    if (nr_of_protocols == 0)
-        return NEAT_ERROR_UNABLE;
+    //Do not resolve for, and race, protocols that failed recently
+    nr_of_protocols = neat_cib_prune_protocols(ctx, flow->name, protocols,
+            nr_of_protocols);
 
-    if (!ctx->resolver) {
-        ctx->resolver = neat_resolver_init(ctx, he_resolve_cb, NULL);
-    }
-    ctx->resolver->userData1 = (void *)flow; // TODO: This doesn't allow multiple sockets
-    ctx->resolver->userData2 = callback_fx;
+    flow->resolver = neat_resolver_init(ctx, he_resolve_cb,
+                                        he_resolver_cleanup_cb);
+    if (flow->resolver == NULL)
+        return NEAT_ERROR_INTERNAL;
+
+    flow->resolver->userData1 = (void *)flow;
+    //Start connecting on the first reply, and merge later ones into the race
+    neat_resolver_set_streaming(flow->resolver, 1);
 
     /* FIXME: derivation of the socket type is wrong.
      * FIXME: Make use of the array of protocols
      */
-    neat_getaddrinfo(ctx->resolver, family, flow->name, flow->port,
-            protocols, nr_of_protocols);
+    if (neat_getaddrinfo(flow->resolver, family, flow->name, flow->port,
+            protocols, nr_of_protocols)) {
+        neat_resolver_release(flow->resolver);
+        flow->resolver = NULL;
+        return NEAT_ERROR_BAD_ARGUMENT;
+    }
 
     return NEAT_OK;
 }
+
+neat_error_code neat_he_lookup(neat_ctx *ctx, neat_flow *flow, uv_poll_cb callback_fx)
+{
+    int protocols[NEAT_MAX_NUM_PROTO];
+    neat_error_code code;
+
+    if ((flow->propertyMask & NEAT_PROPERTY_IPV4_REQUIRED) &&
+        (flow->propertyMask & NEAT_PROPERTY_IPV4_BANNED))
+        return NEAT_ERROR_UNABLE;
+    if ((flow->propertyMask & NEAT_PROPERTY_IPV6_REQUIRED) &&
+        (flow->propertyMask & NEAT_PROPERTY_IPV6_BANNED))
+        return NEAT_ERROR_UNABLE;
+    if ((flow->propertyMask & NEAT_PROPERTY_IPV4_BANNED) &&
+        (flow->propertyMask & NEAT_PROPERTY_IPV6_BANNED))
+        return NEAT_ERROR_UNABLE;
+
+    if (neat_property_translate_protocols(flow->propertyMask, protocols) == 0)
+        return NEAT_ERROR_UNABLE;
+
+    flow->ctx = ctx;
+    flow->heCallback = callback_fx;
+
+    //The deadline covers both resolving and connecting
+    if (ctx->he_deadline) {
+        flow->heDeadline = (uv_timer_t *) malloc(sizeof(uv_timer_t));
+        assert(flow->heDeadline != NULL);
+        uv_timer_init(ctx->loop, flow->heDeadline);
+        flow->heDeadline->data = flow;
+        uv_timer_start(flow->heDeadline, he_deadline_timeout_cb,
+                       ctx->he_deadline, 0);
+    }
+
+    //A recent winner for the same destination is tried alone, we only resolve
+    //and race all candidates if it fails
+    if (he_start_cached_race(flow) == RETVAL_SUCCESS)
+        return NEAT_OK;
+
+    code = he_resolve(ctx, flow);
+    if (code != NEAT_OK)
+        neat_he_stop(flow);
+
+    return code;
+}
@@ -2,6 +2,7 @@
 #define NEAT_INTERNAL_H
 
 #include <stdint.h>
+#include <netinet/in.h>
 #include <uv.h>
 
 #include "neat_queue.h"
@@ -18,22 +19,114 @@
     struct neat_event_cbs* event_cbs; \
     uint8_t src_addr_cnt
 
-#define NEAT_MAX_NUM_PROTO 4
+#define NEAT_MAX_NUM_PROTO 5
+
+//Older libc headers do not know Multipath TCP (Linux 5.6 and later)
+#if defined(__linux__) && !defined(IPPROTO_MPTCP)
+#define IPPROTO_MPTCP 262
+#endif
+
+//Default delay (ms) before Happy Eyeballs starts the next connection attempt
+#define NEAT_HE_DELAY 250
+//Default time (ms) a single connection attempt may take, and default deadline
+//(ms) for resolving and connecting a flow
+#define NEAT_HE_ATTEMPT_TIMEOUT 3000
+#define NEAT_HE_DEADLINE 10000
+//Lifetime (s) and maximum number of cached Happy Eyeballs winners
+#define NEAT_HE_CACHE_TTL 300
+#define NEAT_HE_CACHE_SIZE 64
+//Maximum number of paths remembered by the CIB, and minimum time (ms) between
+//two samples of the transport statistics of a flow
+#define NEAT_CIB_SIZE 256
+#define NEAT_CIB_SAMPLE_INTERVAL 1000
+//First and longest time (s) a protocol that failed is left out of races
+#define NEAT_CIB_BACKOFF_MIN 30
+#define NEAT_CIB_BACKOFF_MAX 3600
+//Default time (ms) a pooled flow may stay idle, time (ms) before warming is
+//retried after a flow failed to open, and interval (ms) of the pool sweep
+#define NEAT_POOL_IDLE_TIMEOUT 30000
+#define NEAT_POOL_RETRY 5000
+#define NEAT_POOL_SWEEP_INTERVAL 1000
+//System resolver configuration, and the number of name servers (per family)
+//and search domains used from it
+#define NEAT_RESOLV_CONF "/etc/resolv.conf"
+#define NEAT_HOSTS "/etc/hosts"
+#define NEAT_RESOLV_MAX_SERVERS 3
+#define NEAT_RESOLV_MAX_SEARCH 6
+#define MAX_DOMAIN_LENGTH   254
+//Default number of DNS queries one lookup may send, 0 for no limit
+#define NEAT_RESOLVER_MAX_QUERIES 16
+//Default first retransmission timeout (ms) of a DNS query. It doubles with
+//every attempt, up to the timeout of resolv.conf
+#define NEAT_RESOLVER_RTO 500
+//Default number of addresses from each DNS reply that are raced
+#define NEAT_RESOLVER_MAX_ANSWERS 3
+//Default number of times a cached DNS answer has to be used before it is
+//refreshed ahead of its expiry
+#define NEAT_RESOLVER_REFRESH_HITS 1
 
 struct neat_event_cb;
 struct neat_addr;
+struct neat_he_cache_entry;
+struct neat_if_load;
+struct neat_addr_policy;
+struct neat_cib_entry;
+struct neat_cib_failure;
+struct neat_pool;
+struct neat_dns_cache_entry;
+struct neat_hosts_entry;
+struct neat_dns_socket;
+struct neat_dns_server;
 
 //TODO: One drawback with using LIST from queue.h, is that a callback can only
 //be member of one list. Decide if this is critical and improve if needed
 LIST_HEAD(neat_event_cbs, neat_event_cb);
 LIST_HEAD(neat_src_addrs, neat_addr);
+TAILQ_HEAD(neat_he_cache, neat_he_cache_entry);
+LIST_HEAD(neat_if_loads, neat_if_load);
+TAILQ_HEAD(neat_cib_entries, neat_cib_entry);
+TAILQ_HEAD(neat_cib_failures, neat_cib_failure);
+LIST_HEAD(neat_pools, neat_pool);
+TAILQ_HEAD(neat_dns_cache, neat_dns_cache_entry);
+LIST_HEAD(neat_hosts_entries, neat_hosts_entry);
+LIST_HEAD(neat_dns_sockets, neat_dns_socket);
+TAILQ_HEAD(neat_dns_servers, neat_dns_server);
+LIST_HEAD(neat_resolvers, neat_resolver);
+TAILQ_HEAD(neat_resolver_deliveries, neat_resolver);
 
 struct neat_pib
 { // TODO
 };
 
+//Observations of the paths used by earlier flows, see neat_cib.c
 struct neat_cib
-{ // TODO
+{
+    struct neat_cib_entries entries;
+    uint32_t entry_cnt;
+    //Protocols that did not work, per destination name or for the host
+    struct neat_cib_failures failures;
+    uint32_t failure_cnt;
+};
+
+//Name servers, options and search list of resolv.conf, and the names of
+///etc/hosts. See neat_resolver_conf.c
+struct neat_resolver_conf
+{
+    char servers4[NEAT_RESOLV_MAX_SERVERS][INET_ADDRSTRLEN];
+    char servers6[NEAT_RESOLV_MAX_SERVERS][INET6_ADDRSTRLEN];
+    uint8_t servers4_cnt;
+    uint8_t servers6_cnt;
+    uint8_t search_cnt;
+    uint8_t ndots;
+    uint8_t attempts;
+    uint8_t timeout; // s
+    //Set if resolv.conf could be read
+    uint8_t loaded;
+    uint8_t __pad;
+    char search[NEAT_RESOLV_MAX_SEARCH][MAX_DOMAIN_LENGTH];
+    struct neat_hosts_entries hosts;
+    uv_fs_event_t resolv_handle;
+    uv_fs_event_t hosts_handle;
 };
 
 struct neat_ctx {
@@ -43,12 +136,65 @@ struct neat_ctx {
     struct neat_cib cib;
     uv_timer_t addr_lifetime_handle;
 
+    //Delay (ms) between two consecutive Happy Eyeballs connection attempts
+    uint32_t he_delay;
+    //Timeout (ms) for one attempt and deadline (ms) for the flow, 0 disables
+    uint32_t he_attempt_timeout;
+    uint32_t he_deadline;
+    //Winners of earlier races, see neat_he.c
+    struct neat_he_cache he_cache;
+    uint32_t he_cache_cnt;
+    //How flows are spread over the available source interfaces
+    neat_source_policy source_policy;
+    uint32_t source_rr_cnt;
+    struct neat_if_loads if_loads;
+    //Pools of connected flows, see neat_pool.c
+    struct neat_pools pools;
+    uint32_t pool_idle_timeout;
+    uv_timer_t pool_handle;
+    //DNS answers, see neat_resolver.c
+    struct neat_dns_cache dns_cache;
+    uint32_t dns_cache_cnt;
+    //Refresh-ahead of popular answers, and background lookups started by
+    //neat_resolver_prefetch or the refresh. See neat_resolver_prefetch.c
+    uint32_t dns_refresh_hits;
+    uint64_t dns_refresh_at; // loop time (ms), 0 if the timer is not running
+    uv_timer_t dns_refresh_handle;
+    struct neat_resolvers resolver_prefetches;
+    struct neat_resolver_conf resolver_conf;
+    //UDP sockets used for DNS queries, one per source address
+    struct neat_dns_sockets dns_sockets;
+    //RTT and failures of the name servers, see neat_resolver_servers.c
+    struct neat_dns_servers dns_servers;
+    uint32_t dns_servers_cnt;
+    //Fan-out of a lookup and interface filters, see neat_resolver.c
+    uint32_t resolver_max_queries;
+    uint8_t resolver_per_if;
+    char *if_include;
+    char *if_exclude;
+    //Transmissions of a DNS query (0 for attempts of resolv.conf), and the
+    //first retransmission timeout (ms)
+    uint8_t dns_attempts;
+    uint32_t dns_rto;
+    //Which addresses of a reply are passed on, and how many (0 for all)
+    neat_answer_policy answer_policy;
+    uint8_t max_answers;
+    //RFC 6724 policy table, NULL for the default one, see neat_addr_select.c
+    struct neat_addr_policy *addr_policy;
+    uint32_t addr_policy_cnt;
+    uint8_t prefer_temporary;
+    //Lookups with DNS queries in flight, and resolvers with results waiting to
+    //be delivered, see neat_resolver.c
+    struct neat_resolvers resolver_lookups;
+    struct neat_resolver_deliveries resolver_deliveries;
+
     // resolver
     NEAT_INTERNAL_CTX;
     NEAT_INTERNAL_OS;
 };
 
 struct he_cb_ctx;
+LIST_HEAD(neat_he_attempts, he_cb_ctx);
 
 typedef struct neat_ctx neat_ctx ;
 typedef neat_error_code (*neat_read_impl)(struct neat_ctx *ctx, struct neat_flow *flow,
@@ -83,6 +229,7 @@ struct neat_flow
     uint8_t family;
     int sockType;
     int sockProtocol;
+    struct neat_resolver *resolver; // lookup in progress, owned by the flow
     struct neat_resolver_results *resolver_results;
     const struct sockaddr *sockAddr; // raw unowned pointer into resolver_results
     struct neat_ctx *ctx; // raw convenience pointer
@@ -108,7 +255,25 @@ struct neat_flow
     neat_listen_impl listenfx;
     neat_shutdown_impl shutdownfx;
 
+    // Happy Eyeballs state, see neat_he.c
+    struct neat_resolver_res *heNextCandidate; // next candidate to attempt
+    uv_timer_t *heTimer;        // staggers the connection attempts
+    uv_timer_t *heDeadline;     // bounds the time spent in neat_open
+    struct neat_if_load *heIfLoad; // source interface the flow is counted on
+    uv_poll_cb heCallback;      // passed on to connectfx
+    struct neat_he_attempts heAttempts; // attempts started but not completed
+    int heProtocols[NEAT_MAX_NUM_PROTO]; // protocols attempted in the race
+    uint16_t heStarted[NEAT_MAX_NUM_PROTO]; // attempts, per protocol
+    uint16_t heFailed[NEAT_MAX_NUM_PROTO];  // failed attempts, per protocol
+    uint8_t heProtocolCnt;
+
+    // CIB sampling state, see neat_cib.c
+    const struct neat_resolver_res *cibPath; // raw unowned pointer into resolver_results
+    uint64_t cibSampled;        // loop time (ms) of the last sample
+    uint32_t cibRetrans;        // retransmissions counted at the last sample
+
     int hefirstConnect : 1;
+    int heFromCache : 1;
     int firstWritePending : 1;
     int acceptPending : 1;
     int isPolling : 1;
@@ -116,6 +281,7 @@ struct neat_flow
     int everConnected : 1;
     int isDraining : 1;
     int isSCTPExplicitEOR : 1;
+    int isTFODeferred : 1; // connect is done by the first write
 };
 
 typedef struct neat_flow neat_flow;
@@ -123,8 +289,22 @@ typedef struct neat_flow neat_flow;
 //NEAT resolver public data structures/functions
 struct neat_resolver;
 struct neat_resolver_res;
-
-LIST_HEAD(neat_resolver_results, neat_resolver_res);
+struct neat_resolver_seen;
+
+//Results of a lookup. It is laid out like a LIST_HEAD, so that the queue
+//macros work on it. The results and their sources are stored right after it
+//and freed with it. Results moved in from another list keep that allocation
+//alive through next_block, see neat_resolver_results_adopt
+struct neat_resolver_results {
+    struct neat_resolver_res *lh_first;
+    struct neat_resolver_results *next_block;
+    struct neat_resolver_res *res;
+    struct neat_resolver_src *srcs;
+    uint32_t num_res;
+    uint32_t max_res;
+    uint32_t num_srcs;
+    uint32_t max_srcs;
+};
 
 typedef void (*neat_resolver_handle_t)(struct neat_resolver*, struct neat_resolver_results *, uint8_t);
 typedef void (*neat_resolver_cleanup_t)(struct neat_resolver *resolver);
@@ -136,18 +316,32 @@ enum neat_resolver_code {
     NEAT_RESOLVER_TIMEOUT,
     //Signal internal error
     NEAT_RESOLVER_ERROR,
+    //Streaming mode only, results of one reply. More may follow
+    NEAT_RESOLVER_PARTIAL,
+};
+
+//Large enough for the addresses the resolver hands out
+union neat_sockaddr {
+    struct sockaddr_in v4;
+    struct sockaddr_in6 v6;
+};
+
+//Source address, shared by the results resolved for it
+struct neat_resolver_src {
+    uint32_t if_idx;
+    socklen_t addr_len;
+    union neat_sockaddr addr;
+    uint8_t temporary;
 };
 
 //Struct passed to resolver callback, mirrors what we get back from getaddrinfo
 struct neat_resolver_res {
-    int32_t ai_family;
-    int32_t ai_socktype;
-    int32_t ai_protocol;
-    uint32_t if_idx;
-    struct sockaddr_storage src_addr;
-    socklen_t src_addr_len;
-    struct sockaddr_storage dst_addr;
+    const struct neat_resolver_src *src;
+    union neat_sockaddr dst_addr;
     socklen_t dst_addr_len;
+    uint16_t ai_protocol;
+    uint8_t ai_family;
+    uint8_t ai_socktype;
     uint8_t internal;
     LIST_ENTRY(neat_resolver_res) next_res;
 };
@@ -163,6 +357,11 @@ struct he_cb_ctx {
     size_t readSize;
     size_t writeLimit;
     int isSCTPExplicitEOR : 1;
+    int isTFODeferred : 1;
+    int mayDefer : 1; // no other attempt can be raced against this one
+    uv_timer_t *timer; // attempt timeout
+    uint64_t start; // loop time (ms) the attempt was started
+    LIST_ENTRY(he_cb_ctx) next_attempt;
 };
 
 //Intilize resolver. Sets up internal callbacks etc.
@@ -173,20 +372,57 @@ struct neat_resolver *neat_resolver_init(struct neat_ctx *nc,
 
 //Reset resolver, it is ready for use right after this is called
 void neat_resolver_reset(struct neat_resolver *resolver);
-//Release all memory occupied by a resolver. Resolver can't be used again
+//Release all memory occupied by a resolver. Resolver can't be used again. If
+//the loop is running, cleanup is called once the resolver memory can be freed
 void neat_resolver_release(struct neat_resolver *resolver);
 
 //Free the list of results
 void neat_resolver_free_results(struct neat_resolver_results *results);
+//Copy one result, and its source, into a list of its own
+struct neat_resolver_results *neat_resolver_results_copy(
+        const struct neat_resolver_res *res);
+//Make results own the memory of other, after the results of other have been
+//moved to results. other must not be used after this
+void neat_resolver_results_adopt(struct neat_resolver_results *results,
+        struct neat_resolver_results *other);
+
+//Forget all cached DNS answers of the context
+void neat_resolver_cache_flush(struct neat_ctx *nc);
+
+//Close the sockets used for DNS queries, they can't be used once the loop is
+//closed
+void neat_resolver_sockets_close(struct neat_ctx *nc);
+//Forget what is known about the name servers
+void neat_resolver_servers_flush(struct neat_ctx *nc);
+//Release the resolvers of background lookups, once the loop is closed
+void neat_resolver_prefetch_cleanup(struct neat_ctx *nc);
+
+//Read resolv.conf and /etc/hosts, and watch them for changes
+void neat_resolver_conf_init(struct neat_ctx *nc);
+//Free the /etc/hosts names. The watch handles are closed with the loop
+void neat_resolver_conf_cleanup(struct neat_ctx *nc);
 
 //Start to resolve a domain name (or literal). Accepts a list of protocols, will
-//set socktype based on protocol
+//set socktype based on protocol. Names are expanded with the search list of
+//resolv.conf. If node is a literal, is listed in /etc/hosts or the answer is
+//cached, no query is sent. handle_resolve is still only called from the loop,
+//never before this returns. A lookup of a name that another resolver of the
+//context is already querying for waits for the answers to that query, instead
+//of sending its own
 uint8_t neat_getaddrinfo(struct neat_resolver *resolver, uint8_t family,
         const char *node, const char *service, int ai_protocol[],
         uint8_t proto_count);
 
+//In streaming mode, handle_resolve is called with NEAT_RESOLVER_PARTIAL and the
+//new addresses every time a DNS reply arrives. The lookup then ends with NULL
+//results and NEAT_RESOLVER_OK, or with an error if no reply was received.
+//Literals and cached answers are still delivered once, with NEAT_RESOLVER_OK
+void neat_resolver_set_streaming(struct neat_resolver *resolver,
+        uint8_t streaming);
+
 //Update timeouts (in ms) for DNS resolving. T1 is total timeout, T2 is how long
-//to wait after first reply from DNS server. Initial values are 30s and 1s.
+//to wait after first reply from DNS server. Initial values are 1s for T2, and
+//timeout * attempts of resolv.conf for T1 (30s if it can't be read).
 void neat_resolver_update_timeouts(struct neat_resolver *resolver, uint16_t t1,
         uint16_t t2);
 
@@ -209,7 +445,6 @@ uint8_t neat_remove_event_cb(struct neat_ctx *nc, uint8_t event_type,
 
 struct neat_resolver_src_dst_addr;
 LIST_HEAD(neat_resolver_pairs, neat_resolver_src_dst_addr);
-#define MAX_DOMAIN_LENGTH   254
 
 //This data structure must be filled out and added using neat_add_event_cb in
 //order for an application to register for a callback
@@ -250,8 +485,17 @@ struct neat_resolver {
     //Flag used to signal if we have resolved name and timeout has switched from
     //total DNS timeout
     uint8_t name_resolved_timeout;
-    uint8_t __pad2;
+    //Deliver results per DNS reply, see neat_resolver_set_streaming
+    uint8_t streaming;
+    //Background lookup that asks the name servers even if the answer is
+    //cached, see neat_resolver_prefetch.c
+    uint8_t refresh;
+    LIST_ENTRY(neat_resolver) next_prefetch;
+    //Name being looked up, node_name expanded by the search list of
+    //resolv.conf. search_idx is the position in the list of names to try
     char domain_name[MAX_DOMAIN_LENGTH];
+    char node_name[MAX_DOMAIN_LENGTH];
+    uint8_t search_idx;
 
     //The reason we need two of these is that as of now, a neat_event_cb
     //struct can only be part of one list. This is a future optimization, if we
@@ -265,6 +509,27 @@ struct neat_resolver {
     struct neat_resolver_pairs resolver_pairs_del;
     uv_idle_t idle_handle;
     uv_timer_t timeout_handle;
+    uv_timer_t retrans_handle;
+    //Addresses received so far, per source, used to drop the ones that more
+    //than one name server answered with. Open addressing, seen_size is a power
+    //of two
+    struct neat_resolver_seen *seen;
+    uint32_t seen_size;
+    uint32_t seen_cnt;
+
+    //Concurrent lookups of the same name are coalesced. The first resolver
+    //sends the queries, the others wait for its answers
+    struct neat_resolver *leader;
+    struct neat_resolvers waiters;
+    LIST_ENTRY(neat_resolver) next_waiter;
+    LIST_ENTRY(neat_resolver) next_lookup;
+    uint8_t lookup_active;
+    //Results are built for every resolver before handle_resolve is called, as
+    //the callback can release any of them
+    uint8_t delivery_queued;
+    uint8_t delivery_code;
+    struct neat_resolver_results *delivery_results;
+    TAILQ_ENTRY(neat_resolver) next_delivery;
 
     //Result is the resolved addresses, code is one of the neat_resolver_codes.
     //Ownsership of results is transfered to application, so it is the
@@ -278,5 +543,138 @@ struct neat_resolver {
 };
 
 neat_error_code neat_he_lookup(neat_ctx *ctx, neat_flow *flow, uv_poll_cb callback_fx);
+//Called by the connect callback when an attempt has connected or failed
+void neat_he_attempt_won(struct he_cb_ctx *he_ctx);
+void neat_he_attempt_failed(struct he_cb_ctx *he_ctx);
+//Stop any Happy Eyeballs activity on flow
+void neat_he_stop(neat_flow *flow);
+//Flow is being freed, release everything Happy Eyeballs holds for it
+void neat_he_flow_closed(neat_flow *flow);
+
+//Number of connected flows using a source interface
+struct neat_if_load {
+    uint32_t if_idx;
+    uint32_t flows;
+    LIST_ENTRY(neat_if_load) next_if_load;
+};
+
+//Winner of an earlier race towards (name, port) with the same properties
+struct neat_he_cache_entry {
+    char *name;
+    char *port;
+    uint64_t propertyMask;
+    uint64_t expires; // in loop time (ms)
+    struct neat_resolver_res winner;
+    struct neat_resolver_src winner_src;
+    TAILQ_ENTRY(neat_he_cache_entry) next_entry;
+};
+
+//Forget all cached Happy Eyeballs winners
+void neat_he_cache_flush(struct neat_ctx *ctx);
+//Free all Happy Eyeballs state of the context
+void neat_he_cleanup(struct neat_ctx *ctx);
+
+//Entry of the RFC 6724 policy table. IPv4 addresses are looked up mapped
+struct neat_addr_policy {
+    struct in6_addr prefix;
+    uint8_t prefix_len;
+    uint8_t precedence;
+    uint8_t label;
+};
+
+//Rank every candidate by RFC 6724 destination address selection, using the
+//source of the candidate. Lower is better, and candidates the rules do not
+//tell apart get the same rank
+void neat_addr_select_rank(struct neat_ctx *ctx,
+                           struct neat_resolver_res **candidates,
+                           uint32_t num_candidates, uint32_t *ranks);
+
+//Observations of one (source, destination, protocol) path. Addresses are kept
+//without port
+struct neat_cib_entry {
+    uint8_t family;
+    int protocol;
+    union {
+        struct in_addr v4;
+        struct in6_addr v6;
+    } src, dst;
+    uint32_t connect_rtt;   // smoothed connect time (ms)
+    uint32_t srtt;          // smoothed RTT (ms) reported by the transport
+    uint32_t successes;
+    uint32_t failures;
+    uint32_t retrans;       // retransmissions seen while flows ran
+    uint64_t sampled;       // time (ms) covered by the retransmission samples
+    TAILQ_ENTRY(neat_cib_entry) next_entry;
+};
+
+//Record the outcome of a connection attempt towards candidate
+void neat_cib_connect_result(struct neat_ctx *ctx,
+                             const struct neat_resolver_res *candidate,
+                             uint8_t success, uint32_t rtt);
+//Sample RTT and loss of a connected flow. Samples are rate limited unless
+//force is set
+void neat_cib_sample_flow(struct neat_ctx *ctx, neat_flow *flow, uint8_t force);
+//Expected cost of connecting over candidate, lower is better
+uint32_t neat_cib_score(struct neat_ctx *ctx,
+                        const struct neat_resolver_res *candidate);
+//A protocol that failed towards name, or on this host if name is NULL
+struct neat_cib_failure {
+    char *name;
+    int protocol;
+    uint32_t failures;  // consecutive failures, sets the backoff
+    uint64_t until;     // loop time (ms) the protocol may be tried again
+    TAILQ_ENTRY(neat_cib_failure) next_failure;
+};
+
+//Remember that protocol failed towards name, or on this host if name is NULL.
+//The protocol is left out of races for a time that doubles with every
+//consecutive failure
+void neat_cib_protocol_failed(struct neat_ctx *ctx, const char *name,
+                              int protocol);
+//Protocol worked towards name, forget earlier failures
+void neat_cib_protocol_usable(struct neat_ctx *ctx, const char *name,
+                              int protocol);
+//Remove protocols that are backing off for name, and return the number of
+//protocols left. The list is left untouched if every protocol is backing off
+uint8_t neat_cib_prune_protocols(struct neat_ctx *ctx, const char *name,
+                                 int protocols[], uint8_t proto_count);
+//Free all CIB entries of the context
+void neat_cib_cleanup(struct neat_ctx *ctx);
+
+struct neat_pool_conn;
+TAILQ_HEAD(neat_pool_conns, neat_pool_conn);
+
+//A flow owned by a pool, either being opened or idle
+struct neat_pool_conn {
+    struct neat_flow_operations ops;
+    struct neat_pool *pool;
+    neat_flow *flow;
+    uint64_t idle_since; // loop time (ms), 0 while the flow is being opened
+    TAILQ_ENTRY(neat_pool_conn) next_conn;
+};
+
+//Flows towards (name, port) with the same properties
+struct neat_pool {
+    char *name;
+    char *port;
+    uint64_t propertyMask;
+    uint32_t size;          // idle flows to keep
+    uint32_t idle_cnt;
+    uint32_t opening_cnt;
+    uint64_t retry_at;      // loop time (ms) warming may continue
+    struct neat_pool_conns idle; // most recently idle first
+    struct neat_pool_conns opening;
+    LIST_ENTRY(neat_pool) next_pool;
+};
+
+//Free all pools and pooled flows of the context
+void neat_pool_cleanup(struct neat_ctx *ctx);
+//Poll flow for the events its operations are interested in
+void neat_flow_update_poll(neat_flow *flow);
+//Call on_connected of a flow that is already connected
+void neat_flow_resume(neat_flow *flow);
+
+//Report an error to the on_error callback of flow
+void neat_io_error(neat_ctx *ctx, neat_flow *flow, neat_error_code code);
 
 #endif
@@ -64,10 +64,11 @@ static void neat_linux_handle_addr(struct neat_ctx *nc,
     struct sockaddr_in6 *src_addr6;
     struct ifa_cacheinfo *ci;
     uint32_t *addr6_ptr, ifa_pref = 0, ifa_valid = 0;
-    uint8_t i;
+    uint8_t i, temporary = 0;
 
     //On Linux, lo has a fixed index. We have no interest in that interface
-    //TODO: Consider other filters - bridges, ifb, ...
+    //Other interfaces (bridges, ifb, ...) are left out with
+    //neat_set_interface_filter
     if (ifm->ifa_index == LO_DEV_IDX)
         return;
 
@@ -101,12 +102,13 @@ static void neat_linux_handle_addr(struct neat_ctx *nc,
         ci = (struct ifa_cacheinfo*) mnl_attr_get_payload(attr_table[IFA_CACHEINFO]);
         ifa_pref = ci->ifa_prefered;
         ifa_valid = ci->ifa_valid;
+        temporary = (ifm->ifa_flags & IFA_F_TEMPORARY) ? 1 : 0;
     }
 
     //TODO: Should this function be a callback instead? Will we have multiple
     //addresses handlers/types of context?
     neat_addr_update_src_list(nc, &src_addr, ifm->ifa_index,
-            nl_hdr->nlmsg_type == RTM_NEWADDR, ifa_pref, ifa_valid);
+            nl_hdr->nlmsg_type == RTM_NEWADDR, ifa_pref, ifa_valid, temporary);
 }
 
 //libuv datagram socket alloc function, un-interesting
@@ -0,0 +1,278 @@
+#include <stdlib.h>
+#include <string.h>
+#include <uv.h>
+
+#include "neat.h"
+#include "neat_internal.h"
+
+static struct neat_pool *neat_pool_lookup(struct neat_ctx *ctx,
+                                          const char *name, const char *port,
+                                          uint64_t propertyMask)
+{
+    struct neat_pool *pool;
+
+    LIST_FOREACH(pool, &ctx->pools, next_pool) {
+        if (pool->propertyMask == propertyMask &&
+            !strcmp(pool->port, port) &&
+            !strcmp(pool->name, name))
+            return pool;
+    }
+
+    return NULL;
+}
+
+//Remove conn from its pool and free it, together with its flow
+static void neat_pool_conn_free(struct neat_pool_conn *conn)
+{
+    struct neat_pool *pool = conn->pool;
+
+    if (conn->idle_since) {
+        TAILQ_REMOVE(&pool->idle, conn, next_conn);
+        pool->idle_cnt--;
+    } else {
+        TAILQ_REMOVE(&pool->opening, conn, next_conn);
+        pool->opening_cnt--;
+    }
+
+    neat_free_flow(conn->flow);
+    free(conn);
+}
+
+static neat_error_code neat_pool_on_readable(struct neat_flow_operations *ops);
+
+static neat_error_code neat_pool_on_connected(struct neat_flow_operations *ops)
+{
+    struct neat_pool_conn *conn = ops->userData;
+    struct neat_pool *pool = conn->pool;
+
+    TAILQ_REMOVE(&pool->opening, conn, next_conn);
+    pool->opening_cnt--;
+
+    conn->idle_since = uv_now(ops->ctx->loop);
+    TAILQ_INSERT_HEAD(&pool->idle, conn, next_conn);
+    pool->idle_cnt++;
+
+    //Watch for the peer closing the flow while it is idle
+    conn->ops.on_readable = neat_pool_on_readable;
+    return NEAT_OK;
+}
+
+//Nothing is expected from the peer while the flow is idle, so it has either
+//closed the flow or is out of sync with us. The flow can't be reused
+static neat_error_code neat_pool_on_readable(struct neat_flow_operations *ops)
+{
+    neat_pool_conn_free(ops->userData);
+    return NEAT_OK;
+}
+
+static neat_error_code neat_pool_on_error(struct neat_flow_operations *ops)
+{
+    struct neat_pool_conn *conn = ops->userData;
+
+    //Do not keep opening flows towards a destination that fails
+    if (!conn->idle_since)
+        conn->pool->retry_at = uv_now(ops->ctx->loop) + NEAT_POOL_RETRY;
+
+    neat_pool_conn_free(conn);
+    return NEAT_OK;
+}
+
+//Open flows until the pool holds size flows, counting those being opened
+static void neat_pool_fill(struct neat_ctx *ctx, struct neat_pool *pool)
+{
+    struct neat_pool_conn *conn;
+    neat_flow *flow;
+
+    while (pool->idle_cnt + pool->opening_cnt < pool->size &&
+           uv_now(ctx->loop) >= pool->retry_at) {
+        conn = calloc(1, sizeof(struct neat_pool_conn));
+        flow = neat_new_flow(ctx);
+
+        if (conn == NULL || flow == NULL) {
+            free(conn);
+            if (flow != NULL)
+                neat_free_flow(flow);
+            return;
+        }
+
+        conn->pool = pool;
+        conn->flow = flow;
+        conn->ops.userData = conn;
+        conn->ops.on_connected = neat_pool_on_connected;
+        conn->ops.on_error = neat_pool_on_error;
+        neat_set_operations(ctx, flow, &conn->ops);
+        neat_set_property(ctx, flow, pool->propertyMask);
+
+        TAILQ_INSERT_TAIL(&pool->opening, conn, next_conn);
+        pool->opening_cnt++;
+
+        if (neat_open(ctx, flow, pool->name, pool->port) != NEAT_OK) {
+            pool->retry_at = uv_now(ctx->loop) + NEAT_POOL_RETRY;
+            neat_pool_conn_free(conn);
+            return;
+        }
+    }
+}
+
+//Close idle flows that have not been used for too long, and top up the pools
+static void neat_pool_sweep_cb(uv_timer_t *handle)
+{
+    struct neat_ctx *ctx = handle->data;
+    struct neat_pool *pool;
+    struct neat_pool_conn *conn, *next_conn;
+    uint64_t now = uv_now(ctx->loop);
+
+    LIST_FOREACH(pool, &ctx->pools, next_pool) {
+        TAILQ_FOREACH_SAFE(conn, &pool->idle, next_conn, next_conn) {
+            if (conn->idle_since + ctx->pool_idle_timeout <= now)
+                neat_pool_conn_free(conn);
+        }
+
+        neat_pool_fill(ctx, pool);
+    }
+}
+
+static void neat_pool_free(struct neat_ctx *ctx, struct neat_pool *pool)
+{
+    while (!TAILQ_EMPTY(&pool->idle))
+        neat_pool_conn_free(TAILQ_FIRST(&pool->idle));
+    while (!TAILQ_EMPTY(&pool->opening))
+        neat_pool_conn_free(TAILQ_FIRST(&pool->opening));
+
+    LIST_REMOVE(pool, next_pool);
+    free(pool);
+
+    if (LIST_EMPTY(&ctx->pools))
+        uv_timer_stop(&ctx->pool_handle);
+}
+
+neat_error_code neat_pool_set_size(struct neat_ctx *ctx, const char *name,
+                                   const char *port, uint64_t propertyMask,
+                                   uint32_t size)
+{
+    struct neat_pool *pool = neat_pool_lookup(ctx, name, port, propertyMask);
+    size_t name_len = strlen(name) + 1;
+    size_t port_len = strlen(port) + 1;
+
+    if (pool == NULL) {
+        if (size == 0)
+            return NEAT_OK;
+
+        //Name and port are stored right after the pool
+        pool = calloc(1, sizeof(struct neat_pool) + name_len + port_len);
+        if (pool == NULL)
+            return NEAT_ERROR_INTERNAL;
+
+        pool->name = (char *) (pool + 1);
+        pool->port = pool->name + name_len;
+        memcpy(pool->name, name, name_len);
+        memcpy(pool->port, port, port_len);
+        pool->propertyMask = propertyMask;
+        TAILQ_INIT(&pool->idle);
+        TAILQ_INIT(&pool->opening);
+
+        if (LIST_EMPTY(&ctx->pools))
+            uv_timer_start(&ctx->pool_handle, neat_pool_sweep_cb,
+                           NEAT_POOL_SWEEP_INTERVAL, NEAT_POOL_SWEEP_INTERVAL);
+
+        LIST_INSERT_HEAD(&ctx->pools, pool, next_pool);
+    }
+
+    if (size == 0) {
+        neat_pool_free(ctx, pool);
+        return NEAT_OK;
+    }
+
+    pool->size = size;
+
+    //Shrink from the least recently used end
+    while (pool->idle_cnt > size)
+        neat_pool_conn_free(TAILQ_LAST(&pool->idle, neat_pool_conns));
+
+    neat_pool_fill(ctx, pool);
+    return NEAT_OK;
+}
+
+void neat_pool_set_idle_timeout(struct neat_ctx *ctx, uint32_t idle_timeout)
+{
+    ctx->pool_idle_timeout = idle_timeout;
+}
+
+neat_error_code neat_pool_acquire(struct neat_ctx *ctx,
+                                  struct neat_flow_operations *ops,
+                                  const char *name, const char *port,
+                                  uint64_t propertyMask,
+                                  struct neat_flow **flow)
+{
+    struct neat_pool *pool = neat_pool_lookup(ctx, name, port, propertyMask);
+    struct neat_pool_conn *conn;
+    neat_error_code code;
+
+    if (pool != NULL && (conn = TAILQ_FIRST(&pool->idle)) != NULL) {
+        TAILQ_REMOVE(&pool->idle, conn, next_conn);
+        pool->idle_cnt--;
+
+        *flow = conn->flow;
+        free(conn);
+
+        neat_set_operations(ctx, *flow, ops);
+        neat_flow_resume(*flow);
+        neat_pool_fill(ctx, pool);
+        return NEAT_OK;
+    }
+
+    if ((*flow = neat_new_flow(ctx)) == NULL)
+        return NEAT_ERROR_INTERNAL;
+
+    neat_set_operations(ctx, *flow, ops);
+    neat_set_property(ctx, *flow, propertyMask);
+
+    code = neat_open(ctx, *flow, name, port);
+    if (code != NEAT_OK) {
+        neat_free_flow(*flow);
+        *flow = NULL;
+        return code;
+    }
+
+    if (pool != NULL)
+        neat_pool_fill(ctx, pool);
+
+    return NEAT_OK;
+}
+
+void neat_pool_release(struct neat_ctx *ctx, struct neat_flow *flow)
+{
+    struct neat_pool *pool = NULL;
+    struct neat_pool_conn *conn;
+
+    if (flow->name != NULL)
+        pool = neat_pool_lookup(ctx, flow->name, flow->port,
+                                flow->propertyMask);
+
+    //Only a connected flow with nothing left to write can be handed out again
+    if (pool == NULL || pool->idle_cnt >= pool->size ||
+        flow->handle == NULL || !flow->everConnected ||
+        flow->isDraining || flow->isTFODeferred ||
+        (conn = calloc(1, sizeof(struct neat_pool_conn))) == NULL) {
+        neat_free_flow(flow);
+        return;
+    }
+
+    conn->pool = pool;
+    conn->flow = flow;
+    conn->idle_since = uv_now(ctx->loop);
+    conn->ops.userData = conn;
+    conn->ops.on_error = neat_pool_on_error;
+    conn->ops.on_readable = neat_pool_on_readable;
+    TAILQ_INSERT_HEAD(&pool->idle, conn, next_conn);
+    pool->idle_cnt++;
+
+    neat_set_operations(ctx, flow, &conn->ops);
+    neat_flow_update_poll(flow);
+}
+
+void neat_pool_cleanup(struct neat_ctx *ctx)
+{
+    while (!LIST_EMPTY(&ctx->pools))
+        neat_pool_free(ctx, LIST_FIRST(&ctx->pools));
+}
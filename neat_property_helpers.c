@@ -1,5 +1,6 @@
 #include "neat_property_helpers.h"
 #include "neat.h"
+#include "neat_internal.h"
 
 uint8_t neat_property_translate_protocols(uint64_t propertyMask,
         int protocols[])
@@ -12,7 +13,8 @@ uint8_t neat_property_translate_protocols(uint64_t propertyMask,
     if ((propertyMask & NEAT_PROPERTY_SCTP_BANNED) &&
         (propertyMask & NEAT_PROPERTY_TCP_BANNED) &&
         (propertyMask & NEAT_PROPERTY_UDP_BANNED) &&
-        (propertyMask & NEAT_PROPERTY_UDPLITE_BANNED))
+        (propertyMask & NEAT_PROPERTY_UDPLITE_BANNED) &&
+        (propertyMask & NEAT_PROPERTY_MPTCP_BANNED))
         return nr_of_protocols;
     if ((propertyMask & NEAT_PROPERTY_CONGESTION_CONTROL_REQUIRED) &&
         (propertyMask & NEAT_PROPERTY_CONGESTION_CONTROL_BANNED))
@@ -32,6 +34,9 @@ uint8_t neat_property_translate_protocols(uint64_t propertyMask,
     if ((propertyMask & NEAT_PROPERTY_UDPLITE_REQUIRED) &&
         (propertyMask & NEAT_PROPERTY_UDPLITE_BANNED))
         return nr_of_protocols;
+    if ((propertyMask & NEAT_PROPERTY_MPTCP_REQUIRED) &&
+        (propertyMask & NEAT_PROPERTY_MPTCP_BANNED))
+        return nr_of_protocols;
 
     /* Check explicit protocol requests first */
     if (propertyMask & NEAT_PROPERTY_SCTP_REQUIRED) {
@@ -39,6 +44,7 @@ uint8_t neat_property_translate_protocols(uint64_t propertyMask,
         if (((propertyMask & NEAT_PROPERTY_TCP_REQUIRED) == 0) &&
             ((propertyMask & NEAT_PROPERTY_UDP_REQUIRED) == 0) &&
             ((propertyMask & NEAT_PROPERTY_UDPLITE_REQUIRED) == 0) &&
+            ((propertyMask & NEAT_PROPERTY_MPTCP_REQUIRED) == 0) &&
             ((propertyMask & NEAT_PROPERTY_CONGESTION_CONTROL_BANNED) == 0))
             protocols[nr_of_protocols++] = IPPROTO_SCTP;
 #endif
@@ -48,6 +54,7 @@ uint8_t neat_property_translate_protocols(uint64_t propertyMask,
         if (((propertyMask & NEAT_PROPERTY_SCTP_REQUIRED) == 0) &&
             ((propertyMask & NEAT_PROPERTY_UDP_REQUIRED) == 0) &&
             ((propertyMask & NEAT_PROPERTY_UDPLITE_REQUIRED) == 0) &&
+            ((propertyMask & NEAT_PROPERTY_MPTCP_REQUIRED) == 0) &&
             ((propertyMask & NEAT_PROPERTY_MESSAGE) == 0) &&
             ((propertyMask & NEAT_PROPERTY_CONGESTION_CONTROL_BANNED) == 0) &&
             ((propertyMask & NEAT_PROPERTY_RETRANSMISSIONS_BANNED) == 0))
@@ -58,6 +65,7 @@ uint8_t neat_property_translate_protocols(uint64_t propertyMask,
         if (((propertyMask & NEAT_PROPERTY_SCTP_REQUIRED) == 0) &&
             ((propertyMask & NEAT_PROPERTY_TCP_REQUIRED) == 0) &&
             ((propertyMask & NEAT_PROPERTY_UDPLITE_REQUIRED) == 0) &&
+            ((propertyMask & NEAT_PROPERTY_MPTCP_REQUIRED) == 0) &&
             ((propertyMask & NEAT_PROPERTY_CONGESTION_CONTROL_REQUIRED) == 0) &&
             ((propertyMask & NEAT_PROPERTY_RETRANSMISSIONS_REQUIRED) == 0))
             protocols[nr_of_protocols++] = IPPROTO_UDP;
@@ -68,6 +76,7 @@ uint8_t neat_property_translate_protocols(uint64_t propertyMask,
         if (((propertyMask & NEAT_PROPERTY_SCTP_REQUIRED) == 0) &&
             ((propertyMask & NEAT_PROPERTY_TCP_REQUIRED) == 0) &&
             ((propertyMask & NEAT_PROPERTY_UDP_REQUIRED) == 0) &&
+            ((propertyMask & NEAT_PROPERTY_MPTCP_REQUIRED) == 0) &&
             ((propertyMask & NEAT_PROPERTY_CONGESTION_CONTROL_REQUIRED) == 0) &&
             ((propertyMask & NEAT_PROPERTY_RETRANSMISSIONS_REQUIRED) == 0))
             protocols[nr_of_protocols++] = IPPROTO_UDPLITE;
@@ -75,11 +84,32 @@ uint8_t neat_property_translate_protocols(uint64_t propertyMask,
         return nr_of_protocols;
     }
 
+    if (propertyMask & NEAT_PROPERTY_MPTCP_REQUIRED) {
+#ifdef IPPROTO_MPTCP
+        if (((propertyMask & NEAT_PROPERTY_SCTP_REQUIRED) == 0) &&
+            ((propertyMask & NEAT_PROPERTY_TCP_REQUIRED) == 0) &&
+            ((propertyMask & NEAT_PROPERTY_UDP_REQUIRED) == 0) &&
+            ((propertyMask & NEAT_PROPERTY_UDPLITE_REQUIRED) == 0) &&
+            ((propertyMask & NEAT_PROPERTY_MESSAGE) == 0) &&
+            ((propertyMask & NEAT_PROPERTY_CONGESTION_CONTROL_BANNED) == 0) &&
+            ((propertyMask & NEAT_PROPERTY_RETRANSMISSIONS_BANNED) == 0))
+            protocols[nr_of_protocols++] = IPPROTO_MPTCP;
+#endif
+        return nr_of_protocols;
+    }
+
     /* Finally the more complex part */
     if (propertyMask & NEAT_PROPERTY_CONGESTION_CONTROL_REQUIRED) {
 #ifdef IPPROTO_SCTP
         if ((propertyMask & NEAT_PROPERTY_SCTP_BANNED) == 0)
             protocols[nr_of_protocols++] = IPPROTO_SCTP;
+#endif
+        /* MPTCP is preferred, plain TCP is the fallback */
+#ifdef IPPROTO_MPTCP
+        if (((propertyMask & NEAT_PROPERTY_MESSAGE) == 0) &&
+            ((propertyMask & NEAT_PROPERTY_RETRANSMISSIONS_BANNED) == 0) &&
+            ((propertyMask & NEAT_PROPERTY_MPTCP_BANNED) == 0))
+            protocols[nr_of_protocols++] = IPPROTO_MPTCP;
 #endif
         if (((propertyMask & NEAT_PROPERTY_MESSAGE) == 0) &&
             ((propertyMask & NEAT_PROPERTY_RETRANSMISSIONS_BANNED) == 0) &&
@@ -98,6 +128,13 @@ uint8_t neat_property_translate_protocols(uint64_t propertyMask,
 #ifdef IPPROTO_SCTP
         if ((propertyMask & NEAT_PROPERTY_SCTP_BANNED) == 0)
             protocols[nr_of_protocols++] = IPPROTO_SCTP;
+#endif
+        /* MPTCP is preferred, plain TCP is the fallback */
+#ifdef IPPROTO_MPTCP
+        if (((propertyMask & NEAT_PROPERTY_MESSAGE) == 0) &&
+            ((propertyMask & NEAT_PROPERTY_RETRANSMISSIONS_BANNED) == 0) &&
+            ((propertyMask & NEAT_PROPERTY_MPTCP_BANNED) == 0))
+            protocols[nr_of_protocols++] = IPPROTO_MPTCP;
 #endif
         if (((propertyMask & NEAT_PROPERTY_MESSAGE) == 0) &&
             ((propertyMask & NEAT_PROPERTY_RETRANSMISSIONS_BANNED) == 0) &&
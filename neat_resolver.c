@@ -2,8 +2,10 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <fnmatch.h>
 #include <arpa/inet.h>
 #include <string.h>
+#include <strings.h>
 #include <uv.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -14,16 +16,19 @@
     #include <net/if.h>
 #endif
 
-// todo - dotted decimals, localhost, /etc/hosts may not work here..
-
 #include "neat.h"
 #include "neat_internal.h"
 #include "neat_core.h"
 #include "neat_addr.h"
 #include "neat_resolver.h"
 
-static uint8_t neat_resolver_create_pairs(struct neat_resolver *resolver,
+static uint8_t neat_resolver_source_usable(struct neat_resolver *resolver,
+        struct neat_addr *src_addr);
+static uint8_t neat_resolver_add_next_pair(struct neat_resolver *resolver,
         struct neat_addr *src_addr);
+static void neat_resolver_retrans_cb(uv_timer_t *handle);
+static void neat_resolver_retrans_start(struct neat_resolver *resolver);
+static void neat_resolver_refresh_cb(uv_timer_t *handle);
 static void neat_resolver_delete_pairs(struct neat_resolver *resolver,
         struct neat_addr *addr_to_delete);
 
@@ -35,14 +40,12 @@ static void neat_resolver_handle_newaddr(struct neat_ctx *nc,
     struct neat_resolver *resolver = p_ptr;
     struct neat_addr *src_addr = data;
 
-    if (resolver->family && resolver->family != src_addr->family)
-        return;
-
-    //Ignore addresses that are deprecated
-    if (src_addr->family == AF_INET6 && !src_addr->u.v6.ifa_pref)
+    //Queries are sent by the leader of a coalesced lookup
+    if (resolver->leader != NULL ||
+        !neat_resolver_source_usable(resolver, src_addr))
         return;
 
-    neat_resolver_create_pairs(resolver, src_addr);
+    neat_resolver_add_next_pair(resolver, src_addr);
 }
 
 static void neat_resolver_handle_deladdr(struct neat_ctx *nic,
@@ -74,17 +77,10 @@ static void neat_resolver_cleanup_pair(struct neat_resolver_src_dst_addr *pair)
     if (pair->dns_snd_buf)
         ldns_buffer_free(pair->dns_snd_buf);
 
+    pair->dns_snd_buf = NULL;
     pair->closed = 1;
 }
 
-//This callback is called when we close a UDP socket (handle) and allows us to
-//free any allocated resource. In our case, this is only the dns_snd_buf
-static void neat_resolver_close_cb(uv_handle_t *handle)
-{
-    struct neat_resolver_src_dst_addr *resolver_pair = handle->data;
-    neat_resolver_cleanup_pair(resolver_pair);
-}
-
 static void neat_resolver_flush_pairs_del(struct neat_resolver *resolver)
 {
     struct neat_resolver_src_dst_addr *resolver_pair, *resolver_itr;
@@ -99,10 +95,36 @@ static void neat_resolver_flush_pairs_del(struct neat_resolver *resolver)
             continue;
 
         LIST_REMOVE(resolver_pair, next_pair);
+        free(resolver_pair->resolved_addrs);
         free(resolver_pair);
     }
 }
 
+//The last handle of a released resolver is closed, so memory can be freed
+static void neat_resolver_timer_close_cb(uv_handle_t *handle)
+{
+    struct neat_resolver *resolver = handle->data;
+
+    if (resolver->cleanup)
+        resolver->cleanup(resolver);
+}
+
+static void neat_resolver_timeout_close_cb(uv_handle_t *handle)
+{
+    struct neat_resolver *resolver = handle->data;
+
+    uv_close((uv_handle_t*) &(resolver->retrans_handle),
+            neat_resolver_timer_close_cb);
+}
+
+static void neat_resolver_idle_close_cb(uv_handle_t *handle)
+{
+    struct neat_resolver *resolver = handle->data;
+
+    uv_close((uv_handle_t*) &(resolver->timeout_handle),
+            neat_resolver_timeout_close_cb);
+}
+
 //This callback is called before libuv polls for I/O and is by default run on
 //every iteration. We use it to free memory used by the resolver, and it is only
 //active when this is relevant. I.e., we only start the idle handle when
@@ -119,9 +141,12 @@ static void neat_resolver_idle_cb(uv_idle_t *handle)
 
     uv_idle_stop(&(resolver->idle_handle));
 
-    //Only call cleanup when library user has marked that it is safe
-    if (resolver->free_resolver && resolver->cleanup)
-        resolver->cleanup(resolver);
+    //Only call cleanup when library user has marked that it is safe. A
+    //released resolver will never be used again, so its handles must be
+    //closed before the memory can be freed. Cleanup is called when that is done
+    if (resolver->free_resolver)
+        uv_close((uv_handle_t*) &(resolver->idle_handle),
+                neat_resolver_idle_close_cb);
 }
 
 static uint8_t neat_resolver_addr_internal(struct sockaddr_storage *addr)
@@ -146,6 +171,118 @@ static uint8_t neat_resolver_addr_internal(struct sockaddr_storage *addr)
         return 0;
 }
 
+//Check if if_name matches one of the shell patterns in patterns, which are
+//separated by commas or spaces
+static uint8_t neat_resolver_if_match(const char *patterns,
+        const char *if_name)
+{
+    char pattern[MAX_DOMAIN_LENGTH];
+    size_t len;
+
+    while (*patterns) {
+        len = strcspn(patterns, ", ");
+
+        if (len && len < sizeof(pattern)) {
+            memcpy(pattern, patterns, len);
+            pattern[len] = '\0';
+
+            if (!fnmatch(pattern, if_name, 0))
+                return 1;
+        }
+
+        patterns += len;
+        patterns += strspn(patterns, ", ");
+    }
+
+    return 0;
+}
+
+//Sources are used for lookups, and flows, unless they are of another family,
+//deprecated or left out by the interface filter of the context
+static uint8_t neat_resolver_source_usable(struct neat_resolver *resolver,
+        struct neat_addr *src_addr)
+{
+    struct neat_ctx *nc = resolver->nc;
+
+    if (resolver->family && src_addr->family != resolver->family)
+        return 0;
+
+    //Do not use deprecated addresses
+    if (src_addr->family == AF_INET6 && !src_addr->u.v6.ifa_pref)
+        return 0;
+
+    if (nc->if_include != NULL &&
+        !neat_resolver_if_match(nc->if_include, src_addr->if_name))
+        return 0;
+
+    if (nc->if_exclude != NULL &&
+        neat_resolver_if_match(nc->if_exclude, src_addr->if_name))
+        return 0;
+
+    return 1;
+}
+
+//Number of protocols results are created for
+static uint8_t neat_resolver_num_protocols(struct neat_resolver *resolver)
+{
+    uint8_t i;
+
+    for (i = 0; i < NEAT_MAX_NUM_PROTO; i++)
+        if (!resolver->ai_protocol[i])
+            break;
+
+    return i;
+}
+
+//Room for max_res results from max_srcs sources is allocated together with the
+//list, so that it is freed with one free
+static struct neat_resolver_results *neat_resolver_results_alloc(
+        uint32_t max_res, uint32_t max_srcs)
+{
+    struct neat_resolver_results *results;
+
+    results = calloc(1, sizeof(struct neat_resolver_results) +
+            max_res * sizeof(struct neat_resolver_res) +
+            max_srcs * sizeof(struct neat_resolver_src));
+
+    if (results == NULL)
+        return NULL;
+
+    results->res = (struct neat_resolver_res *) (results + 1);
+    results->srcs = (struct neat_resolver_src *) (results->res + max_res);
+    results->max_res = max_res;
+    results->max_srcs = max_srcs;
+    return results;
+}
+
+//Find the entry of src_addr among the sources of the list, or add it
+static struct neat_resolver_src *neat_resolver_results_src(
+        struct neat_resolver_results *results, struct neat_addr *src_addr)
+{
+    struct neat_resolver_src *src;
+    socklen_t addrlen = src_addr->family == AF_INET ?
+        sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+    uint32_t i;
+
+    for (i = 0; i < results->num_srcs; i++) {
+        src = &(results->srcs[i]);
+
+        if (src->if_idx == src_addr->if_idx && src->addr_len == addrlen &&
+            !memcmp(&(src->addr), &(src_addr->u.generic.addr), addrlen))
+            return src;
+    }
+
+    if (results->num_srcs >= results->max_srcs)
+        return NULL;
+
+    src = &(results->srcs[results->num_srcs++]);
+    src->if_idx = src_addr->if_idx;
+    src->addr_len = addrlen;
+    src->temporary = src_addr->temporary;
+    memcpy(&(src->addr), &(src_addr->u.generic.addr), addrlen);
+    return src;
+}
+
 //Create all results for one match
 static uint8_t neat_resolver_fill_results(
         struct neat_resolver *resolver,
@@ -154,29 +291,29 @@ static uint8_t neat_resolver_fill_results(
         struct sockaddr_storage dst_addr)
 {
     socklen_t addrlen;
-    struct sockaddr_in *addr4;
+    struct neat_resolver_src *src;
     struct neat_resolver_res *result;
     uint8_t i;
     uint8_t num_addr_added = 0;
 
+    if ((src = neat_resolver_results_src(result_list, src_addr)) == NULL)
+        return 0;
+
+    addrlen = src->addr_len;
+
     for (i = 0; i < NEAT_MAX_NUM_PROTO; i++) {
         if (!resolver->ai_protocol[i])
             break;
 
-        result = calloc(sizeof(struct neat_resolver_res), 1);
-
-        if (result == NULL)
-            continue;
+        if (result_list->num_res >= result_list->max_res)
+            break;
 
-        addrlen = src_addr->family == AF_INET ?
-            sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+        result = &(result_list->res[result_list->num_res++]);
 
         result->ai_family = src_addr->family;
         result->ai_protocol = resolver->ai_protocol[i];
-        result->if_idx = src_addr->if_idx;
-        result->src_addr = src_addr->u.generic.addr;
-        result->src_addr_len = addrlen;
-        result->dst_addr = dst_addr;
+        result->src = src;
+        memcpy(&(result->dst_addr), &dst_addr, addrlen);
         result->dst_addr_len = addrlen;
         result->internal = neat_resolver_addr_internal(&dst_addr);
 
@@ -195,8 +332,7 @@ static uint8_t neat_resolver_fill_results(
 
         //Head of sockaddr_in and sockaddr_in6 is the same, so this is safe
         //for setting port
-        addr4 = (struct sockaddr_in*) &(result->dst_addr);
-        addr4->sin_port = resolver->dst_port;
+        result->dst_addr.v4.sin_port = resolver->dst_port;
 
         LIST_INSERT_HEAD(result_list, result, next_res);
         num_addr_added++;
@@ -205,542 +341,1754 @@ static uint8_t neat_resolver_fill_results(
     return num_addr_added;
 }
 
-//This timeout is used when we "resolve" a literal. It works slightly different
-//than the normal resolver timeout function. We just iterate through source
-//addresses can create a result structure for those that match
-static void neat_resolver_literal_timeout_cb(uv_timer_t *handle)
+//Number of the num_addrs addresses of a reply that are passed on
+static uint8_t neat_resolver_num_answers(struct neat_ctx *nc, uint8_t num_addrs)
 {
-    struct neat_resolver *resolver = handle->data;
-    struct neat_resolver_results *result_list;
-    uint32_t num_resolved_addrs = 0;
-    struct neat_addr *nsrc_addr = NULL;
-    void *dst_addr_pton = NULL;
-    struct sockaddr_storage dst_addr;
-    union {
-        struct sockaddr_in *dst_addr4;
-        struct sockaddr_in6 *dst_addr6;
-    } u;
+    if (nc->max_answers && nc->max_answers < num_addrs)
+        return nc->max_answers;
 
-    //There were no addresses available, so return error
-    //TODO: Consider adding a different error
-    if (!resolver->nc->src_addr_cnt) {
-        resolver->handle_resolve(resolver, NULL, NEAT_RESOLVER_ERROR);
-        return;
-    }
+    return num_addrs;
+}
 
-    //Signal internal error
-    if ((result_list =
-                calloc(sizeof(struct neat_resolver_results), 1)) == NULL) {
-        resolver->handle_resolve(resolver, NULL, NEAT_RESOLVER_ERROR);
-        return;
-    }
+//Expected cost of connecting to addr from src_addr, the lowest for the
+//protocols of the lookup. See neat_cib_score
+static uint32_t neat_resolver_score(struct neat_resolver *resolver,
+        struct neat_addr *src_addr, const union neat_dns_addr *addr)
+{
+    struct neat_resolver_src src;
+    struct neat_resolver_res res;
+    uint32_t score, best = UINT32_MAX;
+    uint8_t i;
 
-    if (resolver->family == AF_INET) {
-        u.dst_addr4 = (struct sockaddr_in*) &dst_addr;
-        u.dst_addr4->sin_family = AF_INET;
-        u.dst_addr4->sin_port = resolver->dst_port;
-        dst_addr_pton = &(u.dst_addr4->sin_addr);
+    memset(&src, 0, sizeof(src));
+    memset(&res, 0, sizeof(res));
+    src.if_idx = src_addr->if_idx;
+    res.src = &src;
+    res.ai_family = src_addr->family;
+
+    if (src_addr->family == AF_INET) {
+        src.addr.v4 = src_addr->u.v4.addr4;
+        res.dst_addr.v4.sin_family = AF_INET;
+        res.dst_addr.v4.sin_addr = addr->v4;
     } else {
-        u.dst_addr6 = (struct sockaddr_in6*) &dst_addr;
-        u.dst_addr6->sin6_family = AF_INET6;
-        u.dst_addr6->sin6_port = resolver->dst_port;
-        dst_addr_pton = &(u.dst_addr6->sin6_addr);
+        src.addr.v6 = src_addr->u.v6.addr6;
+        res.dst_addr.v6.sin6_family = AF_INET6;
+        res.dst_addr.v6.sin6_addr = addr->v6;
     }
 
-    //We already know that this will be successful, it was checked in the
-    //literal-check performed earlier
-    inet_pton(resolver->family, resolver->domain_name, dst_addr_pton);
-
-    LIST_INIT(result_list);
+    for (i = 0; i < NEAT_MAX_NUM_PROTO && resolver->ai_protocol[i]; i++) {
+        res.ai_protocol = resolver->ai_protocol[i];
 
-    for (nsrc_addr = resolver->nc->src_addrs.lh_first; nsrc_addr != NULL;
-            nsrc_addr = nsrc_addr->next_addr.le_next) {
-        //Family is always set for literals
-        if (nsrc_addr->family != resolver->family)
-            continue;
+        if ((score = neat_cib_score(resolver->nc, &res)) < best)
+            best = score;
+    }
 
-        //Do not use deprecated addresses
-        if (nsrc_addr->family == AF_INET6 && !nsrc_addr->u.v6.ifa_pref)
-            continue;
+    return best;
+}
 
-        num_resolved_addrs += neat_resolver_fill_results(resolver, result_list,
-                nsrc_addr, dst_addr);
+//Pick which of the num_addrs addresses received for src_addr are passed on,
+//following the answer policy of the context. Their indexes are written to
+//selected, most preferred first. Returns how many were picked
+static uint8_t neat_resolver_select(struct neat_resolver *resolver,
+        struct neat_addr *src_addr, const union neat_dns_addr *addrs,
+        uint8_t num_addrs, uint8_t *selected)
+{
+    uint32_t scores[DNS_MAX_ANSWERS];
+    uint8_t num_selected = neat_resolver_num_answers(resolver->nc, num_addrs);
+    uint8_t i, j, best, tmp;
+
+    for (i = 0; i < num_addrs; i++)
+        selected[i] = i;
+
+    switch (resolver->nc->answer_policy) {
+    case NEAT_ANSWER_POLICY_RANDOM:
+        //The first num_selected steps of a Fisher-Yates shuffle
+        for (i = 0; i < num_selected; i++) {
+            j = i + random() % (num_addrs - i);
+            tmp = selected[i];
+            selected[i] = selected[j];
+            selected[j] = tmp;
+        }
+        break;
+    case NEAT_ANSWER_POLICY_RTT:
+        for (i = 0; i < num_addrs; i++)
+            scores[i] = neat_resolver_score(resolver, src_addr, &(addrs[i]));
+
+        //Only the part that is used is sorted. Ties keep the order of the
+        //reply
+        for (i = 0; i < num_selected; i++) {
+            for (best = i, j = i + 1; j < num_addrs; j++)
+                if (scores[selected[j]] < scores[selected[best]])
+                    best = j;
+
+            tmp = selected[best];
+            memmove(&(selected[i + 1]), &(selected[i]), best - i);
+            selected[i] = tmp;
+        }
+        break;
+    default:
+        break;
     }
 
-    if (!num_resolved_addrs)
-        resolver->handle_resolve(resolver, NULL, NEAT_RESOLVER_ERROR);
-    else
-        resolver->handle_resolve(resolver, result_list, NEAT_RESOLVER_OK);
+    return num_selected;
 }
 
-//Called when timeout expires. This function will pass the results of the DNS
-//query to the application using NEAT
-static void neat_resolver_timeout_cb(uv_timer_t *handle)
+//Create the results for the addresses received for src_addr that are picked
+//by the answer policy
+static uint32_t neat_resolver_fill_answers(struct neat_resolver *resolver,
+        struct neat_resolver_results *result_list, struct neat_addr *src_addr,
+        const union neat_dns_addr *addrs, uint8_t num_addrs)
 {
-    struct neat_resolver *resolver = handle->data;
-    struct neat_resolver_src_dst_addr *pair_itr = NULL;
-    struct neat_resolver_results *result_list;
-    uint32_t num_resolved_addrs = 0;
-    uint8_t i;
+    struct sockaddr_storage dst_addr;
+    uint8_t selected[DNS_MAX_ANSWERS];
+    uint32_t num_addr_added = 0;
+    uint8_t num_selected, i;
 
-    //DNS timeout, call DNS callback with timeout error code
-    if (!resolver->name_resolved_timeout) {
-        resolver->handle_resolve(resolver, NULL, NEAT_RESOLVER_TIMEOUT);
-        return;
-    }
+    num_selected = neat_resolver_select(resolver, src_addr, addrs, num_addrs,
+                                        selected);
 
-    //Signal internal error
-    if ((result_list =
-                calloc(sizeof(struct neat_resolver_results), 1)) == NULL) {
-        resolver->handle_resolve(resolver, NULL, NEAT_RESOLVER_ERROR);
-        return;
+    for (i = 0; i < num_selected; i++) {
+        memset(&dst_addr, 0, sizeof(dst_addr));
+
+        if (src_addr->family == AF_INET) {
+            ((struct sockaddr_in *) &dst_addr)->sin_family = AF_INET;
+            ((struct sockaddr_in *) &dst_addr)->sin_addr =
+                addrs[selected[i]].v4;
+        } else {
+            ((struct sockaddr_in6 *) &dst_addr)->sin6_family = AF_INET6;
+            ((struct sockaddr_in6 *) &dst_addr)->sin6_addr =
+                addrs[selected[i]].v6;
+        }
+
+        num_addr_added += neat_resolver_fill_results(resolver, result_list,
+                                                     src_addr, dst_addr);
     }
 
-    LIST_INIT(result_list);
-    pair_itr = resolver->resolver_pairs.lh_first;
+    return num_addr_added;
+}
 
-    //Iterate through all receiver pairs and create neat_resolver_res
-    while (pair_itr != NULL) {
-        //Resolve has not been completed
-        if (!pair_itr->resolved_addr[0].ss_family) {
-            pair_itr = pair_itr->next_pair.le_next;
-            continue;
-        }
+//Names are compared without a trailing dot, "example.com." is the same name as
+//"example.com"
+static uint8_t neat_resolver_name_equal(const char *name1, const char *name2)
+{
+    size_t len1 = strlen(name1), len2 = strlen(name2);
 
-        for (i = 0; i < MAX_NUM_RESOLVED; i++) {
-            //Resolved addresses are added linearly, so if this is empty then
-            //that is the end of result list
-            if (!pair_itr->resolved_addr[i].ss_family)
-                break;
+    if (len1 && name1[len1 - 1] == '.')
+        len1--;
 
-            if (pair_itr->src_addr->family == AF_INET6 &&
-                !pair_itr->src_addr->u.v6.ifa_pref)
-                return;
+    if (len2 && name2[len2 - 1] == '.')
+        len2--;
 
-            num_resolved_addrs += neat_resolver_fill_results(resolver,
-                    result_list, pair_itr->src_addr,
-                    pair_itr->resolved_addr[i]);
+    return len1 == len2 && !strncasecmp(name1, name2, len1);
+}
+
+//The answer cache is shared by all resolvers of a context. It is keyed by
+//(name, record type, source interface), since the answer can depend on the
+//network the question was sent on
+static struct neat_dns_cache_entry *neat_resolver_cache_lookup(
+        struct neat_ctx *nc, const char *name, uint16_t rr_type,
+        uint32_t if_idx)
+{
+    struct neat_dns_cache_entry *entry, *next_entry;
+    uint64_t now = uv_now(nc->loop);
+
+    TAILQ_FOREACH_SAFE(entry, &(nc->dns_cache), next_entry, next_entry) {
+        if (entry->expires <= now) {
+            TAILQ_REMOVE(&(nc->dns_cache), entry, next_entry);
+            free(entry);
+            nc->dns_cache_cnt--;
+            continue;
         }
 
-        pair_itr = pair_itr->next_pair.le_next;
+        if (entry->rr_type != rr_type || entry->if_idx != if_idx ||
+            !neat_resolver_name_equal(entry->name, name))
+            continue;
+
+        //Keep recently used entries at the head
+        TAILQ_REMOVE(&(nc->dns_cache), entry, next_entry);
+        TAILQ_INSERT_HEAD(&(nc->dns_cache), entry, next_entry);
+        return entry;
     }
 
-    if (!num_resolved_addrs)
-        resolver->handle_resolve(resolver, NULL, NEAT_RESOLVER_ERROR);
-    else
-        resolver->handle_resolve(resolver, result_list, NEAT_RESOLVER_OK);
+    return NULL;
 }
 
-//Called when a DNS request has been (i.e., passed to socket). We will send the
-//second query (used for checking poisoning) here. If that is needed
-static void neat_resolver_dns_sent_cb(uv_udp_send_t *req, int status)
+//A positive answer that has been used often enough since it was stored is
+//looked up again before it expires, so that lookups never have to wait for it
+static uint8_t neat_resolver_cache_popular(struct neat_ctx *nc,
+        struct neat_dns_cache_entry *entry)
 {
-    //Callback will be used to send the follow-up request to check for errors
-    //printf("UDP send callback\n");
+    return nc->dns_refresh_hits && entry->num_addrs && !entry->refreshing &&
+        entry->refresh_at && entry->hits >= nc->dns_refresh_hits;
 }
 
-//libuv gives the user control of how memory is allocated. This callback is
-//called when a UDP packet is ready to received, and we have to fill out the
-//provided buf with the storage location (and available size)
-static void neat_resolver_dns_alloc_cb(uv_handle_t *handle,
-        size_t suggested_size, uv_buf_t *buf)
+//Make sure the refresh timer fires in time for entry
+static void neat_resolver_refresh_schedule(struct neat_ctx *nc,
+        struct neat_dns_cache_entry *entry)
 {
-    struct neat_resolver_src_dst_addr *pair = handle->data;
+    uint64_t now = uv_now(nc->loop);
+
+    if (!neat_resolver_cache_popular(nc, entry) ||
+        (nc->dns_refresh_at && nc->dns_refresh_at <= entry->refresh_at))
+        return;
 
-    buf->base = pair->dns_rcv_buf;
-    buf->len = sizeof(pair->dns_rcv_buf);
+    nc->dns_refresh_at = entry->refresh_at;
+    uv_timer_start(&(nc->dns_refresh_handle), neat_resolver_refresh_cb,
+            entry->refresh_at > now ? entry->refresh_at - now : 0, 0);
 }
 
-//Internal NEAT resolver functions
-//Deletes have to happen async so that libuv can do internal clean-up. I.e., we
-//can't just free memory and that is that. This function marks a resolver pair
-//as ready for deletion
-static void neat_resolver_mark_pair_del(struct neat_resolver_src_dst_addr *pair)
+//Start a lookup for every popular name that is due, and restart the timer for
+//the next one. One lookup refreshes the name for every interface and family
+static void neat_resolver_refresh_cb(uv_timer_t *handle)
 {
-    struct neat_resolver *resolver = pair->resolver;
+    struct neat_ctx *nc = handle->data;
+    struct neat_dns_cache_entry *entry, *other;
+    uint64_t now = uv_now(nc->loop);
+
+    nc->dns_refresh_at = 0;
+
+    TAILQ_FOREACH(entry, &(nc->dns_cache), next_entry) {
+        if (!neat_resolver_cache_popular(nc, entry) || entry->expires <= now)
+            continue;
+
+        if (entry->refresh_at > now) {
+            neat_resolver_refresh_schedule(nc, entry);
+            continue;
+        }
 
-    if (uv_is_active((uv_handle_t*) &(pair->resolve_handle))) {
-        uv_udp_recv_stop(&(pair->resolve_handle));
-        uv_close((uv_handle_t*) &(pair->resolve_handle), neat_resolver_close_cb);
+        //A name that could not be looked up is tried again when the entry
+        //is used next, if it has not expired by then
+        if (neat_resolver_prefetch_start(nc, entry->name, 1)) {
+            entry->hits = 0;
+            continue;
+        }
+
+        TAILQ_FOREACH(other, &(nc->dns_cache), next_entry)
+            if (neat_resolver_name_equal(other->name, entry->name))
+                other->refreshing = 1;
     }
+}
 
-    if (pair->next_pair.le_next != NULL || pair->next_pair.le_prev != NULL)
-        LIST_REMOVE(pair, next_pair);
+//When a positive answer with this TTL is to be refreshed, 0 if never
+static uint64_t neat_resolver_cache_refresh_at(uint64_t now, uint32_t ttl)
+{
+    uint64_t lifetime = 1000 * (uint64_t) ttl, ahead = lifetime / 10;
 
-    LIST_INSERT_HEAD(&(resolver->resolver_pairs_del), pair,
-            next_pair);
+    if (ttl < DNS_REFRESH_MIN_TTL)
+        return 0;
 
-    //We can't free memory right away, libuv has to be allowed to
-    //perform internal clean-up first. This is done after loop is done
-    //(uv__run_closing_handles), so we use idle (which is called in the
-    //next iteration and before polling)
-    if (uv_backend_fd(resolver->nc->loop) != -1 &&
-        !uv_is_active((uv_handle_t*) &(resolver->idle_handle)))
-        uv_idle_start(&(resolver->idle_handle), neat_resolver_idle_cb);
+    if (ahead < DNS_REFRESH_MIN_AHEAD)
+        ahead = DNS_REFRESH_MIN_AHEAD;
+
+    return now + lifetime - ahead;
 }
 
-static uint8_t neat_resolver_check_duplicate(
-        struct neat_resolver_src_dst_addr *pair, const char *resolved_addr_str)
+//Add an answer to the cache. Addresses are merged into a cached positive
+//answer, and a positive answer replaces a negative one, or one that is being
+//refreshed. An answer without addresses is negative, it never replaces a
+//positive one
+static void neat_resolver_cache_store(struct neat_ctx *nc, const char *name,
+        uint16_t rr_type, uint32_t if_idx, union neat_dns_addr *addrs,
+        uint8_t num_addrs, uint32_t ttl)
 {
-    //Accepts a src_dst_pair and an address, convert this address to struct
-    //in{6}_addr, then check all pairs if this IP has seen before for same
-    //(index, source)
-    struct neat_addr *src_addr = pair->src_addr;
-    struct sockaddr_in *src_addr_4 = NULL, *cmp_addr_4 = NULL;
-    struct sockaddr_in6 *src_addr_6 = NULL, *cmp_addr_6 = NULL;
-    union {
-        struct in_addr resolved_addr_4;
-        struct in6_addr resolved_addr_6;
-    } u;
-    struct neat_resolver_src_dst_addr *itr;
-    uint8_t addr_equal = 0;
-    int32_t i;
+    struct neat_dns_cache_entry *entry;
+    size_t name_len = strlen(name) + 1;
+    size_t addr_len = rr_type == LDNS_RR_TYPE_A ?
+        sizeof(struct in_addr) : sizeof(struct in6_addr);
+    uint64_t now = uv_now(nc->loop);
+    uint64_t expires = now + 1000 * (uint64_t) ttl;
+    uint64_t refresh_at = neat_resolver_cache_refresh_at(now, ttl);
+    uint8_t i, j;
+
+    if (!ttl)
+        return;
 
-    if (src_addr->family == AF_INET) {
-        src_addr_4 = &(src_addr->u.v4.addr4);
-        i = inet_pton(AF_INET, resolved_addr_str,
-                (void *) &u.resolved_addr_4);
+    entry = neat_resolver_cache_lookup(nc, name, rr_type, if_idx);
+
+    if (entry != NULL) {
+        if (!num_addrs)
+            return;
+
+        if (!entry->num_addrs || entry->refreshing) {
+            entry->num_addrs = 0;
+            entry->refreshing = 0;
+            entry->hits = 0;
+            entry->expires = expires;
+            entry->refresh_at = refresh_at;
+        }
     } else {
-        src_addr_6 = &(src_addr->u.v6.addr6);
-        i = inet_pton(AF_INET6, resolved_addr_str,
-                (void *) &u.resolved_addr_6);
-    }
+        if (nc->dns_cache_cnt >= DNS_CACHE_SIZE) {
+            entry = TAILQ_LAST(&(nc->dns_cache), neat_dns_cache);
+            TAILQ_REMOVE(&(nc->dns_cache), entry, next_entry);
+            free(entry);
+            nc->dns_cache_cnt--;
+        }
 
-    //the calleee also does pton, so that failure will currently be handled
-    //elsewhere
-    //TODO: SO UGLY!!!!!!!!!!!!!
-    if (i <= 0)
-        return 0;
+        //Name is stored right after the entry
+        entry = calloc(1, sizeof(struct neat_dns_cache_entry) + name_len);
+        if (entry == NULL)
+            return;
+
+        entry->name = (char *) (entry + 1);
+        memcpy(entry->name, name, name_len);
+        entry->rr_type = rr_type;
+        entry->if_idx = if_idx;
+        entry->expires = expires;
+        entry->refresh_at = refresh_at;
+        TAILQ_INSERT_HEAD(&(nc->dns_cache), entry, next_entry);
+        nc->dns_cache_cnt++;
+    }
 
-    for (itr = pair->resolver->resolver_pairs.lh_first; itr != NULL;
-            itr = itr->next_pair.le_next) {
-        addr_equal = 0;
+    //The merged answer is only valid as long as its shortest lived part
+    if (expires < entry->expires)
+        entry->expires = expires;
 
-        //Must match index
-        if (src_addr->if_idx != itr->src_addr->if_idx ||
-            src_addr->family != itr->src_addr->family)
-            continue;
+    if (!refresh_at || refresh_at < entry->refresh_at)
+        entry->refresh_at = refresh_at;
 
-        if (src_addr->family == AF_INET) {
-            cmp_addr_4 = &(itr->src_addr->u.v4.addr4);
-            addr_equal = (cmp_addr_4->sin_addr.s_addr ==
-                          src_addr_4->sin_addr.s_addr);
-        } else {
-            cmp_addr_6 = &(itr->src_addr->u.v6.addr6);
-            addr_equal = neat_addr_cmp_ip6_addr(cmp_addr_6->sin6_addr,
-                                                src_addr_6->sin6_addr);
-        }
+    neat_resolver_refresh_schedule(nc, entry);
 
-        if (!addr_equal)
-            continue;
+    for (i = 0; i < num_addrs; i++) {
+        if (entry->num_addrs >= DNS_CACHE_MAX_ADDRS)
+            break;
 
-        //Check all resolved addresses
-        for (i = 0; i < MAX_NUM_RESOLVED; i++) {
-            if (!itr->resolved_addr[i].ss_family)
+        for (j = 0; j < entry->num_addrs; j++)
+            if (!memcmp(&(entry->addrs[j]), &(addrs[i]), addr_len))
                 break;
 
-            if (src_addr->family == AF_INET) {
-                cmp_addr_4 = (struct sockaddr_in*) &(itr->resolved_addr[i]);
-                addr_equal = (u.resolved_addr_4.s_addr ==
-                              cmp_addr_4->sin_addr.s_addr);
-            } else {
-                cmp_addr_6 = (struct sockaddr_in6*) &(itr->resolved_addr[i]);
-                addr_equal = neat_addr_cmp_ip6_addr(cmp_addr_6->sin6_addr,
-                                                    u.resolved_addr_6);
-            }
-
-            if (addr_equal)
-                return 1;
-        }
+        if (j == entry->num_addrs)
+            memcpy(&(entry->addrs[entry->num_addrs++]), &(addrs[i]), addr_len);
     }
-
-    return 0;
 }
 
-//Receive and parse a DNS reply
-//TODO: Refactor and make large parts helper function?
-static void neat_resolver_dns_recv_cb(uv_udp_t* handle, ssize_t nread,
-        const uv_buf_t* buf, const struct sockaddr* addr, unsigned flags)
+//Cache every address of a reply, with the lowest TTL of the records
+static void neat_resolver_cache_answer(struct neat_resolver_src_dst_addr *pair,
+        struct neat_dns_reply *reply, uint16_t rr_type)
 {
-    struct neat_resolver_src_dst_addr *pair = handle->data;
-    ldns_pkt *dns_reply;
-    //Used to store the results of the DNS query
-    ldns_rr_list *rr_list = NULL;
-    ldns_rr *rr_record = NULL;
-    ldns_buffer *host_addr = NULL;
-    ldns_rdf *rdf_result = NULL;
-    ldns_rr_type rr_type;
-    size_t retval, rr_count, i;
-    uint8_t num_resolved = 0, pton_failed = 0;
-    struct sockaddr_in *addr4;
-    struct sockaddr_in6 *addr6;
+    union neat_dns_addr addrs[DNS_CACHE_MAX_ADDRS];
+    uint32_t ttl = UINT32_MAX;
+    uint8_t i;
 
-    if (nread == 0 && addr == NULL)
-        return;
+    for (i = 0; i < reply->num_addrs; i++) {
+        addrs[i] = reply->answers[i].addr;
+
+        if (reply->answers[i].ttl < ttl)
+            ttl = reply->answers[i].ttl;
+    }
 
-    retval = ldns_wire2pkt(&dns_reply, (const uint8_t*) buf->base, nread);
+    if (reply->num_addrs)
+        neat_resolver_cache_store(pair->resolver->nc,
+                pair->resolver->domain_name, rr_type,
+                pair->src_addr->if_idx, addrs, reply->num_addrs, ttl);
+}
 
-    if (retval != LDNS_STATUS_OK)
+//Cache that the name has no address of this type (RFC 2308). Only NXDOMAIN and
+//an empty NOERROR answer say something about the name, other errors are about
+//the server
+static void neat_resolver_cache_negative(
+        struct neat_resolver_src_dst_addr *pair, struct neat_dns_reply *reply,
+        uint16_t rr_type)
+{
+    if (reply->rcode != LDNS_RCODE_NXDOMAIN &&
+        (reply->rcode != LDNS_RCODE_NOERROR || reply->ancount))
         return;
 
-    if (pair->src_addr->family == AF_INET)
-        rr_type = LDNS_RR_TYPE_A;
-    else
-        rr_type = LDNS_RR_TYPE_AAAA;
+    //The TTL of a negative answer is the lowest of the SOA TTL and minimum
+    neat_resolver_cache_store(pair->resolver->nc, pair->resolver->domain_name,
+            rr_type, pair->src_addr->if_idx, NULL, 0,
+            reply->has_soa ? reply->soa_ttl : DNS_NEGATIVE_TTL);
+}
 
-    //Parse result
-    rr_list = ldns_pkt_rr_list_by_type(dns_reply, rr_type, LDNS_SECTION_ANSWER);
+//Pass on results that are known without asking the name servers. This is
+//done from the loop, so that handle_resolve never runs before
+//neat_getaddrinfo has returned, and the flow it opens is still usable
+static void neat_resolver_complete_cb(uv_timer_t *handle)
+{
+    struct neat_resolver *resolver = handle->data;
+    struct neat_resolver_results *results = resolver->delivery_results;
 
-    if (rr_list == NULL) {
-        ldns_pkt_free(dns_reply);
-        return;
-    }
+    resolver->delivery_results = NULL;
+    resolver->handle_resolve(resolver, results, resolver->delivery_code);
+}
 
-    rr_count = ldns_rr_list_rr_count(rr_list);
+static void neat_resolver_complete(struct neat_resolver *resolver,
+        struct neat_resolver_results *results, uint8_t code)
+{
+    resolver->delivery_results = results;
+    resolver->delivery_code = code;
+    uv_timer_start(&(resolver->timeout_handle), neat_resolver_complete_cb,
+            0, 0);
+}
 
-    if (!rr_count) {
-        ldns_rr_list_deep_free(rr_list);
-        ldns_pkt_free(dns_reply);
-        return;
-    }
+//Answer a lookup from the cache, without sockets. This is only done when
+//every source address that would be used has a cached answer. Returns
+//RETVAL_SUCCESS if the results have been passed on, and RETVAL_IGNORE if the
+//cache knows that the name does not exist
+static uint8_t neat_resolver_cache_resolve(struct neat_resolver *resolver)
+{
+    struct neat_ctx *nc = resolver->nc;
+    struct neat_resolver_results *result_list;
+    struct neat_dns_cache_entry *entry;
+    struct neat_addr *nsrc_addr;
+    uint32_t num_resolved_addrs = 0, num_srcs = 0, num_dsts = 0;
+    uint16_t rr_type;
 
-    for (i=0; i<rr_count; i++) {
-        rr_record = ldns_rr_list_rr(rr_list, i);
-        rdf_result = ldns_rr_rdf(rr_record, 0);
-        host_addr = ldns_buffer_new(ldns_rdf_size(rdf_result));
+    if (TAILQ_EMPTY(&(nc->dns_cache)))
+        return RETVAL_FAILURE;
 
-        if(!host_addr)
+    for (nsrc_addr = nc->src_addrs.lh_first; nsrc_addr != NULL;
+            nsrc_addr = nsrc_addr->next_addr.le_next) {
+        if (!neat_resolver_source_usable(resolver, nsrc_addr))
             continue;
 
-        if (pair->src_addr->family == AF_INET) {
-            ldns_rdf2buffer_str_a(host_addr, rdf_result);
+        rr_type = nsrc_addr->family == AF_INET ?
+            LDNS_RR_TYPE_A : LDNS_RR_TYPE_AAAA;
 
-            if (neat_resolver_check_duplicate(pair,
-                    (const char *) ldns_buffer_begin(host_addr))) {
-                ldns_buffer_free(host_addr);
-                continue;
-            }
+        if ((entry = neat_resolver_cache_lookup(nc, resolver->domain_name,
+                        rr_type, nsrc_addr->if_idx)) == NULL)
+            return RETVAL_FAILURE;
+
+        num_srcs++;
+        num_dsts += neat_resolver_num_answers(nc, entry->num_addrs);
+    }
+
+    if (!num_srcs)
+        return RETVAL_FAILURE;
+
+    if ((result_list = neat_resolver_results_alloc(
+                    num_dsts * neat_resolver_num_protocols(resolver),
+                    num_srcs)) == NULL)
+        return RETVAL_FAILURE;
+
+    for (nsrc_addr = nc->src_addrs.lh_first; nsrc_addr != NULL;
+            nsrc_addr = nsrc_addr->next_addr.le_next) {
+        if (!neat_resolver_source_usable(resolver, nsrc_addr))
+            continue;
+
+        rr_type = nsrc_addr->family == AF_INET ?
+            LDNS_RR_TYPE_A : LDNS_RR_TYPE_AAAA;
+        entry = neat_resolver_cache_lookup(nc, resolver->domain_name, rr_type,
+                                           nsrc_addr->if_idx);
+        num_resolved_addrs += neat_resolver_fill_answers(resolver, result_list,
+                nsrc_addr, entry->addrs, entry->num_addrs);
+
+        entry->hits++;
+        neat_resolver_refresh_schedule(nc, entry);
+    }
+
+    //Only negative answers
+    if (!num_resolved_addrs) {
+        free(result_list);
+        return RETVAL_IGNORE;
+    }
+
+    neat_resolver_complete(resolver, result_list, NEAT_RESOLVER_OK);
+    return RETVAL_SUCCESS;
+}
+
+void neat_resolver_cache_flush(struct neat_ctx *nc)
+{
+    struct neat_dns_cache_entry *entry;
+
+    while ((entry = TAILQ_FIRST(&(nc->dns_cache))) != NULL) {
+        TAILQ_REMOVE(&(nc->dns_cache), entry, next_entry);
+        free(entry);
+    }
+
+    nc->dns_cache_cnt = 0;
+}
+
+//"Resolve" a literal. We just iterate through source addresses and create a
+//result structure for those that match
+static void neat_resolver_literal_resolve(struct neat_resolver *resolver)
+{
+    struct neat_resolver_results *result_list;
+    uint32_t num_resolved_addrs = 0;
+    struct neat_addr *nsrc_addr = NULL;
+    void *dst_addr_pton = NULL;
+    struct sockaddr_storage dst_addr;
+    union {
+        struct sockaddr_in *dst_addr4;
+        struct sockaddr_in6 *dst_addr6;
+    } u;
+
+    //There were no addresses available, so return error
+    //TODO: Consider adding a different error
+    if (!resolver->nc->src_addr_cnt) {
+        neat_resolver_complete(resolver, NULL, NEAT_RESOLVER_ERROR);
+        return;
+    }
+
+    //Signal internal error
+    if ((result_list = neat_resolver_results_alloc(
+                    resolver->nc->src_addr_cnt *
+                    neat_resolver_num_protocols(resolver),
+                    resolver->nc->src_addr_cnt)) == NULL) {
+        neat_resolver_complete(resolver, NULL, NEAT_RESOLVER_ERROR);
+        return;
+    }
+
+    memset(&dst_addr, 0, sizeof(dst_addr));
+
+    if (resolver->family == AF_INET) {
+        u.dst_addr4 = (struct sockaddr_in*) &dst_addr;
+        u.dst_addr4->sin_family = AF_INET;
+        u.dst_addr4->sin_port = resolver->dst_port;
+        dst_addr_pton = &(u.dst_addr4->sin_addr);
+    } else {
+        u.dst_addr6 = (struct sockaddr_in6*) &dst_addr;
+        u.dst_addr6->sin6_family = AF_INET6;
+        u.dst_addr6->sin6_port = resolver->dst_port;
+        dst_addr_pton = &(u.dst_addr6->sin6_addr);
+    }
+
+    //We already know that this will be successful, it was checked in the
+    //literal-check performed earlier
+    inet_pton(resolver->family, resolver->domain_name, dst_addr_pton);
+
+    for (nsrc_addr = resolver->nc->src_addrs.lh_first; nsrc_addr != NULL;
+            nsrc_addr = nsrc_addr->next_addr.le_next) {
+        //Family is always set for literals
+        if (!neat_resolver_source_usable(resolver, nsrc_addr))
+            continue;
+
+        num_resolved_addrs += neat_resolver_fill_results(resolver, result_list,
+                nsrc_addr, dst_addr);
+    }
+
+    if (!num_resolved_addrs) {
+        free(result_list);
+        neat_resolver_complete(resolver, NULL, NEAT_RESOLVER_ERROR);
+    } else {
+        neat_resolver_complete(resolver, result_list, NEAT_RESOLVER_OK);
+    }
+}
+
+//This timeout is used when a literal is given before the source address list
+//has been populated
+static void neat_resolver_literal_timeout_cb(uv_timer_t *handle)
+{
+    neat_resolver_literal_resolve(handle->data);
+}
+
+//Answer a name listed in /etc/hosts like a literal, with every address listed
+//for it. Returns RETVAL_FAILURE if the name is not listed, and RETVAL_IGNORE
+//if the source address list has not been populated yet
+static uint8_t neat_resolver_hosts_resolve(struct neat_resolver *resolver)
+{
+    struct neat_hosts_entry *entry;
+    struct neat_resolver_results *result_list;
+    struct neat_addr *nsrc_addr;
+    struct sockaddr_storage dst_addr;
+    uint32_t num_resolved_addrs = 0, listed = 0;
+
+    LIST_FOREACH(entry, &(resolver->nc->resolver_conf.hosts), next_entry) {
+        if ((!resolver->family || entry->family == resolver->family) &&
+            !strcasecmp(entry->name, resolver->node_name))
+            listed++;
+    }
+
+    if (!listed)
+        return RETVAL_FAILURE;
+
+    if (!resolver->nc->src_addr_cnt)
+        return RETVAL_IGNORE;
+
+    //Signal internal error
+    if ((result_list = neat_resolver_results_alloc(
+                    listed * resolver->nc->src_addr_cnt *
+                    neat_resolver_num_protocols(resolver),
+                    resolver->nc->src_addr_cnt)) == NULL) {
+        neat_resolver_complete(resolver, NULL, NEAT_RESOLVER_ERROR);
+        return RETVAL_SUCCESS;
+    }
+
+    LIST_FOREACH(entry, &(resolver->nc->resolver_conf.hosts), next_entry) {
+        if ((resolver->family && entry->family != resolver->family) ||
+            strcasecmp(entry->name, resolver->node_name))
+            continue;
 
-            addr4 = (struct sockaddr_in*) &(pair->resolved_addr[num_resolved]);
+        memset(&dst_addr, 0, sizeof(dst_addr));
 
-            if (!inet_pton(AF_INET, (const char*) ldns_buffer_begin(host_addr),
-                    &(addr4->sin_addr)))
-                pton_failed = 1;
-            else
-                addr4->sin_family = AF_INET;
+        if (entry->family == AF_INET) {
+            ((struct sockaddr_in *) &dst_addr)->sin_family = AF_INET;
+            ((struct sockaddr_in *) &dst_addr)->sin_addr = entry->addr.v4;
         } else {
-            ldns_rdf2buffer_str_aaaa(host_addr, rdf_result);
-            if (neat_resolver_check_duplicate(pair,
-                    (const char *) ldns_buffer_begin(host_addr))) {
-                ldns_buffer_free(host_addr);
+            ((struct sockaddr_in6 *) &dst_addr)->sin6_family = AF_INET6;
+            ((struct sockaddr_in6 *) &dst_addr)->sin6_addr = entry->addr.v6;
+        }
+
+        for (nsrc_addr = resolver->nc->src_addrs.lh_first; nsrc_addr != NULL;
+                nsrc_addr = nsrc_addr->next_addr.le_next) {
+            if (nsrc_addr->family != entry->family ||
+                !neat_resolver_source_usable(resolver, nsrc_addr))
                 continue;
-            }
 
-            addr6 = (struct sockaddr_in6*) &(pair->resolved_addr[num_resolved]);
+            num_resolved_addrs += neat_resolver_fill_results(resolver,
+                    result_list, nsrc_addr, dst_addr);
+        }
+    }
+
+    if (!num_resolved_addrs) {
+        free(result_list);
+        neat_resolver_complete(resolver, NULL, NEAT_RESOLVER_ERROR);
+    } else {
+        neat_resolver_complete(resolver, result_list, NEAT_RESOLVER_OK);
+    }
+
+    return RETVAL_SUCCESS;
+}
+
+//Like the literal timeout, used when a name listed in /etc/hosts is given
+//before the source address list has been populated
+static void neat_resolver_hosts_timeout_cb(uv_timer_t *handle)
+{
+    struct neat_resolver *resolver = handle->data;
+
+    if (neat_resolver_hosts_resolve(resolver) != RETVAL_SUCCESS)
+        neat_resolver_complete(resolver, NULL, NEAT_RESOLVER_ERROR);
+}
+
+//Build the results of resolver from the addresses received by the pairs of
+//leader, or only by pair if it is set. Returns NULL if there are none
+static struct neat_resolver_results *neat_resolver_collect_results(
+        struct neat_resolver *resolver, struct neat_resolver *leader,
+        struct neat_resolver_src_dst_addr *pair)
+{
+    struct neat_resolver_src_dst_addr *pair_itr;
+    struct neat_resolver_results *result_list;
+    uint32_t num_resolved_addrs = 0, num_pairs = 0, num_dsts = 0;
+
+    for (pair_itr = pair ? pair : leader->resolver_pairs.lh_first;
+            pair_itr != NULL;
+            pair_itr = pair ? NULL : pair_itr->next_pair.le_next) {
+        num_pairs++;
+        num_dsts += neat_resolver_num_answers(resolver->nc,
+                                              pair_itr->num_resolved);
+    }
+
+    if ((result_list = neat_resolver_results_alloc(
+                    num_dsts * neat_resolver_num_protocols(resolver),
+                    num_pairs)) == NULL)
+        return NULL;
+
+    for (pair_itr = pair ? pair : leader->resolver_pairs.lh_first;
+            pair_itr != NULL;
+            pair_itr = pair ? NULL : pair_itr->next_pair.le_next) {
+        //Do not use deprecated addresses
+        if (pair_itr->src_addr->family == AF_INET6 &&
+            !pair_itr->src_addr->u.v6.ifa_pref)
+            continue;
+
+        num_resolved_addrs += neat_resolver_fill_answers(resolver, result_list,
+                pair_itr->src_addr, pair_itr->resolved_addrs,
+                pair_itr->num_resolved);
+    }
+
+    if (!num_resolved_addrs) {
+        free(result_list);
+        return NULL;
+    }
+
+    return result_list;
+}
+
+//Queue results and code for resolver, they are passed on by
+//neat_resolver_deliver
+static void neat_resolver_queue(struct neat_resolver *resolver,
+        struct neat_resolver_results *results, uint8_t code)
+{
+    resolver->delivery_results = results;
+    resolver->delivery_code = code;
+    resolver->delivery_queued = 1;
+    TAILQ_INSERT_TAIL(&(resolver->nc->resolver_deliveries), resolver,
+            next_delivery);
+}
+
+//Queue the last results of the lookup of resolver. The addresses are passed
+//on when code is NEAT_RESOLVER_OK, unless that has already been done in
+//streaming mode
+static void neat_resolver_queue_final(struct neat_resolver *resolver,
+        struct neat_resolver *leader, uint8_t code)
+{
+    struct neat_resolver_results *results = NULL;
+
+    if (code == NEAT_RESOLVER_OK && !resolver->streaming &&
+        (results = neat_resolver_collect_results(resolver, leader,
+                                                 NULL)) == NULL)
+        code = NEAT_RESOLVER_ERROR;
+
+    neat_resolver_queue(resolver, results, code);
+}
+
+//Call handle_resolve for every queued resolver. A resolver released by one of
+//the callbacks is removed from the queue
+static void neat_resolver_deliver(struct neat_ctx *nc)
+{
+    struct neat_resolver *resolver;
+    struct neat_resolver_results *results;
+
+    while ((resolver = TAILQ_FIRST(&(nc->resolver_deliveries))) != NULL) {
+        TAILQ_REMOVE(&(nc->resolver_deliveries), resolver, next_delivery);
+        resolver->delivery_queued = 0;
+        results = resolver->delivery_results;
+        resolver->delivery_results = NULL;
+        resolver->handle_resolve(resolver, results, resolver->delivery_code);
+    }
+}
+
+//Resolver no longer takes part in a coalesced lookup
+static void neat_resolver_lookup_end(struct neat_resolver *resolver)
+{
+    if (resolver->leader != NULL) {
+        LIST_REMOVE(resolver, next_waiter);
+        resolver->leader = NULL;
+    }
+
+    if (resolver->lookup_active) {
+        LIST_REMOVE(resolver, next_lookup);
+        resolver->lookup_active = 0;
+    }
+}
+
+//End the lookup of resolver, and of the resolvers waiting for it
+static void neat_resolver_finish(struct neat_resolver *resolver, uint8_t code)
+{
+    struct neat_ctx *nc = resolver->nc;
+    struct neat_resolver *waiter;
+
+    neat_resolver_lookup_end(resolver);
+    uv_timer_stop(&(resolver->retrans_handle));
+
+    while ((waiter = LIST_FIRST(&(resolver->waiters))) != NULL) {
+        LIST_REMOVE(waiter, next_waiter);
+        waiter->leader = NULL;
+        neat_resolver_queue_final(waiter, resolver, code);
+    }
+
+    //Must be done last, the resolver can be released by the callbacks
+    neat_resolver_queue_final(resolver, resolver, code);
+    neat_resolver_deliver(nc);
+}
+
+//Called when timeout expires. This function will pass the results of the DNS
+//query to the application using NEAT
+static void neat_resolver_timeout_cb(uv_timer_t *handle)
+{
+    struct neat_resolver *resolver = handle->data;
+
+    //DNS timeout, call DNS callback with timeout error code
+    if (!resolver->name_resolved_timeout) {
+        neat_resolver_finish(resolver, NEAT_RESOLVER_TIMEOUT);
+        return;
+    }
+
+    neat_resolver_finish(resolver, NEAT_RESOLVER_OK);
+}
+
+//Called when a DNS request has been (i.e., passed to socket). We will send the
+//second query (used for checking poisoning) here. If that is needed
+static void neat_resolver_dns_sent_cb(uv_udp_send_t *req, int status)
+{
+    struct neat_resolver_src_dst_addr *pair = req->data;
+
+    //The query buffer was in use until now
+    pair->sending = 0;
+
+    if (pair->deleted)
+        neat_resolver_cleanup_pair(pair);
+}
+
+//libuv gives the user control of how memory is allocated. This callback is
+//called when a UDP packet is ready to received, and we have to fill out the
+//provided buf with the storage location (and available size)
+static void neat_resolver_dns_alloc_cb(uv_handle_t *handle,
+        size_t suggested_size, uv_buf_t *buf)
+{
+    struct neat_dns_socket *sock = handle->data;
+
+    buf->base = sock->dns_rcv_buf;
+    buf->len = sizeof(sock->dns_rcv_buf);
+}
+
+//Internal NEAT resolver functions
+//Deletes have to happen async so that libuv can do internal clean-up. I.e., we
+//can't just free memory and that is that. This function marks a resolver pair
+//as ready for deletion
+static void neat_resolver_mark_pair_del(struct neat_resolver_src_dst_addr *pair)
+{
+    struct neat_resolver *resolver = pair->resolver;
+
+    //Replies are no longer routed to the pair
+    if (pair->sock != NULL) {
+        LIST_REMOVE(pair, next_query);
+        pair->sock = NULL;
+    }
+
+    //A query that is still being sent keeps the pair around until the send
+    //callback, the socket is shared so the send can't be cancelled
+    pair->deleted = 1;
+
+    if (!pair->sending)
+        neat_resolver_cleanup_pair(pair);
+
+    if (pair->next_pair.le_next != NULL || pair->next_pair.le_prev != NULL)
+        LIST_REMOVE(pair, next_pair);
+
+    LIST_INSERT_HEAD(&(resolver->resolver_pairs_del), pair,
+            next_pair);
+
+    //We can't free memory right away, libuv has to be allowed to
+    //perform internal clean-up first. This is done after loop is done
+    //(uv__run_closing_handles), so we use idle (which is called in the
+    //next iteration and before polling)
+    if (uv_backend_fd(resolver->nc->loop) != -1 &&
+        !uv_is_active((uv_handle_t*) &(resolver->idle_handle)))
+        uv_idle_start(&(resolver->idle_handle), neat_resolver_idle_cb);
+}
+
+//FNV-1a over the whole entry. Entries are zeroed before they are filled in,
+//so padding does not get in the way
+static uint32_t neat_resolver_seen_hash(const struct neat_resolver_seen *entry)
+{
+    const uint8_t *key = (const uint8_t *) entry;
+    uint32_t hash = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < sizeof(struct neat_resolver_seen); i++)
+        hash = (hash ^ key[i]) * 16777619u;
+
+    return hash;
+}
+
+//Slot of entry in seen, or the free slot it would go in
+static struct neat_resolver_seen *neat_resolver_seen_slot(
+        struct neat_resolver_seen *seen, uint32_t size,
+        const struct neat_resolver_seen *entry)
+{
+    uint32_t i = neat_resolver_seen_hash(entry) & (size - 1);
+
+    while (seen[i].family &&
+           memcmp(&(seen[i]), entry, sizeof(struct neat_resolver_seen)))
+        i = (i + 1) & (size - 1);
+
+    return &(seen[i]);
+}
+
+//Double the size of the set of resolver
+static uint8_t neat_resolver_seen_grow(struct neat_resolver *resolver)
+{
+    struct neat_resolver_seen *seen;
+    uint32_t size = resolver->seen_size ?
+        2 * resolver->seen_size : DNS_SEEN_MIN_SIZE;
+    uint32_t i;
+
+    if ((seen = calloc(size, sizeof(struct neat_resolver_seen))) == NULL)
+        return RETVAL_FAILURE;
 
-            if (!inet_pton(AF_INET6, (const char*) ldns_buffer_begin(host_addr),
-                    &(addr6->sin6_addr)))
-                pton_failed = 1;
-            else
-                addr6->sin6_family = AF_INET6;
+    for (i = 0; i < resolver->seen_size; i++)
+        if (resolver->seen[i].family)
+            memcpy(neat_resolver_seen_slot(seen, size, &(resolver->seen[i])),
+                   &(resolver->seen[i]), sizeof(struct neat_resolver_seen));
+
+    free(resolver->seen);
+    resolver->seen = seen;
+    resolver->seen_size = size;
+    return RETVAL_SUCCESS;
+}
+
+//Add an address received by pair to the set of its resolver. Returns 1 if it
+//was already there, i.e., another name server has answered with it for the
+//same source (index and address)
+static uint8_t neat_resolver_seen_add(struct neat_resolver_src_dst_addr *pair,
+        const union neat_dns_addr *resolved_addr)
+{
+    struct neat_resolver *resolver = pair->resolver;
+    struct neat_addr *src_addr = pair->src_addr;
+    struct neat_resolver_seen entry, *slot;
+
+    memset(&entry, 0, sizeof(entry));
+    entry.if_idx = src_addr->if_idx;
+    entry.family = src_addr->family;
+
+    if (src_addr->family == AF_INET) {
+        entry.src.v4 = src_addr->u.v4.addr4.sin_addr;
+        entry.dst.v4 = resolved_addr->v4;
+    } else {
+        entry.src.v6 = src_addr->u.v6.addr6.sin6_addr;
+        entry.dst.v6 = resolved_addr->v6;
+    }
+
+    //The set is kept at most half full. Without memory for it, duplicates are
+    //let through
+    if (2 * (resolver->seen_cnt + 1) > resolver->seen_size &&
+        neat_resolver_seen_grow(resolver) != RETVAL_SUCCESS)
+        return 0;
+
+    slot = neat_resolver_seen_slot(resolver->seen, resolver->seen_size,
+                                   &entry);
+
+    if (slot->family)
+        return 1;
+
+    memcpy(slot, &entry, sizeof(entry));
+    resolver->seen_cnt++;
+    return 0;
+}
+
+static void neat_resolver_seen_clear(struct neat_resolver *resolver)
+{
+    free(resolver->seen);
+    resolver->seen = NULL;
+    resolver->seen_size = 0;
+    resolver->seen_cnt = 0;
+}
+
+//Set domain_name to the name at position idx of the names to try for node_name,
+//following the search list and ndots option of resolv.conf. Returns
+//RETVAL_FAILURE when there are no more names, and RETVAL_IGNORE if the name
+//would be too long
+static uint8_t neat_resolver_search_name(struct neat_resolver *resolver,
+        uint8_t idx)
+{
+    struct neat_resolver_conf *conf = &(resolver->nc->resolver_conf);
+    const char *node = resolver->node_name;
+    size_t node_len = strlen(node);
+    uint8_t num_dots = 0, search_cnt = conf->search_cnt;
+    size_t i;
+
+    for (i = 0; i < node_len; i++)
+        if (node[i] == '.')
+            num_dots++;
+
+    //Absolute names are never searched
+    if (node_len && node[node_len - 1] == '.')
+        search_cnt = 0;
+
+    //Names with enough dots are tried as they are first, others last
+    if (num_dots >= conf->ndots || !search_cnt) {
+        if (!idx) {
+            memcpy(resolver->domain_name, node, node_len + 1);
+            return RETVAL_SUCCESS;
         }
 
-        if (!pton_failed)
-            num_resolved++;
-        else
-            pton_failed = 0;
+        idx--;
+    } else if (idx == search_cnt) {
+        memcpy(resolver->domain_name, node, node_len + 1);
+        return RETVAL_SUCCESS;
+    }
+
+    if (idx >= search_cnt)
+        return RETVAL_FAILURE;
+
+    if (snprintf(resolver->domain_name, MAX_DOMAIN_LENGTH, "%s.%s", node,
+                 conf->search[idx]) >= MAX_DOMAIN_LENGTH)
+        return RETVAL_IGNORE;
+
+    return RETVAL_SUCCESS;
+}
+
+//Iterate through src addresses and start requesting. Every source asks its
+//first name server before any source asks its second, so that the fan-out
+//limit leaves as few sources as possible without a query
+static void neat_resolver_start_queries(struct neat_resolver *resolver)
+{
+    struct neat_addr *nsrc_addr;
+
+    for (nsrc_addr = resolver->nc->src_addrs.lh_first; nsrc_addr != NULL;
+            nsrc_addr = nsrc_addr->next_addr.le_next) {
+        if (!neat_resolver_source_usable(resolver, nsrc_addr))
+            continue;
+
+        neat_resolver_add_next_pair(resolver, nsrc_addr);
+    }
+}
+
+//Called when a reply without addresses has been received. Once every server
+//has answered, the next name of the search list is tried. When there are no
+//more names, the lookup has failed
+static void neat_resolver_search_next(struct neat_resolver *resolver)
+{
+    struct neat_resolver_src_dst_addr *pair_itr;
+    uint8_t retval;
+
+    if (resolver->name_resolved_timeout ||
+        LIST_EMPTY(&(resolver->resolver_pairs)))
+        return;
+
+    for (pair_itr = resolver->resolver_pairs.lh_first; pair_itr != NULL;
+            pair_itr = pair_itr->next_pair.le_next)
+        if (!pair_itr->answered)
+            return;
+
+    while ((pair_itr = LIST_FIRST(&(resolver->resolver_pairs))) != NULL)
+        neat_resolver_mark_pair_del(pair_itr);
+
+    do {
+        retval = neat_resolver_search_name(resolver, ++resolver->search_idx);
+    } while (retval == RETVAL_IGNORE);
+
+    if (retval == RETVAL_SUCCESS) {
+        neat_resolver_start_queries(resolver);
+        return;
+    }
+
+    uv_timer_stop(&(resolver->timeout_handle));
+    neat_resolver_finish(resolver, NEAT_RESOLVER_ERROR);
+}
+
+//Pass the addresses of one reply on right away to the resolver, and the
+//resolvers waiting for it, that are in streaming mode
+static void neat_resolver_deliver_reply(struct neat_resolver_src_dst_addr *pair)
+{
+    struct neat_resolver *resolver = pair->resolver, *waiter;
+    struct neat_resolver_results *results;
+
+    LIST_FOREACH(waiter, &(resolver->waiters), next_waiter) {
+        if (waiter->streaming &&
+            (results = neat_resolver_collect_results(waiter, resolver,
+                                                     pair)) != NULL)
+            neat_resolver_queue(waiter, results, NEAT_RESOLVER_PARTIAL);
+    }
+
+    if (resolver->streaming &&
+        (results = neat_resolver_collect_results(resolver, resolver,
+                                                 pair)) != NULL)
+        neat_resolver_queue(resolver, results, NEAT_RESOLVER_PARTIAL);
+
+    //Must be done last, the resolver can be released by the callbacks
+    neat_resolver_deliver(resolver->nc);
+}
+
+static uint8_t neat_resolver_sockaddr_equal(const struct sockaddr *addr1,
+        const struct sockaddr *addr2)
+{
+    const struct sockaddr_in *addr1_4, *addr2_4;
+    const struct sockaddr_in6 *addr1_6, *addr2_6;
+
+    if (addr1->sa_family != addr2->sa_family)
+        return 0;
+
+    if (addr1->sa_family == AF_INET) {
+        addr1_4 = (const struct sockaddr_in*) addr1;
+        addr2_4 = (const struct sockaddr_in*) addr2;
+        return addr1_4->sin_port == addr2_4->sin_port &&
+            addr1_4->sin_addr.s_addr == addr2_4->sin_addr.s_addr;
+    }
+
+    addr1_6 = (const struct sockaddr_in6*) addr1;
+    addr2_6 = (const struct sockaddr_in6*) addr2;
+    return addr1_6->sin6_port == addr2_6->sin6_port &&
+        neat_addr_cmp_ip6_addr(addr1_6->sin6_addr, addr2_6->sin6_addr);
+}
+
+//Find the query with this ID sent to server through sock
+static struct neat_resolver_src_dst_addr *neat_resolver_query_lookup(
+        struct neat_dns_socket *sock, uint16_t query_id,
+        const struct sockaddr *server)
+{
+    struct neat_resolver_src_dst_addr *pair;
+
+    LIST_FOREACH(pair, &(sock->queries), next_query) {
+        if (pair->dns_snd_buf != NULL && pair->query_id == query_id &&
+            neat_resolver_sockaddr_equal(server,
+                (struct sockaddr*) &(pair->dst_addr.u.generic.addr)))
+            return pair;
+    }
+
+    return NULL;
+}
+
+static void neat_resolver_dns_recv(struct neat_resolver_src_dst_addr *pair,
+        const uint8_t *buf, size_t len);
+
+//Route a reply to the query with its ID that was sent to the server. Anything
+//else, like late replies to queries that are gone or spoofed packets, is
+//dropped. So are replies to another question, by neat_dns_parse_reply
+static void neat_resolver_socket_recv_cb(uv_udp_t* handle, ssize_t nread,
+        const uv_buf_t* buf, const struct sockaddr* addr, unsigned flags)
+{
+    struct neat_dns_socket *sock = handle->data;
+    struct neat_resolver_src_dst_addr *pair;
+    const uint8_t *reply = (const uint8_t*) buf->base;
+
+    if (nread < DNS_HEADER_SIZE || addr == NULL)
+        return;
+
+    pair = neat_resolver_query_lookup(sock, (reply[0] << 8) | reply[1], addr);
+
+    if (pair == NULL)
+        return;
+
+    neat_resolver_dns_recv(pair, reply, nread);
+}
+
+static void neat_resolver_socket_close_cb(uv_handle_t *handle)
+{
+    free(handle->data);
+}
+
+//Stop routing replies to the pairs of sock, and close it. Pairs that still
+//point to the socket are deleted by their resolvers
+static void neat_resolver_socket_close(struct neat_dns_socket *sock)
+{
+    struct neat_resolver_src_dst_addr *pair;
+
+    while ((pair = LIST_FIRST(&(sock->queries))) != NULL) {
+        LIST_REMOVE(pair, next_query);
+        pair->sock = NULL;
+    }
+
+    LIST_REMOVE(sock, next_socket);
+    neat_remove_event_cb(sock->nc, NEAT_DELADDR, &(sock->deladdr_cb));
+    uv_close((uv_handle_t*) &(sock->handle), neat_resolver_socket_close_cb);
+}
+
+//The address the socket is bound to is gone
+static void neat_resolver_socket_handle_deladdr(struct neat_ctx *nc,
+                                                void *p_ptr,
+                                                void *data)
+{
+    struct neat_dns_socket *sock = p_ptr;
+
+    if (sock->bind_addr == data)
+        neat_resolver_socket_close(sock);
+}
+
+//Get the socket that sends from bind_addr, it is created on first use. Sockets
+//for name servers on the host are not bound to the interface of bind_addr
+static struct neat_dns_socket *neat_resolver_socket_get(struct neat_ctx *nc,
+        struct neat_addr *bind_addr, uint8_t loopback)
+{
+    struct neat_dns_socket *sock;
+#ifdef __linux__
+    uv_os_fd_t socket_fd = -1;
+    char if_name[IF_NAMESIZE];
+#endif
+
+    LIST_FOREACH(sock, &(nc->dns_sockets), next_socket)
+        if (sock->bind_addr == bind_addr && sock->loopback == loopback)
+            return sock;
+
+    if ((sock = calloc(sizeof(struct neat_dns_socket), 1)) == NULL) {
+        fprintf(stderr, "Failed to allocate memory for DNS socket\n");
+        return NULL;
+    }
+
+    sock->nc = nc;
+    sock->bind_addr = bind_addr;
+    sock->loopback = loopback;
+    LIST_INIT(&(sock->queries));
+
+    //Configure uv_udp_handle
+    if (uv_udp_init(nc->loop, &(sock->handle))) {
+        fprintf(stderr, "Failure to initialize UDP handle\n");
+        free(sock);
+        return NULL;
+    }
+
+    sock->handle.data = sock;
+    sock->deladdr_cb.event_cb = neat_resolver_socket_handle_deladdr;
+    sock->deladdr_cb.data = sock;
+    LIST_INSERT_HEAD(&(nc->dns_sockets), sock, next_socket);
+
+    if (neat_add_event_cb(nc, NEAT_DELADDR, &(sock->deladdr_cb))) {
+        fprintf(stderr, "Could not add DNS socket callback\n");
+        LIST_REMOVE(sock, next_socket);
+        uv_close((uv_handle_t*) &(sock->handle), neat_resolver_socket_close_cb);
+        return NULL;
+    }
+
+    if (uv_udp_bind(&(sock->handle),
+                (struct sockaddr*) &(bind_addr->u.generic.addr), 0)) {
+        fprintf(stderr, "Failed to bind UDP socket\n");
+        neat_resolver_socket_close(sock);
+        return NULL;
+    }
+
+    if (uv_udp_recv_start(&(sock->handle), neat_resolver_dns_alloc_cb,
+                neat_resolver_socket_recv_cb)) {
+        fprintf(stderr, "Failed to start receiving UDP\n");
+        neat_resolver_socket_close(sock);
+        return NULL;
+    }
+
+//TODO: Binding to interface name requires sudo, not sure if that is acceptable.
+//Ignore any error here for now
+#ifdef __linux__
+    //A local name server (like a caching resolver) is reached through the
+    //loopback interface
+    if (loopback)
+        return sock;
+
+    uv_fileno((uv_handle_t*) &(sock->handle), &socket_fd);
+
+    if (!if_indextoname(bind_addr->if_idx, if_name)) {
+        /*fprintf(stderr, "Could not get interface name for index %u\n",
+                bind_addr->if_idx);*/
+        return sock;
+    }
+
+    if (setsockopt(socket_fd, SOL_SOCKET, SO_BINDTODEVICE, if_name,
+                strlen(if_name)) < 0) {
+        //fprintf(stderr, "Could not bind socket to interface %s\n", if_name);
+        return sock;
+    }
+#endif
+
+    return sock;
+}
+
+void neat_resolver_sockets_close(struct neat_ctx *nc)
+{
+    while (!LIST_EMPTY(&(nc->dns_sockets)))
+        neat_resolver_socket_close(LIST_FIRST(&(nc->dns_sockets)));
+}
+
+//Parse a DNS reply to the query of pair
+//TODO: Refactor and make large parts helper function?
+static void neat_resolver_dns_recv(struct neat_resolver_src_dst_addr *pair,
+        const uint8_t *buf, size_t len)
+{
+    //Parsed in place, replies are only read for their addresses and TTLs
+    struct neat_dns_reply reply;
+    union neat_dns_addr *resolved_addrs;
+    uint16_t rr_type;
+    uint8_t num_resolved = 0, i;
+
+    if (pair->src_addr->family == AF_INET)
+        rr_type = LDNS_RR_TYPE_A;
+    else
+        rr_type = LDNS_RR_TYPE_AAAA;
+
+    //Replies with another question are dropped here
+    if (neat_dns_parse_reply(buf, len, ldns_buffer_begin(pair->dns_snd_buf),
+                             ldns_buffer_position(pair->dns_snd_buf), rr_type,
+                             &reply))
+        return;
+
+    pair->answered = 1;
+    pair->retrans_at = 0;
+    pair->hedge_at = 0;
+
+    //Other errors than NXDOMAIN are about the server, not the name. The next
+    //server is asked right away
+    if (reply.rcode != LDNS_RCODE_NOERROR &&
+        reply.rcode != LDNS_RCODE_NXDOMAIN) {
+        neat_resolver_server_failed(pair->resolver->nc,
+                pair->bind_addr->if_idx, &(pair->dst_addr));
+        neat_resolver_add_next_pair(pair->resolver, pair->src_addr);
+        neat_resolver_search_next(pair->resolver);
+        return;
+    }
+
+    pair->replied = 1;
+    neat_resolver_server_answered(pair->resolver->nc, pair->bind_addr->if_idx,
+            &(pair->dst_addr), uv_now(pair->resolver->nc->loop) - pair->sent_at,
+            pair->sent_at != 0);
+
+    if (!reply.num_addrs) {
+        neat_resolver_cache_negative(pair, &reply, rr_type);
+        neat_resolver_search_next(pair->resolver);
+        return;
+    }
+
+    neat_resolver_cache_answer(pair, &reply, rr_type);
+
+    //Every address is kept, the answer policy decides which are used
+    resolved_addrs = realloc(pair->resolved_addrs,
+            (pair->num_resolved + reply.num_addrs) *
+            sizeof(union neat_dns_addr));
+
+    if (resolved_addrs == NULL)
+        return;
+
+    pair->resolved_addrs = resolved_addrs;
+
+    for (i = 0; i < reply.num_addrs &&
+            pair->num_resolved < DNS_MAX_ANSWERS; i++) {
+        if (neat_resolver_seen_add(pair, &(reply.answers[i].addr)))
+            continue;
+
+        pair->resolved_addrs[pair->num_resolved++] = reply.answers[i].addr;
+        num_resolved++;
+    }
+
+    if (num_resolved && !pair->resolver->name_resolved_timeout){
+        uv_timer_stop(&(pair->resolver->timeout_handle));
+        uv_timer_start(&(pair->resolver->timeout_handle), neat_resolver_timeout_cb,
+                pair->resolver->dns_t2, 0);
+        pair->resolver->name_resolved_timeout = 1;
+    }
+
+    //Must be done last, the resolver can be released by the callback
+    if (num_resolved)
+        neat_resolver_deliver_reply(pair);
+}
+
+//Prepare and send (or, start sending) a DNS query for the given service
+static uint8_t neat_resolver_send_query(struct neat_resolver_src_dst_addr *pair)
+{
+    ldns_pkt *pkt;
+    ldns_rr_type rr_type;
+
+    if (pair->src_addr->family == AF_INET)
+        rr_type = LDNS_RR_TYPE_A;
+    else
+        rr_type = LDNS_RR_TYPE_AAAA;
+
+    //Create a DNS query for aUrl
+    if (ldns_pkt_query_new_frm_str(&pkt, pair->resolver->domain_name, rr_type,
+                LDNS_RR_CLASS_IN, 0) != LDNS_STATUS_OK) {
+        fprintf(stderr, "Could not create DNS packet");
+        return RETVAL_FAILURE;
+    }
+
+    //The ID must be unique among the queries sent to the server through the
+    //socket, it is all that tells their replies apart
+    do {
+        ldns_pkt_set_random_id(pkt);
+    } while (neat_resolver_query_lookup(pair->sock, ldns_pkt_id(pkt),
+                (struct sockaddr*) &(pair->dst_addr.u.generic.addr)) != NULL);
+
+    pair->query_id = ldns_pkt_id(pkt);
+
+    //We are a naive stub-resolver, so we need the server we query to do most of
+    //the work for us
+    ldns_pkt_set_rd(pkt, 1);
+    ldns_pkt_set_ad(pkt, 1);
+
+    //Convert internal LDNS structure to query buffer
+    pair->dns_snd_buf = ldns_buffer_new(LDNS_MIN_BUFLEN);
+    if (ldns_pkt2buffer_wire(pair->dns_snd_buf, pkt) != LDNS_STATUS_OK) {
+        fprintf(stderr, "Could not convert pkt to buf");
+        ldns_pkt_free(pkt);
+        return RETVAL_FAILURE;
+    }
+
+    ldns_pkt_free(pkt);
+
+    pair->dns_uv_snd_buf.base = (char*) ldns_buffer_begin(pair->dns_snd_buf);
+    pair->dns_uv_snd_buf.len = ldns_buffer_position(pair->dns_snd_buf);
+
+    pair->dns_snd_handle.data = pair;
+
+    if (uv_udp_send(&(pair->dns_snd_handle), &(pair->sock->handle),
+            &(pair->dns_uv_snd_buf), 1,
+            (const struct sockaddr*) &(pair->dst_addr.u.generic.addr),
+            neat_resolver_dns_sent_cb)) {
+        fprintf(stderr, "Failed to start DNS send\n");
+        return RETVAL_FAILURE;
+    }
+
+    pair->sending = 1;
+    pair->sent_at = uv_now(pair->resolver->nc->loop);
+    return RETVAL_SUCCESS;
+}
+
+//Address of name server number idx of family
+static const char *neat_resolver_server_addr(struct neat_resolver *resolver,
+        uint8_t family, uint8_t idx)
+{
+    struct neat_resolver_conf *conf = &(resolver->nc->resolver_conf);
+
+    if (!conf->servers4_cnt && !conf->servers6_cnt)
+        return family == AF_INET ?
+            INET_DNS_SERVERS[idx] : INET6_DNS_SERVERS[idx];
+
+    return family == AF_INET ? conf->servers4[idx] : conf->servers6[idx];
+}
+
+//Fill in dst_addr with the address of a name server. loopback tells if the
+//server is on this host
+static uint8_t neat_resolver_parse_server(uint8_t family,
+        const char *dst_addr_str, struct neat_addr *dst_addr,
+        uint8_t *loopback)
+{
+    struct sockaddr_in *dst_addr4;
+    struct sockaddr_in6 *dst_addr6;
+    void *dst_addr_pton = NULL;
+
+    memset(dst_addr, 0, sizeof(struct neat_addr));
+    dst_addr->family = family;
+
+    if (family == AF_INET) {
+        dst_addr4 = &(dst_addr->u.v4.addr4);
+        dst_addr4->sin_family = AF_INET;
+        dst_addr4->sin_port = htons(LDNS_PORT);
+        dst_addr_pton = &(dst_addr4->sin_addr);
+    } else {
+        dst_addr6 = &(dst_addr->u.v6.addr6);
+        dst_addr6->sin6_family = AF_INET6;
+        dst_addr6->sin6_port = htons(LDNS_PORT);
+        dst_addr_pton = &(dst_addr6->sin6_addr);
+    }
+
+    if (!inet_pton(family, dst_addr_str, dst_addr_pton)) {
+        fprintf(stderr, "Failed to convert destination address\n");
+        return RETVAL_FAILURE;
+    }
+
+    if (family == AF_INET)
+        *loopback = (ntohl(dst_addr4->sin_addr.s_addr) >> 24) == IN_LOOPBACKNET;
+    else
+        *loopback = IN6_IS_ADDR_LOOPBACK(&(dst_addr6->sin6_addr));
+
+    return RETVAL_SUCCESS;
+}
+
+//Set the name server the pair sends its query to
+static uint8_t neat_resolver_set_server(
+        struct neat_resolver_src_dst_addr *pair, const char *dst_addr_str,
+        uint8_t *loopback)
+{
+    return neat_resolver_parse_server(pair->bind_addr->family, dst_addr_str,
+                                      &(pair->dst_addr), loopback);
+}
+
+//Create one SRC/DST DNS resolver pair. Pair has already been allocated
+static uint8_t neat_resolver_create_pair(struct neat_ctx *nc,
+        struct neat_resolver_src_dst_addr *pair,
+        const char *dst_addr_str)
+{
+    uint8_t loopback;
+
+    if (neat_resolver_set_server(pair, dst_addr_str, &loopback))
+        return RETVAL_FAILURE;
+
+    //Replies are received on the shared socket, and routed to the pair by
+    //transaction ID, name server and question
+    pair->sock = neat_resolver_socket_get(nc, pair->bind_addr, loopback);
+
+    if (pair->sock == NULL)
+        return RETVAL_FAILURE;
+
+    LIST_INSERT_HEAD(&(pair->sock->queries), pair, next_query);
+
+    return RETVAL_SUCCESS;
+}
+
+//Find an address of the other family on the interface of src_addr
+static struct neat_addr *neat_resolver_bind_addr(struct neat_ctx *nc,
+        struct neat_addr *src_addr)
+{
+    struct neat_addr *nsrc_addr;
+
+    for (nsrc_addr = nc->src_addrs.lh_first; nsrc_addr != NULL;
+            nsrc_addr = nsrc_addr->next_addr.le_next) {
+        if (nsrc_addr->family == src_addr->family ||
+            nsrc_addr->if_idx != src_addr->if_idx)
+            continue;
+
+        //Do not use deprecated addresses
+        if (nsrc_addr->family == AF_INET6 && !nsrc_addr->u.v6.ifa_pref)
+            continue;
+
+        return nsrc_addr;
+    }
+
+    return NULL;
+}
+
+//Number of name servers src_addr sends queries to, and the address they are
+//sent from. Servers of the other family are asked through an address of that
+//family on the same interface, so that we still get both A and AAAA records
+static uint8_t neat_resolver_num_servers(struct neat_resolver *resolver,
+        struct neat_addr *src_addr, struct neat_addr **bind_addr)
+{
+    struct neat_resolver_conf *conf = &(resolver->nc->resolver_conf);
+
+    *bind_addr = src_addr;
+
+    if (!conf->servers4_cnt && !conf->servers6_cnt)
+        return src_addr->family == AF_INET ?
+            sizeof(INET_DNS_SERVERS) / sizeof(const char*) :
+            sizeof(INET6_DNS_SERVERS) / sizeof(const char*);
+
+    if (src_addr->family == AF_INET ? conf->servers4_cnt : conf->servers6_cnt)
+        return src_addr->family == AF_INET ? conf->servers4_cnt :
+            conf->servers6_cnt;
+
+    if ((*bind_addr = neat_resolver_bind_addr(resolver->nc, src_addr)) == NULL)
+        return 0;
+
+    return src_addr->family == AF_INET ? conf->servers6_cnt :
+        conf->servers4_cnt;
+}
+
+//Only one source per interface and family sends queries, if the context asks
+//for it
+static uint8_t neat_resolver_source_represented(
+        struct neat_resolver *resolver, struct neat_addr *src_addr)
+{
+    struct neat_resolver_src_dst_addr *pair_itr;
 
-        ldns_buffer_free(host_addr);
+    if (!resolver->nc->resolver_per_if)
+        return 0;
 
-        if (num_resolved >= MAX_NUM_RESOLVED)
-            break;
-    }
+    for (pair_itr = resolver->resolver_pairs.lh_first; pair_itr != NULL;
+            pair_itr = pair_itr->next_pair.le_next)
+        if (pair_itr->src_addr != src_addr &&
+            pair_itr->src_addr->if_idx == src_addr->if_idx &&
+            pair_itr->src_addr->family == src_addr->family)
+            return 1;
 
-    ldns_rr_list_deep_free(rr_list);
-    ldns_pkt_free(dns_reply);
+    return 0;
+}
 
-    if (num_resolved && !pair->resolver->name_resolved_timeout){
-        uv_timer_stop(&(pair->resolver->timeout_handle));
-        uv_timer_start(&(pair->resolver->timeout_handle), neat_resolver_timeout_cb,
-                pair->resolver->dns_t2, 0);
-        pair->resolver->name_resolved_timeout = 1;
-    }
+//Retransmission timeout with up to 25% jitter either way, so that queries sent
+//together are not retransmitted together
+static uint64_t neat_resolver_jitter(uint32_t rto)
+{
+    return rto - rto / 4 + random() % (rto / 2 + 1);
 }
 
-//Prepare and send (or, start sending) a DNS query for the given service
-static uint8_t neat_resolver_send_query(struct neat_resolver_src_dst_addr *pair)
+//Start the retransmission timer for the first pair that is due
+static void neat_resolver_retrans_start(struct neat_resolver *resolver)
 {
-    ldns_pkt *pkt;
-    ldns_rr_type rr_type;
+    struct neat_resolver_src_dst_addr *pair_itr;
+    uint64_t now = uv_now(resolver->nc->loop), next = 0;
 
-    if (pair->src_addr->family == AF_INET)
-        rr_type = LDNS_RR_TYPE_A;
-    else
-        rr_type = LDNS_RR_TYPE_AAAA;
+    for (pair_itr = resolver->resolver_pairs.lh_first; pair_itr != NULL;
+            pair_itr = pair_itr->next_pair.le_next) {
+        if (pair_itr->retrans_at && (!next || pair_itr->retrans_at < next))
+            next = pair_itr->retrans_at;
 
-    //Create a DNS query for aUrl
-    if (ldns_pkt_query_new_frm_str(&pkt, pair->resolver->domain_name, rr_type,
-                LDNS_RR_CLASS_IN, 0) != LDNS_STATUS_OK) {
-        fprintf(stderr, "Could not create DNS packet");
-        return RETVAL_FAILURE;
+        if (pair_itr->hedge_at && (!next || pair_itr->hedge_at < next))
+            next = pair_itr->hedge_at;
     }
 
-    ldns_pkt_set_random_id(pkt);
-
-    //We are a naive stub-resolver, so we need the server we query to do most of
-    //the work for us
-    ldns_pkt_set_rd(pkt, 1);
-    ldns_pkt_set_ad(pkt, 1);
-
-    //Convert internal LDNS structure to query buffer
-    pair->dns_snd_buf = ldns_buffer_new(LDNS_MIN_BUFLEN);
-    if (ldns_pkt2buffer_wire(pair->dns_snd_buf, pkt) != LDNS_STATUS_OK) {
-        fprintf(stderr, "Could not convert pkt to buf");
-        ldns_pkt_free(pkt);
-        return RETVAL_FAILURE;
+    if (!next) {
+        uv_timer_stop(&(resolver->retrans_handle));
+        return;
     }
 
-    ldns_pkt_free(pkt);
+    uv_timer_start(&(resolver->retrans_handle), neat_resolver_retrans_cb,
+            next > now ? next - now : 0, 0);
+}
 
-    pair->dns_uv_snd_buf.base = (char*) ldns_buffer_begin(pair->dns_snd_buf);
-    pair->dns_uv_snd_buf.len = ldns_buffer_position(pair->dns_snd_buf);
+//Send the query of pair again. The query and ID are kept, so that a late reply
+//to an earlier transmission is still accepted. Other name servers are asked by
+//hedging, see neat_resolver_retrans_cb
+static uint8_t neat_resolver_retransmit(struct neat_resolver_src_dst_addr *pair)
+{
+    //The socket has been closed, the pair is about to be deleted
+    if (pair->sock == NULL)
+        return RETVAL_FAILURE;
 
-    if (uv_udp_send(&(pair->dns_snd_handle), &(pair->resolve_handle),
+    if (uv_udp_send(&(pair->dns_snd_handle), &(pair->sock->handle),
             &(pair->dns_uv_snd_buf), 1,
             (const struct sockaddr*) &(pair->dst_addr.u.generic.addr),
-            neat_resolver_dns_sent_cb)) {
-        fprintf(stderr, "Failed to start DNS send\n");
+            neat_resolver_dns_sent_cb))
         return RETVAL_FAILURE;
-    }
 
+    pair->sending = 1;
+    //A reply could be to either transmission, so it says nothing about RTT
+    pair->sent_at = 0;
     return RETVAL_SUCCESS;
 }
 
-//Create one SRC/DST DNS resolver pair. Pair has already been allocated
-static uint8_t neat_resolver_create_pair(struct neat_ctx *nc,
-        struct neat_resolver_src_dst_addr *pair,
-        const char *dst_addr_str)
+//Retransmit the queries that have not been answered in time, with exponential
+//backoff. A server is given up on when the last transmission has not been
+//answered within the timeout of resolv.conf. A query that has not been
+//answered by the time its server should have answered (its hedging delay) is
+//hedged: the next best name server of the source is asked as well
+static void neat_resolver_retrans_cb(uv_timer_t *handle)
 {
-    struct sockaddr_in *dst_addr4;
-    struct sockaddr_in6 *dst_addr6;
-    void *dst_addr_pton = NULL;
-    uint8_t family = pair->src_addr->family;
-#ifdef __linux__
-    uv_os_fd_t socket_fd = -1;
-    char if_name[IF_NAMESIZE];
-#endif
+    struct neat_resolver *resolver = handle->data;
+    struct neat_resolver_conf *conf = &(resolver->nc->resolver_conf);
+    struct neat_resolver_src_dst_addr *pair_itr;
+    uint64_t now = uv_now(resolver->nc->loop);
+    uint32_t max_rto = 1000 * conf->timeout;
+    uint8_t attempts = resolver->nc->dns_attempts ?
+        resolver->nc->dns_attempts : conf->attempts;
+    uint8_t given_up = 0;
+
+    //Hedged pairs are inserted at the head of the list, so they are not
+    //visited by the loop
+    for (pair_itr = resolver->resolver_pairs.lh_first; pair_itr != NULL;
+            pair_itr = pair_itr->next_pair.le_next) {
+        if (pair_itr->hedge_at && pair_itr->hedge_at <= now) {
+            pair_itr->hedge_at = 0;
+            neat_resolver_add_next_pair(resolver, pair_itr->src_addr);
+        }
 
-    if (family == AF_INET) {
-        dst_addr4 = &(pair->dst_addr.u.v4.addr4);
-        dst_addr4->sin_family = AF_INET;
-        dst_addr4->sin_port = htons(LDNS_PORT);
-        dst_addr_pton = &(dst_addr4->sin_addr);
-    } else {
-        dst_addr6 = &(pair->dst_addr.u.v6.addr6);
-        dst_addr6->sin6_family = AF_INET6;
-        dst_addr6->sin6_port = htons(LDNS_PORT);
-        dst_addr_pton = &(dst_addr6->sin6_addr);
-    }
+        if (!pair_itr->retrans_at || pair_itr->retrans_at > now)
+            continue;
 
-    if (!inet_pton(family, dst_addr_str, dst_addr_pton)) {
-        fprintf(stderr, "Failed to convert destination address\n");
-        return RETVAL_FAILURE;
+        if (pair_itr->attempts >= attempts) {
+            pair_itr->retrans_at = 0;
+            pair_itr->answered = 1;
+            given_up = 1;
+            neat_resolver_add_next_pair(resolver, pair_itr->src_addr);
+            continue;
+        }
+
+        //The last transmission has not left yet, give it another round
+        if (pair_itr->sending) {
+            pair_itr->retrans_at = now + neat_resolver_jitter(pair_itr->rto);
+            continue;
+        }
+
+        //The server is held responsible once for every query it leaves
+        //unanswered
+        if (pair_itr->attempts == 1)
+            neat_resolver_server_failed(resolver->nc,
+                    pair_itr->bind_addr->if_idx, &(pair_itr->dst_addr));
+
+        if (neat_resolver_retransmit(pair_itr)) {
+            pair_itr->retrans_at = 0;
+            pair_itr->answered = 1;
+            given_up = 1;
+            neat_resolver_add_next_pair(resolver, pair_itr->src_addr);
+            continue;
+        }
+
+        pair_itr->attempts++;
+        pair_itr->rto = 2 * pair_itr->rto < max_rto ?
+            2 * pair_itr->rto : max_rto;
+
+        if (pair_itr->attempts >= attempts)
+            pair_itr->retrans_at = now + max_rto;
+        else
+            pair_itr->retrans_at = now + neat_resolver_jitter(pair_itr->rto);
     }
 
-    //Configure uv_udp_handle
-    if (uv_udp_init(nc->loop, &(pair->resolve_handle))) {
-        //Closed is normally set in close_cb, but since we will never get that
-        //far, set it here instead
-        //pair->closed = 1;
-        fprintf(stderr, "Failure to initialize UDP handle\n");
+    neat_resolver_retrans_start(resolver);
+
+    //Must be done last, the resolver can be released by the callback
+    if (given_up)
+        neat_resolver_search_next(resolver);
+}
+
+//Try to create the src/dst pair for name server number idx of src_addr, and
+//send the query. Returns RETVAL_FAILURE if src_addr will not send more queries,
+//because it has no more name servers or the fan-out limit is reached
+static uint8_t neat_resolver_add_pair(struct neat_resolver *resolver,
+        struct neat_addr *src_addr, uint8_t idx)
+{
+    struct neat_resolver_src_dst_addr *resolver_pair;
+    struct neat_addr *bind_addr;
+    const char *dns_addr;
+    uint32_t num_pairs = 0;
+
+    //After adding support for restart, we can end up here without a domain
+    //name. There is not point continuing if we have no domain name to resolve
+    if (!resolver->domain_name[0])
         return RETVAL_FAILURE;
-    }
 
-    pair->resolve_handle.data = pair;
+    if (idx >= neat_resolver_num_servers(resolver, src_addr, &bind_addr))
+        return RETVAL_FAILURE;
 
-    if (uv_udp_bind(&(pair->resolve_handle),
-                (struct sockaddr*) &(pair->src_addr->u.generic.addr),
-                0)) {
-        fprintf(stderr, "Failed to bind UDP socket\n");
+    if (neat_resolver_source_represented(resolver, src_addr))
         return RETVAL_FAILURE;
-    }
 
-    if (uv_udp_recv_start(&(pair->resolve_handle), neat_resolver_dns_alloc_cb,
-                neat_resolver_dns_recv_cb)) {
-        fprintf(stderr, "Failed to start receiving UDP\n");
+    for (resolver_pair = resolver->resolver_pairs.lh_first;
+            resolver_pair != NULL;
+            resolver_pair = resolver_pair->next_pair.le_next)
+        num_pairs++;
+
+    if (resolver->nc->resolver_max_queries &&
+        num_pairs >= resolver->nc->resolver_max_queries)
         return RETVAL_FAILURE;
+
+    dns_addr = neat_resolver_server_addr(resolver, bind_addr->family, idx);
+
+    resolver_pair = (struct neat_resolver_src_dst_addr*)
+        calloc(sizeof(struct neat_resolver_src_dst_addr), 1);
+
+    if (!resolver_pair) {
+        fprintf(stderr, "Failed to allocate memory for resolver pair\n");
+        return RETVAL_SUCCESS;
     }
 
-//TODO: Binding to interface name requires sudo, not sure if that is acceptable.
-//Ignore any error here for now
-#ifdef __linux__
-    uv_fileno((uv_handle_t*) &(pair->resolve_handle), &socket_fd);
+    resolver_pair->resolver = resolver;
+    resolver_pair->src_addr = src_addr;
+    resolver_pair->bind_addr = bind_addr;
+    resolver_pair->server_idx = idx;
 
-    if (!if_indextoname(pair->src_addr->if_idx, if_name)) {
-        /*fprintf(stderr, "Could not get interface name for index %u\n",
-                pair->src_addr->if_idx);*/
-        return RETVAL_IGNORE;
+    if (neat_resolver_create_pair(resolver->nc, resolver_pair,
+                dns_addr) == RETVAL_FAILURE) {
+        fprintf(stderr, "Failed to create resolver pair\n");
+        neat_resolver_mark_pair_del(resolver_pair);
+        return RETVAL_SUCCESS;
     }
 
-    if (setsockopt(socket_fd, SOL_SOCKET, SO_BINDTODEVICE, if_name,
-                strlen(if_name)) < 0) {
-        //fprintf(stderr, "Could not bind socket to interface %s\n", if_name);
-        return RETVAL_IGNORE;
+    if (neat_resolver_send_query(resolver_pair)) {
+        fprintf(stderr, "Failed to start lookup\n");
+        neat_resolver_mark_pair_del(resolver_pair);
+    } else {
+        //printf("Will lookup %s\n", resolver->domain_name);
+        LIST_INSERT_HEAD(&(resolver->resolver_pairs), resolver_pair,
+                next_pair);
+
+        resolver_pair->attempts = 1;
+        resolver_pair->rto = resolver->nc->dns_rto;
+        resolver_pair->retrans_at = uv_now(resolver->nc->loop) +
+            neat_resolver_jitter(resolver_pair->rto);
+        resolver_pair->hedge_at = uv_now(resolver->nc->loop) +
+            neat_resolver_server_hedge_delay(resolver->nc, bind_addr->if_idx,
+                    &(resolver_pair->dst_addr), resolver_pair->rto);
+        neat_resolver_retrans_start(resolver);
     }
-#endif
 
     return RETVAL_SUCCESS;
 }
 
-//Called when we get a NEAT_NEWADDR message. Go through all matching DNS
-//servers, try to create src/dst pair and send query
-static uint8_t neat_resolver_create_pairs(struct neat_resolver *resolver,
+//Index of the name server of src_addr with the best score that has not been
+//asked yet, in this round of the lookup. Ties go to the server listed first.
+//Returns the number of servers if every one has been asked
+static uint8_t neat_resolver_next_server(struct neat_resolver *resolver,
         struct neat_addr *src_addr)
 {
-    const char **dns_addrs = (const char **) ((src_addr->family == AF_INET) ?
-            INET_DNS_SERVERS : INET6_DNS_SERVERS);
-    uint8_t num_dns = src_addr->family == AF_INET ? sizeof(INET_DNS_SERVERS) :
-        sizeof(INET6_DNS_SERVERS);
-    uint8_t i;
-    struct neat_resolver_src_dst_addr *resolver_pair;
+    struct neat_resolver_src_dst_addr *pair_itr;
+    struct neat_addr *bind_addr, dst_addr;
+    uint32_t score, best_score = UINT32_MAX;
+    uint8_t num_servers, idx, best, loopback;
+
+    num_servers = neat_resolver_num_servers(resolver, src_addr, &bind_addr);
+    best = num_servers;
+
+    for (idx = 0; idx < num_servers; idx++) {
+        for (pair_itr = resolver->resolver_pairs.lh_first; pair_itr != NULL;
+                pair_itr = pair_itr->next_pair.le_next)
+            if (pair_itr->src_addr == src_addr && pair_itr->server_idx == idx)
+                break;
 
-    //After adding support for restart, we can end up here without a domain
-    //name. There is not point continuing if we have no domain name to resolve
-    if (!resolver->domain_name[0])
-        return RETVAL_SUCCESS;
+        if (pair_itr != NULL)
+            continue;
 
-    num_dns /= sizeof(const char*);
+        if (neat_resolver_parse_server(bind_addr->family,
+                    neat_resolver_server_addr(resolver, bind_addr->family, idx),
+                    &dst_addr, &loopback))
+            continue;
 
-    for (i = 0; i < num_dns; i++) {
-        resolver_pair = (struct neat_resolver_src_dst_addr*)
-            calloc(sizeof(struct neat_resolver_src_dst_addr), 1);
+        score = neat_resolver_server_score(resolver->nc, bind_addr->if_idx,
+                                           &dst_addr);
 
-        if (!resolver_pair) {
-            fprintf(stderr, "Failed to allocate memory for resolver pair\n");
-            continue;
+        if (best == num_servers || score < best_score) {
+            best = idx;
+            best_score = score;
         }
+    }
 
-        resolver_pair->resolver = resolver;
-        resolver_pair->src_addr = src_addr;
+    return best;
+}
 
-        if (neat_resolver_create_pair(resolver->nc, resolver_pair,
-                    dns_addrs[i]) == RETVAL_FAILURE) {
-            fprintf(stderr, "Failed to create resolver pair\n");
-            neat_resolver_mark_pair_del(resolver_pair);
-            continue;
-        }
+//Ask the best name server of src_addr that has not been asked yet, unless one
+//has replied. Returns RETVAL_FAILURE if no query was sent
+static uint8_t neat_resolver_add_next_pair(struct neat_resolver *resolver,
+        struct neat_addr *src_addr)
+{
+    struct neat_resolver_src_dst_addr *pair_itr;
 
-        if (neat_resolver_send_query(resolver_pair)) {
-            fprintf(stderr, "Failed to start lookup\n");
-            neat_resolver_mark_pair_del(resolver_pair);
-        } else {
-            //printf("Will lookup %s\n", resolver->domain_name);
-            LIST_INSERT_HEAD(&(resolver->resolver_pairs), resolver_pair,
-                    next_pair);
-        }
-    }
+    for (pair_itr = resolver->resolver_pairs.lh_first; pair_itr != NULL;
+            pair_itr = pair_itr->next_pair.le_next)
+        if (pair_itr->src_addr == src_addr && pair_itr->replied)
+            return RETVAL_FAILURE;
 
-    return RETVAL_SUCCESS;
+    return neat_resolver_add_pair(resolver, src_addr,
+            neat_resolver_next_server(resolver, src_addr));
 }
 
 //Called when we get a NEAT_DELADDR message. Go though all resolve pairs and
@@ -763,6 +2111,11 @@ static void neat_resolver_delete_pairs(struct neat_resolver *resolver,
         resolver_pair = resolver_itr;
         resolver_itr = resolver_itr->next_pair.le_next;
 
+        if (resolver_pair->bind_addr == addr_to_delete) {
+            neat_resolver_mark_pair_del(resolver_pair);
+            continue;
+        }
+
         if (resolver_pair->src_addr->family != addr_to_delete->family)
             continue;
 
@@ -830,6 +2183,9 @@ static uint8_t neat_validate_protocols(int protocols[], uint8_t proto_count)
         case IPPROTO_TCP:
 #ifdef IPPROTO_SCTP
         case IPPROTO_SCTP:
+#endif
+#ifdef IPPROTO_MPTCP
+        case IPPROTO_MPTCP:
 #endif
             continue;
         default:
@@ -840,13 +2196,105 @@ static uint8_t neat_validate_protocols(int protocols[], uint8_t proto_count)
     return RETVAL_SUCCESS;
 }
 
+//Start the resolver timeout and the DNS queries for domain_name. Other
+//lookups of node_name can wait for the answers
+static void neat_resolver_lookup_start(struct neat_resolver *resolver)
+{
+    LIST_INSERT_HEAD(&(resolver->nc->resolver_lookups), resolver,
+            next_lookup);
+    resolver->lookup_active = 1;
+
+    //Start the resolver timeout, this includes fetching addresses
+    uv_timer_start(&(resolver->timeout_handle), neat_resolver_timeout_cb,
+            resolver->dns_t1, 0);
+
+    //No point starting to query if we don't have any source addresses
+    if (!resolver->nc->src_addr_cnt) {
+        fprintf(stderr, "No available src addresses\n");
+        return;
+    }
+
+    //Iterate through available addresses and start sending DNS queries
+    neat_resolver_start_queries(resolver);
+}
+
+//Wait for the answers of a lookup of the same name and family, if there is
+//one. A resolver in streaming mode only joins before any answer has arrived,
+//as it would miss those
+static uint8_t neat_resolver_lookup_join(struct neat_resolver *resolver)
+{
+    struct neat_resolver *leader;
+
+    LIST_FOREACH(leader, &(resolver->nc->resolver_lookups), next_lookup) {
+        if (leader->family != resolver->family ||
+            strcasecmp(leader->node_name, resolver->node_name))
+            continue;
+
+        if (resolver->streaming && leader->name_resolved_timeout)
+            continue;
+
+        resolver->leader = leader;
+        LIST_INSERT_HEAD(&(leader->waiters), resolver, next_waiter);
+        return RETVAL_SUCCESS;
+    }
+
+    return RETVAL_FAILURE;
+}
+
+//The leader of a coalesced lookup is going away. The first waiter takes over
+//its queries and answers, and the others wait for it instead
+static void neat_resolver_lookup_handover(struct neat_resolver *resolver)
+{
+    struct neat_resolver *new_leader, *waiter;
+    struct neat_resolver_src_dst_addr *pair;
+
+    if ((new_leader = LIST_FIRST(&(resolver->waiters))) == NULL)
+        return;
+
+    LIST_REMOVE(new_leader, next_waiter);
+    new_leader->leader = NULL;
+
+    while ((waiter = LIST_FIRST(&(resolver->waiters))) != NULL) {
+        LIST_REMOVE(waiter, next_waiter);
+        waiter->leader = new_leader;
+        LIST_INSERT_HEAD(&(new_leader->waiters), waiter, next_waiter);
+    }
+
+    while ((pair = LIST_FIRST(&(resolver->resolver_pairs))) != NULL) {
+        LIST_REMOVE(pair, next_pair);
+        pair->resolver = new_leader;
+        LIST_INSERT_HEAD(&(new_leader->resolver_pairs), pair, next_pair);
+    }
+
+    neat_resolver_seen_clear(new_leader);
+    new_leader->seen = resolver->seen;
+    new_leader->seen_size = resolver->seen_size;
+    new_leader->seen_cnt = resolver->seen_cnt;
+    resolver->seen = NULL;
+
+    memcpy(new_leader->domain_name, resolver->domain_name, MAX_DOMAIN_LENGTH);
+    new_leader->search_idx = resolver->search_idx;
+    new_leader->name_resolved_timeout = resolver->name_resolved_timeout;
+
+    LIST_INSERT_HEAD(&(resolver->nc->resolver_lookups), new_leader,
+            next_lookup);
+    new_leader->lookup_active = 1;
+
+    if (uv_backend_fd(resolver->nc->loop) == -1)
+        return;
+
+    uv_timer_start(&(new_leader->timeout_handle), neat_resolver_timeout_cb,
+            new_leader->name_resolved_timeout ?
+            new_leader->dns_t2 : new_leader->dns_t1, 0);
+    neat_resolver_retrans_start(new_leader);
+}
+
 //Public NEAT resolver functions
 //getaddrinfo starts a query for the provided service
 uint8_t neat_getaddrinfo(struct neat_resolver *resolver, uint8_t family,
         const char *node, const char *service, int ai_protocol[],
         uint8_t proto_count)
 {
-    struct neat_addr *nsrc_addr = NULL;
     int32_t dst_port = 0;
     int8_t retval;
     uint8_t i;
@@ -887,41 +2335,67 @@ uint8_t neat_getaddrinfo(struct neat_resolver *resolver, uint8_t family,
     //No need to care about \0, we use calloc ...
     memcpy(resolver->domain_name, node, strlen(node));
 
-    //node is a literal, so we will just wait a short while for address list to
-    //be populated
+    //node is a literal. It is resolved right away against the current source
+    //addresses, unless the address list has not been populated yet. Then we
+    //wait a short while for it
     if (retval) {
+        if (resolver->nc->src_addr_cnt) {
+            neat_resolver_literal_resolve(resolver);
+            return RETVAL_SUCCESS;
+        }
+
         uv_timer_start(&(resolver->timeout_handle),
                 neat_resolver_literal_timeout_cb,
                 DNS_LITERAL_TIMEOUT, 0);
         return RETVAL_SUCCESS;
     }
 
-    //Start the resolver timeout, this includes fetching addresses
-    uv_timer_start(&(resolver->timeout_handle), neat_resolver_timeout_cb,
-            resolver->dns_t1, 0);
+    memcpy(resolver->node_name, node, strlen(node));
 
-    //No point starting to query if we don't have any source addresses
-    if (!resolver->nc->src_addr_cnt) {
-        fprintf(stderr, "No available src addresses\n");
+    //Names listed in /etc/hosts are not looked up
+    retval = neat_resolver_hosts_resolve(resolver);
+
+    if (retval == RETVAL_SUCCESS)
+        return RETVAL_SUCCESS;
+
+    if (retval == RETVAL_IGNORE) {
+        uv_timer_start(&(resolver->timeout_handle),
+                neat_resolver_hosts_timeout_cb,
+                DNS_LITERAL_TIMEOUT, 0);
         return RETVAL_SUCCESS;
     }
 
-    //Iterate through src addresses, create udp sockets and start requesting
-    for (nsrc_addr = resolver->nc->src_addrs.lh_first; nsrc_addr != NULL;
-            nsrc_addr = nsrc_addr->next_addr.le_next) {
-        if (resolver->family && nsrc_addr->family != resolver->family)
-            continue;
+    //Names resolved earlier are answered right away. A name known not to exist
+    //moves us on to the next name of the search list
+    for (resolver->search_idx = 0; ; resolver->search_idx++) {
+        retval = neat_resolver_search_name(resolver, resolver->search_idx);
 
-        //Do not use deprecated addresses
-        if (nsrc_addr->family == AF_INET6 && !nsrc_addr->u.v6.ifa_pref)
+        if (retval == RETVAL_IGNORE)
             continue;
 
-        //TODO: Potential place to filter based on policy
+        if (retval == RETVAL_FAILURE) {
+            neat_resolver_complete(resolver, NULL, NEAT_RESOLVER_ERROR);
+            return RETVAL_SUCCESS;
+        }
+
+        //A refresh asks the name servers even though the answer is cached
+        if (resolver->refresh)
+            break;
+
+        retval = neat_resolver_cache_resolve(resolver);
+
+        if (retval == RETVAL_SUCCESS)
+            return RETVAL_SUCCESS;
 
-        neat_resolver_create_pairs(resolver, nsrc_addr);
+        if (retval == RETVAL_FAILURE)
+            break;
     }
 
-    //Iterate through available addresses and start sending DNS queries
+    //Wait for the answers of a lookup of the same name that is in progress
+    if (neat_resolver_lookup_join(resolver) == RETVAL_SUCCESS)
+        return RETVAL_SUCCESS;
+
+    neat_resolver_lookup_start(resolver);
     return RETVAL_SUCCESS;
 }
 
@@ -937,7 +2411,17 @@ neat_resolver_init(struct neat_ctx *nc,
     resolver->nc = nc;
     resolver->cleanup = cleanup;
     resolver->handle_resolve = handle_resolve;
-    resolver->dns_t1 = DNS_TIMEOUT;
+    //Name servers that do not answer are soon joined by the next ones, so like
+    //res_send, a lookup may take attempts tries of timeout
+    if (nc->resolver_conf.loaded &&
+        1000 * nc->resolver_conf.timeout * nc->resolver_conf.attempts <
+        UINT16_MAX)
+        resolver->dns_t1 = 1000 * nc->resolver_conf.timeout *
+            nc->resolver_conf.attempts;
+    else if (nc->resolver_conf.loaded)
+        resolver->dns_t1 = UINT16_MAX;
+    else
+        resolver->dns_t1 = DNS_TIMEOUT;
     resolver->dns_t2 = DNS_RESOLVED_TIMEOUT;
 
     resolver->newaddr_cb.event_cb = neat_resolver_handle_newaddr;
@@ -953,11 +2437,14 @@ neat_resolver_init(struct neat_ctx *nc,
 
     LIST_INIT(&(resolver->resolver_pairs));
     LIST_INIT(&(resolver->resolver_pairs_del));
+    LIST_INIT(&(resolver->waiters));
 
     uv_idle_init(nc->loop, &(resolver->idle_handle));
     resolver->idle_handle.data = resolver;
     uv_timer_init(nc->loop, &(resolver->timeout_handle));
     resolver->timeout_handle.data = resolver;
+    uv_timer_init(nc->loop, &(resolver->retrans_handle));
+    resolver->retrans_handle.data = resolver;
 
     return resolver;
 }
@@ -967,6 +2454,22 @@ static void neat_resolver_cleanup(struct neat_resolver *resolver, uint8_t free_m
 {
     struct neat_resolver_src_dst_addr *resolver_pair, *resolver_itr;
 
+    //Resolvers waiting for this one are handed over, and results that have not
+    //been delivered are dropped
+    neat_resolver_lookup_end(resolver);
+    neat_resolver_lookup_handover(resolver);
+
+    if (resolver->delivery_queued) {
+        TAILQ_REMOVE(&(resolver->nc->resolver_deliveries), resolver,
+                next_delivery);
+        resolver->delivery_queued = 0;
+    }
+
+    if (resolver->delivery_results) {
+        neat_resolver_free_results(resolver->delivery_results);
+        resolver->delivery_results = NULL;
+    }
+
     resolver_itr = resolver->resolver_pairs.lh_first;
 
     while (resolver_itr != NULL) {
@@ -982,10 +2485,14 @@ static void neat_resolver_cleanup(struct neat_resolver *resolver, uint8_t free_m
 
     resolver->free_resolver = free_mem;
     resolver->name_resolved_timeout = 0;
+    neat_resolver_seen_clear(resolver);
 
     if (uv_is_active((const uv_handle_t*) &(resolver->timeout_handle)))
         uv_timer_stop(&(resolver->timeout_handle));
 
+    if (uv_is_active((const uv_handle_t*) &(resolver->retrans_handle)))
+        uv_timer_stop(&(resolver->retrans_handle));
+
     //We need to do this here, in addition to in mark_pair_del, since we might
     //get in the situation where there are zero addresses to delete (for example
     //if resolver is freed before there are no source addresses)
@@ -1002,6 +2509,8 @@ static void neat_resolver_cleanup(struct neat_resolver *resolver, uint8_t free_m
         neat_remove_event_cb(resolver->nc, NEAT_DELADDR, &(resolver->deladdr_cb));
     } else {
         memset(resolver->domain_name, 0, MAX_DOMAIN_LENGTH);
+        memset(resolver->node_name, 0, MAX_DOMAIN_LENGTH);
+        resolver->search_idx = 0;
     }
 
     memset(resolver->ai_protocol, 0, sizeof(resolver->ai_protocol));
@@ -1026,17 +2535,49 @@ void neat_resolver_release(struct neat_resolver *resolver)
 
 void neat_resolver_free_results(struct neat_resolver_results *results)
 {
-    struct neat_resolver_res *result, *res_itr;
-
-    res_itr = results->lh_first;
+    struct neat_resolver_results *next_block;
 
-    while (res_itr != NULL) {
-        result = res_itr;
-        res_itr = res_itr->next_res.le_next;
-        free(result);
+    while (results != NULL) {
+        next_block = results->next_block;
+        free(results);
+        results = next_block;
     }
+}
+
+struct neat_resolver_results *neat_resolver_results_copy(
+        const struct neat_resolver_res *res)
+{
+    struct neat_resolver_results *results = neat_resolver_results_alloc(1, 1);
+
+    if (results == NULL)
+        return NULL;
+
+    results->srcs[0] = *(res->src);
+    results->res[0] = *res;
+    results->res[0].src = &(results->srcs[0]);
+    results->num_srcs = 1;
+    results->num_res = 1;
+    LIST_INSERT_HEAD(results, &(results->res[0]), next_res);
+    return results;
+}
+
+void neat_resolver_results_adopt(struct neat_resolver_results *results,
+        struct neat_resolver_results *other)
+{
+    struct neat_resolver_results *last = other;
+
+    while (last->next_block != NULL)
+        last = last->next_block;
+
+    other->lh_first = NULL;
+    last->next_block = results->next_block;
+    results->next_block = other;
+}
 
-    free(results);
+void neat_resolver_set_streaming(struct neat_resolver *resolver,
+        uint8_t streaming)
+{
+    resolver->streaming = streaming;
 }
 
 void neat_resolver_update_timeouts(struct neat_resolver *resolver, uint16_t t1,
@@ -1045,3 +2586,44 @@ void neat_resolver_update_timeouts(struct neat_resolver *resolver, uint16_t t1,
     resolver->dns_t1 = t1;
     resolver->dns_t2 = t2;
 }
+
+neat_error_code neat_set_interface_filter(struct neat_ctx *ctx,
+                                          const char *include,
+                                          const char *exclude)
+{
+    char *include_copy = NULL, *exclude_copy = NULL;
+
+    if ((include != NULL && (include_copy = strdup(include)) == NULL) ||
+        (exclude != NULL && (exclude_copy = strdup(exclude)) == NULL)) {
+        free(include_copy);
+        return NEAT_ERROR_INTERNAL;
+    }
+
+    free(ctx->if_include);
+    free(ctx->if_exclude);
+    ctx->if_include = include_copy;
+    ctx->if_exclude = exclude_copy;
+    return NEAT_OK;
+}
+
+void neat_resolver_set_fanout(struct neat_ctx *ctx, uint32_t max_queries,
+                              uint8_t per_interface)
+{
+    ctx->resolver_max_queries = max_queries;
+    ctx->resolver_per_if = per_interface;
+}
+
+void neat_resolver_set_retransmit(struct neat_ctx *ctx, uint8_t attempts,
+                                  uint32_t initial_timeout)
+{
+    ctx->dns_attempts = attempts;
+    ctx->dns_rto = initial_timeout ? initial_timeout : NEAT_RESOLVER_RTO;
+}
+
+void neat_resolver_set_answer_policy(struct neat_ctx *ctx,
+                                     neat_answer_policy policy,
+                                     uint8_t max_answers)
+{
+    ctx->answer_policy = policy;
+    ctx->max_answers = max_answers;
+}
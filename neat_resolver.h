@@ -12,8 +12,34 @@
 #define DNS_RESOLVED_TIMEOUT    1000
 #define DNS_LITERAL_TIMEOUT     100
 #define DNS_BUF_SIZE            1472
-#define MAX_NUM_RESOLVED        3
+//Layout of the fixed part of a DNS message (RFC 1035, section 4.1)
+#define DNS_HEADER_SIZE         12
+#define DNS_QDCOUNT_OFFSET      4
+#define DNS_QTYPE_QCLASS_SIZE   4
+//Addresses kept from one reply. A reply without EDNS fits in 512 bytes, which
+//is room for fewer A records than this
+#define DNS_MAX_ANSWERS         32
 #define NO_PROTOCOL             0xFFFFFFFF
+//Answer cache: number of entries, addresses kept per entry, and TTL (s) of a
+//negative answer that came without SOA record
+#define DNS_CACHE_SIZE          256
+#define DNS_CACHE_MAX_ADDRS     DNS_MAX_ANSWERS
+#define DNS_NEGATIVE_TTL        60
+//Refresh-ahead of popular answers: answers with a TTL (s) below this are not
+//refreshed, the others are a tenth of their TTL before they expire, but at
+//least this many ms
+#define DNS_REFRESH_MIN_TTL     10
+#define DNS_REFRESH_MIN_AHEAD   2000
+//Initial size of the set of addresses received by a lookup
+#define DNS_SEEN_MIN_SIZE       16
+//Name server scoreboard: number of servers kept, RTT (ms) assumed for unknown
+//servers, lower bound (ms) of the hedging delay, how long (ms) failures are
+//held against a server, and the largest power of two a score is multiplied by
+#define DNS_SERVERS_SIZE        64
+#define DNS_SERVER_DEFAULT_RTT  200
+#define DNS_SERVER_MIN_HEDGE    20
+#define DNS_SERVER_FAILURE_TTL  60000
+#define DNS_SERVER_MAX_BACKOFF  5
 
 //These are the private networks defined by IANA. We use them to check if we end
 //up in the private network after following redirects
@@ -25,38 +51,183 @@
 #define IANA_C_MASK         0xffff0000 //255.255.0.0 (16)
 
 //We know these servers will not lie and will accept queries from an network
-//address. Until we have defined a syntax for IP/interface information in
-//resolv.conf (and the like), then this is as good as we can do
-//TODO: Some firewalls like to block these, implement a platform-independent way of reading from resolv.conf etc.
+//address. They are only used when resolv.conf lists no name servers (or can't
+//be read), some firewalls like to block them
 static char* const INET_DNS_SERVERS [] = {"8.8.8.8", "8.8.4.4", "208.67.222.222", "208.67.220.220"};
 static char* const INET6_DNS_SERVERS [] = {"2001:4860:4860::8888", "2001:4860:4860::8844", "2620:0:ccc::2", "2620:0:ccd::2"};
 
 struct neat_addr;
 struct neat_resolver;
 
+//IPv4 or IPv6 address, the family is known from the context it is used in
+union neat_dns_addr {
+    struct in_addr v4;
+    struct in6_addr v6;
+};
+
+//Address received for a source address during a lookup, an entry in the set
+//of the resolver. A free slot has family 0
+struct neat_resolver_seen {
+    uint32_t if_idx;
+    uint8_t family;
+    union neat_dns_addr src;
+    union neat_dns_addr dst;
+};
+
+//Answer to one (name, record type) question, as seen from one source interface.
+//An entry without addresses is a negative answer
+struct neat_dns_cache_entry {
+    char *name;
+    uint32_t if_idx;
+    uint16_t rr_type;
+    uint8_t num_addrs;
+    //A lookup to refresh the answer has been started
+    uint8_t refreshing;
+    //Lookups answered by the entry since it was stored
+    uint32_t hits;
+    uint64_t expires; // loop time (ms)
+    //When to refresh the answer if it is popular, 0 if it is too short lived
+    uint64_t refresh_at; // loop time (ms)
+    union neat_dns_addr addrs[DNS_CACHE_MAX_ADDRS];
+    TAILQ_ENTRY(neat_dns_cache_entry) next_entry;
+};
+
+//One (name, address) line of /etc/hosts, aliases get an entry each
+struct neat_hosts_entry {
+    char *name;
+    uint8_t family;
+    union neat_dns_addr addr;
+    LIST_ENTRY(neat_hosts_entry) next_entry;
+};
+
+//Address and TTL (s) of one A or AAAA record of the answer section
+struct neat_dns_answer {
+    union neat_dns_addr addr;
+    uint32_t ttl;
+};
+
+//What the receive path needs from a DNS reply, parsed in place by
+//neat_dns_parse_reply. soa_ttl is the lowest of the TTL and minimum of the
+//first SOA record in the authority section (RFC 2308)
+struct neat_dns_reply {
+    uint8_t rcode;
+    uint8_t num_addrs;
+    uint16_t ancount;
+    uint8_t has_soa;
+    uint8_t __pad;
+    uint16_t __pad2;
+    uint32_t soa_ttl;
+    struct neat_dns_answer answers[DNS_MAX_ANSWERS];
+};
+
+//Parse the reply in buf to the query in query, keeping the addresses of
+//rr_type (A or AAAA) records of the answer section. Nothing is allocated.
+//Returns RETVAL_FAILURE if the reply is malformed, is not a reply, or holds
+//another question than the query
+uint8_t neat_dns_parse_reply(const uint8_t *buf, size_t len,
+                             const uint8_t *query, size_t query_len,
+                             uint16_t rr_type, struct neat_dns_reply *reply);
+
+//What is known about a name server, as reached from one interface. srtt and
+//rttvar (ms) are estimated like the RTO of RFC 6298. failures counts the
+//queries in a row that went unanswered, or got a server error
+struct neat_dns_server {
+    uint32_t if_idx;
+    uint8_t family;
+    uint8_t failures;
+    uint16_t __pad;
+    union neat_dns_addr addr;
+    uint32_t srtt;
+    uint32_t rttvar;
+    uint64_t last_failure; // loop time (ms)
+    TAILQ_ENTRY(neat_dns_server) next_server;
+};
+
+//Record a reply from the server at addr, reached from interface if_idx. rtt
+//(ms) is only used if sampled is set, it is unknown for retransmitted queries
+void neat_resolver_server_answered(struct neat_ctx *nc, uint32_t if_idx,
+                                   const struct neat_addr *addr, uint32_t rtt,
+                                   uint8_t sampled);
+//Record that the server did not answer in time, or failed to answer
+void neat_resolver_server_failed(struct neat_ctx *nc, uint32_t if_idx,
+                                 const struct neat_addr *addr);
+//Expected time (ms) for the server to answer, lower is better. Servers that
+//fail have their score doubled for every failure
+uint32_t neat_resolver_server_score(struct neat_ctx *nc, uint32_t if_idx,
+                                    const struct neat_addr *addr);
+//Time (ms) to wait for the server before the next one is asked as well, at
+//most max_delay
+uint32_t neat_resolver_server_hedge_delay(struct neat_ctx *nc,
+                                          uint32_t if_idx,
+                                          const struct neat_addr *addr,
+                                          uint32_t max_delay);
+
+//Look name up in the background, the answers only end up in the cache. If
+//refresh is set, the name servers are asked even if the answer is cached
+uint8_t neat_resolver_prefetch_start(struct neat_ctx *nc, const char *name,
+                                     uint8_t refresh);
+
+//UDP socket shared by all lookups sent from one source address. Pairs are in
+//queries while their replies can arrive
+struct neat_dns_socket {
+    struct neat_ctx *nc;
+    struct neat_addr *bind_addr;
+    //Used for name servers on the host, and not bound to the interface
+    uint8_t loopback;
+    char dns_rcv_buf[DNS_BUF_SIZE];
+    uv_udp_t handle;
+    struct neat_event_cb deladdr_cb;
+    struct neat_resolver_pairs queries;
+    LIST_ENTRY(neat_dns_socket) next_socket;
+};
+
 //Represent one source/dst address used for DNS lookups. We could save space by
 //recycling handle, but this structure will make it easier to support
 //fragmentation of DNS requests (way down the line)
 struct neat_resolver_src_dst_addr {
     struct neat_resolver *resolver;
     struct neat_addr *src_addr;
+    //Address the socket is bound to. This is src_addr, unless the name servers
+    //are of the other family. Then it is an address on the same interface
+    struct neat_addr *bind_addr;
     //TODO: Dynamically allocate?
     struct neat_addr dst_addr;
 
-    char dns_rcv_buf[DNS_BUF_SIZE];
     ldns_buffer *dns_snd_buf;
     uv_buf_t dns_uv_snd_buf;
     uv_udp_send_t dns_snd_handle;
-    uv_udp_t resolve_handle;
+    //Socket the query is sent on, NULL once the pair is deleted
+    struct neat_dns_socket *sock;
+    uint16_t query_id;
+    //Name server of src_addr the query is sent to, transmissions so far, and
+    //when (loop time, ms) to retransmit or give up. 0 once answered
+    uint8_t server_idx;
+    uint8_t attempts;
+    uint32_t rto;
+    uint64_t retrans_at;
+    //When the query was sent, 0 once it has been retransmitted (as the reply
+    //could be to either transmission), and when to ask the next name server of
+    //src_addr as well. 0 once that is done, or the query is answered
+    uint64_t sent_at;
+    uint64_t hedge_at;
 
     LIST_ENTRY(neat_resolver_src_dst_addr) next_pair;
+    LIST_ENTRY(neat_resolver_src_dst_addr) next_query;
 
-    //TODO: Consider designing a better algorithm for selecting servers when
-    //there are multiple answers, than just picking first MAX_NUM_RESOLVED
-    struct sockaddr_storage resolved_addr[MAX_NUM_RESOLVED];
+    //Every address received, apart from duplicates. Which of them are passed
+    //on is up to the answer policy of the context
+    union neat_dns_addr *resolved_addrs;
+    uint8_t num_resolved;
 
     //Keep track of which pairs are closed
     uint8_t closed;
+    //Pair is in resolver_pairs_del, and query is still being sent
+    uint8_t deleted;
+    uint8_t sending;
+    //A reply has been received, or the server has been given up on
+    uint8_t answered;
+    //A reply that is not a server error has been received
+    uint8_t replied;
 };
 
 #endif
@@ -0,0 +1,250 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <uv.h>
+
+#include "neat.h"
+#include "neat_internal.h"
+#include "neat_core.h"
+#include "neat_addr.h"
+#include "neat_resolver.h"
+
+//Defaults of res_init, used when resolv.conf does not set the options
+#define NEAT_RESOLV_NDOTS 1
+#define NEAT_RESOLV_TIMEOUT 5
+#define NEAT_RESOLV_ATTEMPTS 2
+//Limits of res_init for the options
+#define NEAT_RESOLV_MAX_NDOTS 15
+#define NEAT_RESOLV_MAX_TIMEOUT 30
+#define NEAT_RESOLV_MAX_ATTEMPTS 5
+
+#define NEAT_RESOLV_LINE_LEN 1024
+#define NEAT_RESOLV_DELIM " \t\r\n"
+
+//Parse "name:value" of an option, value is clamped to [min, max]
+static uint8_t neat_resolver_conf_option(const char *option, const char *name,
+                                         uint8_t min, uint8_t max,
+                                         uint8_t *value)
+{
+    size_t name_len = strlen(name);
+    int32_t parsed;
+
+    if (strncmp(option, name, name_len) || option[name_len] != ':')
+        return RETVAL_FAILURE;
+
+    parsed = atoi(option + name_len + 1);
+
+    if (parsed < min)
+        parsed = min;
+    else if (parsed > max)
+        parsed = max;
+
+    *value = parsed;
+    return RETVAL_SUCCESS;
+}
+
+//Zone indexes are not supported for name servers, and are left out
+static void neat_resolver_conf_add_server(struct neat_resolver_conf *conf,
+                                          char *server)
+{
+    struct in6_addr dummy_addr;
+    char *scope = strchr(server, '%');
+
+    if (scope != NULL)
+        *scope = '\0';
+
+    if (inet_pton(AF_INET, server, &dummy_addr) == 1) {
+        if (conf->servers4_cnt < NEAT_RESOLV_MAX_SERVERS)
+            snprintf(conf->servers4[conf->servers4_cnt++], INET_ADDRSTRLEN,
+                     "%s", server);
+    } else if (inet_pton(AF_INET6, server, &dummy_addr) == 1) {
+        if (conf->servers6_cnt < NEAT_RESOLV_MAX_SERVERS)
+            snprintf(conf->servers6[conf->servers6_cnt++], INET6_ADDRSTRLEN,
+                     "%s", server);
+    } else {
+        fprintf(stderr, "Ignoring invalid name server %s\n", server);
+    }
+}
+
+//Read name servers, search list and options. Like res_init, the last domain
+//or search line wins
+static void neat_resolver_conf_read_resolv(struct neat_ctx *nc)
+{
+    struct neat_resolver_conf *conf = &(nc->resolver_conf);
+    char line[NEAT_RESOLV_LINE_LEN];
+    char *token, *saveptr;
+    FILE *resolv_file;
+
+    conf->servers4_cnt = 0;
+    conf->servers6_cnt = 0;
+    conf->search_cnt = 0;
+    conf->ndots = NEAT_RESOLV_NDOTS;
+    conf->timeout = NEAT_RESOLV_TIMEOUT;
+    conf->attempts = NEAT_RESOLV_ATTEMPTS;
+    conf->loaded = 0;
+
+    if ((resolv_file = fopen(NEAT_RESOLV_CONF, "r")) == NULL)
+        return;
+
+    conf->loaded = 1;
+
+    while (fgets(line, sizeof(line), resolv_file) != NULL) {
+        token = strtok_r(line, NEAT_RESOLV_DELIM, &saveptr);
+
+        if (token == NULL || token[0] == '#' || token[0] == ';')
+            continue;
+
+        if (!strcmp(token, "nameserver")) {
+            token = strtok_r(NULL, NEAT_RESOLV_DELIM, &saveptr);
+
+            if (token != NULL)
+                neat_resolver_conf_add_server(conf, token);
+        } else if (!strcmp(token, "domain") || !strcmp(token, "search")) {
+            conf->search_cnt = 0;
+
+            while ((token = strtok_r(NULL, NEAT_RESOLV_DELIM, &saveptr))
+                    != NULL && conf->search_cnt < NEAT_RESOLV_MAX_SEARCH) {
+                //Room is needed for the name it is appended to
+                if (strlen(token) + 2 >= MAX_DOMAIN_LENGTH)
+                    continue;
+
+                snprintf(conf->search[conf->search_cnt++], MAX_DOMAIN_LENGTH,
+                         "%s", token);
+            }
+        } else if (!strcmp(token, "options")) {
+            while ((token = strtok_r(NULL, NEAT_RESOLV_DELIM, &saveptr))
+                    != NULL) {
+                if (!neat_resolver_conf_option(token, "ndots", 0,
+                            NEAT_RESOLV_MAX_NDOTS, &(conf->ndots)))
+                    continue;
+                if (!neat_resolver_conf_option(token, "timeout", 1,
+                            NEAT_RESOLV_MAX_TIMEOUT, &(conf->timeout)))
+                    continue;
+                neat_resolver_conf_option(token, "attempts", 1,
+                        NEAT_RESOLV_MAX_ATTEMPTS, &(conf->attempts));
+            }
+        }
+    }
+
+    fclose(resolv_file);
+}
+
+static void neat_resolver_conf_flush_hosts(struct neat_resolver_conf *conf)
+{
+    struct neat_hosts_entry *entry;
+
+    while ((entry = LIST_FIRST(&(conf->hosts))) != NULL) {
+        LIST_REMOVE(entry, next_entry);
+        free(entry);
+    }
+}
+
+static void neat_resolver_conf_read_hosts(struct neat_ctx *nc)
+{
+    struct neat_resolver_conf *conf = &(nc->resolver_conf);
+    struct neat_hosts_entry *entry;
+    union neat_dns_addr addr;
+    char line[NEAT_RESOLV_LINE_LEN];
+    char *token, *saveptr, *comment;
+    size_t name_len;
+    uint8_t family;
+    FILE *hosts_file;
+
+    neat_resolver_conf_flush_hosts(conf);
+
+    if ((hosts_file = fopen(NEAT_HOSTS, "r")) == NULL)
+        return;
+
+    while (fgets(line, sizeof(line), hosts_file) != NULL) {
+        if ((comment = strchr(line, '#')) != NULL)
+            *comment = '\0';
+
+        if ((token = strtok_r(line, NEAT_RESOLV_DELIM, &saveptr)) == NULL)
+            continue;
+
+        //Zone indexes are not supported, the address is used without
+        if ((comment = strchr(token, '%')) != NULL)
+            *comment = '\0';
+
+        if (inet_pton(AF_INET, token, &(addr.v4)) == 1)
+            family = AF_INET;
+        else if (inet_pton(AF_INET6, token, &(addr.v6)) == 1)
+            family = AF_INET6;
+        else
+            continue;
+
+        while ((token = strtok_r(NULL, NEAT_RESOLV_DELIM, &saveptr)) != NULL) {
+            name_len = strlen(token) + 1;
+
+            if (name_len > MAX_DOMAIN_LENGTH)
+                continue;
+
+            //Name is stored right after the entry
+            entry = calloc(1, sizeof(struct neat_hosts_entry) + name_len);
+            if (entry == NULL)
+                break;
+
+            entry->name = (char *) (entry + 1);
+            memcpy(entry->name, token, name_len);
+            entry->family = family;
+            entry->addr = addr;
+            LIST_INSERT_HEAD(&(conf->hosts), entry, next_entry);
+        }
+    }
+
+    fclose(hosts_file);
+}
+
+//The files are often replaced rather than written to, so the watch is
+//restarted to follow the new file
+static void neat_resolver_conf_changed_cb(uv_fs_event_t *handle,
+                                          const char *filename, int events,
+                                          int status)
+{
+    struct neat_ctx *nc = handle->data;
+    const char *path;
+
+    uv_fs_event_stop(handle);
+
+    if (handle == &(nc->resolver_conf.resolv_handle)) {
+        path = NEAT_RESOLV_CONF;
+        neat_resolver_conf_read_resolv(nc);
+
+        //Answers from the old name servers may not hold for the new ones
+        neat_resolver_cache_flush(nc);
+        neat_resolver_servers_flush(nc);
+    } else {
+        path = NEAT_HOSTS;
+        neat_resolver_conf_read_hosts(nc);
+    }
+
+    if (uv_fs_event_start(handle, neat_resolver_conf_changed_cb, path, 0))
+        fprintf(stderr, "Could not watch %s for changes\n", path);
+}
+
+void neat_resolver_conf_init(struct neat_ctx *nc)
+{
+    struct neat_resolver_conf *conf = &(nc->resolver_conf);
+
+    LIST_INIT(&(conf->hosts));
+    neat_resolver_conf_read_resolv(nc);
+    neat_resolver_conf_read_hosts(nc);
+
+    uv_fs_event_init(nc->loop, &(conf->resolv_handle));
+    conf->resolv_handle.data = nc;
+    uv_fs_event_init(nc->loop, &(conf->hosts_handle));
+    conf->hosts_handle.data = nc;
+
+    //A missing file is not an error, we just do not learn about it appearing
+    uv_fs_event_start(&(conf->resolv_handle), neat_resolver_conf_changed_cb,
+                      NEAT_RESOLV_CONF, 0);
+    uv_fs_event_start(&(conf->hosts_handle), neat_resolver_conf_changed_cb,
+                      NEAT_HOSTS, 0);
+}
+
+void neat_resolver_conf_cleanup(struct neat_ctx *nc)
+{
+    neat_resolver_conf_flush_hosts(&(nc->resolver_conf));
+}
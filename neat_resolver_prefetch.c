@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <uv.h>
+
+#include "neat.h"
+#include "neat_internal.h"
+#include "neat_core.h"
+#include "neat_addr.h"
+#include "neat_resolver.h"
+
+//Background lookups. They are ordinary lookups of the resolver, with results
+//that are thrown away, what matters is that the answers end up in the cache.
+//The refresh timer of neat_resolver.c starts them for popular names, and
+//applications for the names they know they will need
+
+static void neat_resolver_prefetch_cleanup_cb(struct neat_resolver *resolver)
+{
+    free(resolver);
+}
+
+static void neat_resolver_prefetch_resolve_cb(struct neat_resolver *resolver,
+        struct neat_resolver_results *results, uint8_t code)
+{
+    neat_resolver_free_results(results);
+    LIST_REMOVE(resolver, next_prefetch);
+    neat_resolver_release(resolver);
+}
+
+uint8_t neat_resolver_prefetch_start(struct neat_ctx *nc, const char *name,
+                                     uint8_t refresh)
+{
+    struct neat_resolver *resolver;
+    char node[MAX_DOMAIN_LENGTH];
+    int protocols[] = {IPPROTO_TCP};
+    size_t name_len = strlen(name);
+
+    //A refresh is of the name that was cached, it must not be searched again
+    if (refresh && name_len && name[name_len - 1] != '.') {
+        if (snprintf(node, sizeof(node), "%s.", name) >= sizeof(node))
+            return RETVAL_FAILURE;
+
+        name = node;
+    }
+
+    if ((resolver = neat_resolver_init(nc, neat_resolver_prefetch_resolve_cb,
+                    neat_resolver_prefetch_cleanup_cb)) == NULL)
+        return RETVAL_FAILURE;
+
+    resolver->refresh = refresh;
+    LIST_INSERT_HEAD(&(nc->resolver_prefetches), resolver, next_prefetch);
+
+    //Any port will do
+    if (neat_getaddrinfo(resolver, AF_UNSPEC, name, "80", protocols, 1)) {
+        LIST_REMOVE(resolver, next_prefetch);
+        neat_resolver_release(resolver);
+        return RETVAL_FAILURE;
+    }
+
+    return RETVAL_SUCCESS;
+}
+
+void neat_resolver_prefetch_cleanup(struct neat_ctx *nc)
+{
+    struct neat_resolver *resolver;
+
+    while ((resolver = LIST_FIRST(&(nc->resolver_prefetches))) != NULL) {
+        LIST_REMOVE(resolver, next_prefetch);
+        neat_resolver_release(resolver);
+        free(resolver);
+    }
+}
+
+neat_error_code neat_resolver_prefetch(struct neat_ctx *ctx,
+                                       const char *names[],
+                                       uint32_t num_names)
+{
+    neat_error_code retval = NEAT_OK;
+    uint32_t i;
+
+    for (i = 0; i < num_names; i++) {
+        if (names[i] == NULL ||
+            strlen(names[i]) + 1 > MAX_DOMAIN_LENGTH) {
+            retval = NEAT_ERROR_BAD_ARGUMENT;
+            continue;
+        }
+
+        if (neat_resolver_prefetch_start(ctx, names[i], 0))
+            retval = NEAT_ERROR_INTERNAL;
+    }
+
+    return retval;
+}
+
+void neat_resolver_set_refresh(struct neat_ctx *ctx, uint32_t min_hits)
+{
+    ctx->dns_refresh_hits = min_hits;
+
+    if (!min_hits) {
+        uv_timer_stop(&(ctx->dns_refresh_handle));
+        ctx->dns_refresh_at = 0;
+    }
+}
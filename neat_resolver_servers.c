@@ -0,0 +1,181 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <uv.h>
+
+#include "neat.h"
+#include "neat_internal.h"
+#include "neat_core.h"
+#include "neat_addr.h"
+#include "neat_resolver.h"
+
+//The scoreboard decides which name server a lookup asks first, and how long it
+//waits for it before it asks the next one as well (see the hedging in
+//neat_resolver.c). Servers are kept per interface, the path to a server can be
+//fast on one network and broken on another
+
+static void neat_resolver_server_key(struct neat_dns_server *key,
+                                     uint32_t if_idx,
+                                     const struct neat_addr *addr)
+{
+    memset(key, 0, sizeof(struct neat_dns_server));
+    key->if_idx = if_idx;
+    key->family = addr->family;
+
+    if (addr->family == AF_INET)
+        key->addr.v4 = addr->u.v4.addr4.sin_addr;
+    else
+        key->addr.v6 = addr->u.v6.addr6.sin6_addr;
+}
+
+//Find the entry of a server. If create is set, a missing entry is added and
+//the entry is moved to the head of the list, the least recently updated server
+//is forgotten when the scoreboard is full
+static struct neat_dns_server *neat_resolver_server_lookup(
+        struct neat_ctx *nc, uint32_t if_idx, const struct neat_addr *addr,
+        uint8_t create)
+{
+    struct neat_dns_server key, *server;
+
+    neat_resolver_server_key(&key, if_idx, addr);
+
+    TAILQ_FOREACH(server, &(nc->dns_servers), next_server) {
+        if (server->if_idx == key.if_idx && server->family == key.family &&
+            !memcmp(&(server->addr), &(key.addr), sizeof(key.addr)))
+            break;
+    }
+
+    if (!create)
+        return server;
+
+    if (server != NULL) {
+        TAILQ_REMOVE(&(nc->dns_servers), server, next_server);
+        TAILQ_INSERT_HEAD(&(nc->dns_servers), server, next_server);
+        return server;
+    }
+
+    if (nc->dns_servers_cnt >= DNS_SERVERS_SIZE) {
+        server = TAILQ_LAST(&(nc->dns_servers), neat_dns_servers);
+        TAILQ_REMOVE(&(nc->dns_servers), server, next_server);
+        free(server);
+        nc->dns_servers_cnt--;
+    }
+
+    if ((server = calloc(1, sizeof(struct neat_dns_server))) == NULL)
+        return NULL;
+
+    *server = key;
+    TAILQ_INSERT_HEAD(&(nc->dns_servers), server, next_server);
+    nc->dns_servers_cnt++;
+    return server;
+}
+
+//Failures are forgiven after a while, so that a server that is back gets
+//another chance
+static uint8_t neat_resolver_server_failures(struct neat_ctx *nc,
+                                             struct neat_dns_server *server)
+{
+    if (!server->failures ||
+        uv_now(nc->loop) - server->last_failure > DNS_SERVER_FAILURE_TTL)
+        return 0;
+
+    return server->failures < DNS_SERVER_MAX_BACKOFF ?
+        server->failures : DNS_SERVER_MAX_BACKOFF;
+}
+
+void neat_resolver_server_answered(struct neat_ctx *nc, uint32_t if_idx,
+                                   const struct neat_addr *addr, uint32_t rtt,
+                                   uint8_t sampled)
+{
+    struct neat_dns_server *server;
+    uint32_t delta;
+
+    if ((server = neat_resolver_server_lookup(nc, if_idx, addr, 1)) == NULL)
+        return;
+
+    server->failures = 0;
+
+    if (!sampled)
+        return;
+
+    //RFC 6298, section 2, with alpha 1/8 and beta 1/4
+    if (!server->srtt) {
+        server->srtt = rtt ? rtt : 1;
+        server->rttvar = rtt / 2;
+        return;
+    }
+
+    delta = server->srtt > rtt ? server->srtt - rtt : rtt - server->srtt;
+    server->rttvar = server->rttvar - server->rttvar / 4 + delta / 4;
+    server->srtt = server->srtt - server->srtt / 8 + rtt / 8;
+
+    if (!server->srtt)
+        server->srtt = 1;
+}
+
+void neat_resolver_server_failed(struct neat_ctx *nc, uint32_t if_idx,
+                                 const struct neat_addr *addr)
+{
+    struct neat_dns_server *server;
+
+    if ((server = neat_resolver_server_lookup(nc, if_idx, addr, 1)) == NULL)
+        return;
+
+    server->failures = neat_resolver_server_failures(nc, server) + 1;
+    server->last_failure = uv_now(nc->loop);
+}
+
+uint32_t neat_resolver_server_score(struct neat_ctx *nc, uint32_t if_idx,
+                                    const struct neat_addr *addr)
+{
+    struct neat_dns_server *server;
+    uint32_t srtt = DNS_SERVER_DEFAULT_RTT;
+    uint8_t failures = 0;
+
+    if ((server = neat_resolver_server_lookup(nc, if_idx, addr, 0)) != NULL) {
+        if (server->srtt)
+            srtt = server->srtt;
+
+        failures = neat_resolver_server_failures(nc, server);
+    }
+
+    return srtt << failures;
+}
+
+//The server has had its time when it should have answered by the RTO of RFC
+//6298. A server we know nothing about is waited for as long as a query is
+//before it is retransmitted
+uint32_t neat_resolver_server_hedge_delay(struct neat_ctx *nc,
+                                          uint32_t if_idx,
+                                          const struct neat_addr *addr,
+                                          uint32_t max_delay)
+{
+    struct neat_dns_server *server;
+    uint32_t delay;
+
+    server = neat_resolver_server_lookup(nc, if_idx, addr, 0);
+
+    if (server == NULL || !server->srtt ||
+        neat_resolver_server_failures(nc, server))
+        return max_delay;
+
+    delay = server->srtt + 4 * server->rttvar;
+
+    if (delay < DNS_SERVER_MIN_HEDGE)
+        delay = DNS_SERVER_MIN_HEDGE;
+
+    return delay < max_delay ? delay : max_delay;
+}
+
+void neat_resolver_servers_flush(struct neat_ctx *nc)
+{
+    struct neat_dns_server *server;
+
+    while ((server = TAILQ_FIRST(&(nc->dns_servers))) != NULL) {
+        TAILQ_REMOVE(&(nc->dns_servers), server, next_server);
+        free(server);
+    }
+
+    nc->dns_servers_cnt = 0;
+}
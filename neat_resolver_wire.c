@@ -0,0 +1,173 @@
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <netinet/in.h>
+#include <uv.h>
+#include <ldns/ldns.h>
+
+#include "neat.h"
+#include "neat_internal.h"
+#include "neat_core.h"
+#include "neat_addr.h"
+#include "neat_resolver.h"
+
+//QR bit of the flags, set in replies
+#define DNS_FLAG_QR 0x80
+//Fixed part of a resource record after the owner name: type, class, TTL and
+//length of rdata (RFC 1035, section 4.1.3)
+#define DNS_RR_FIXED_SIZE 10
+//Offset of minimum in the rdata of a SOA record, after the two names
+#define DNS_SOA_MINIMUM_OFFSET 16
+
+static uint16_t neat_dns_read16(const uint8_t *buf)
+{
+    return (buf[0] << 8) | buf[1];
+}
+
+static uint32_t neat_dns_read32(const uint8_t *buf)
+{
+    return ((uint32_t) buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+}
+
+//A TTL with the most significant bit set is treated as 0 (RFC 2181, 8)
+static uint32_t neat_dns_read_ttl(const uint8_t *buf)
+{
+    uint32_t ttl = neat_dns_read32(buf);
+
+    return ttl & 0x80000000 ? 0 : ttl;
+}
+
+//Move offset past the (possibly compressed) name that starts there. Pointers
+//are not followed, as the name itself is never needed. Returns RETVAL_FAILURE
+//if the name does not fit in len
+static uint8_t neat_dns_skip_name(const uint8_t *buf, size_t len,
+                                  size_t *offset)
+{
+    size_t pos = *offset;
+    uint8_t label_len;
+
+    while (pos < len) {
+        label_len = buf[pos];
+
+        //End of the name, or a pointer to the rest of it
+        if (!label_len) {
+            *offset = pos + 1;
+            return RETVAL_SUCCESS;
+        } else if ((label_len & 0xc0) == 0xc0) {
+            if (pos + 2 > len)
+                return RETVAL_FAILURE;
+
+            *offset = pos + 2;
+            return RETVAL_SUCCESS;
+        } else if (label_len & 0xc0) {
+            //Extended label types are not in use
+            return RETVAL_FAILURE;
+        }
+
+        pos += label_len + 1;
+    }
+
+    return RETVAL_FAILURE;
+}
+
+//Minimum of a SOA record, whose rdata starts at offset and ends at rd_end
+static uint8_t neat_dns_soa_minimum(const uint8_t *buf, size_t rd_end,
+                                    size_t offset, uint32_t *minimum)
+{
+    //MNAME and RNAME
+    if (neat_dns_skip_name(buf, rd_end, &offset) ||
+        neat_dns_skip_name(buf, rd_end, &offset) ||
+        offset + DNS_SOA_MINIMUM_OFFSET + sizeof(uint32_t) > rd_end)
+        return RETVAL_FAILURE;
+
+    *minimum = neat_dns_read32(buf + offset + DNS_SOA_MINIMUM_OFFSET);
+    return RETVAL_SUCCESS;
+}
+
+//A reply carries the question of the query, which holds exactly one. The name
+//is compared without case, the type and class exactly. Returns the offset of
+//the answer section, or 0 if the questions differ
+static size_t neat_dns_question_end(const uint8_t *buf, size_t len,
+                                    const uint8_t *query, size_t query_len)
+{
+    size_t i;
+
+    if (query_len <= DNS_HEADER_SIZE + DNS_QTYPE_QCLASS_SIZE ||
+        len < query_len ||
+        neat_dns_read16(query + DNS_QDCOUNT_OFFSET) != 1 ||
+        neat_dns_read16(buf + DNS_QDCOUNT_OFFSET) != 1)
+        return 0;
+
+    for (i = DNS_HEADER_SIZE; i < query_len - DNS_QTYPE_QCLASS_SIZE; i++)
+        if (tolower(buf[i]) != tolower(query[i]))
+            return 0;
+
+    if (memcmp(buf + i, query + i, DNS_QTYPE_QCLASS_SIZE))
+        return 0;
+
+    return query_len;
+}
+
+uint8_t neat_dns_parse_reply(const uint8_t *buf, size_t len,
+                             const uint8_t *query, size_t query_len,
+                             uint16_t rr_type, struct neat_dns_reply *reply)
+{
+    size_t offset, addr_len, rd_end;
+    uint16_t nscount, type, class, rd_len;
+    uint32_t ttl, minimum, i;
+
+    if (len < DNS_HEADER_SIZE || !(buf[2] & DNS_FLAG_QR))
+        return RETVAL_FAILURE;
+
+    if (!(offset = neat_dns_question_end(buf, len, query, query_len)))
+        return RETVAL_FAILURE;
+
+    addr_len = rr_type == LDNS_RR_TYPE_A ?
+        sizeof(struct in_addr) : sizeof(struct in6_addr);
+
+    memset(reply, 0, sizeof(struct neat_dns_reply));
+    reply->rcode = buf[3] & 0x0f;
+    reply->ancount = neat_dns_read16(buf + DNS_QDCOUNT_OFFSET + 2);
+    nscount = neat_dns_read16(buf + DNS_QDCOUNT_OFFSET + 4);
+
+    //Answers and authority records have the same layout. Only records of
+    //rr_type are of interest in the answer section, and the SOA record of a
+    //negative answer in the authority section. CNAME records are skipped, the
+    //addresses of the target follow them
+    for (i = 0; i < reply->ancount + nscount; i++) {
+        if (neat_dns_skip_name(buf, len, &offset) ||
+            offset + DNS_RR_FIXED_SIZE > len)
+            return RETVAL_FAILURE;
+
+        type = neat_dns_read16(buf + offset);
+        class = neat_dns_read16(buf + offset + 2);
+        ttl = neat_dns_read_ttl(buf + offset + 4);
+        rd_len = neat_dns_read16(buf + offset + 8);
+        offset += DNS_RR_FIXED_SIZE;
+        rd_end = offset + rd_len;
+
+        if (rd_end > len)
+            return RETVAL_FAILURE;
+
+        if (class != LDNS_RR_CLASS_IN) {
+            offset = rd_end;
+            continue;
+        }
+
+        if (i < reply->ancount && type == rr_type && rd_len == addr_len &&
+            reply->num_addrs < DNS_MAX_ANSWERS) {
+            memcpy(&(reply->answers[reply->num_addrs].addr), buf + offset,
+                   addr_len);
+            reply->answers[reply->num_addrs++].ttl = ttl;
+        } else if (i >= reply->ancount && type == LDNS_RR_TYPE_SOA &&
+                   !reply->has_soa &&
+                   !neat_dns_soa_minimum(buf, rd_end, offset, &minimum)) {
+            reply->has_soa = 1;
+            reply->soa_ttl = minimum < ttl ? minimum : ttl;
+        }
+
+        offset = rd_end;
+    }
+
+    return RETVAL_SUCCESS;
+}
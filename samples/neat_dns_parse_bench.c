@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <uv.h>
+#include <ldns/ldns.h>
+
+#include "../neat.h"
+
+// The DNS parser is internal - but it is benchmarked from here anyway
+#include "../neat_internal.h"
+#include "../neat_addr.h"
+#include "../neat_resolver.h"
+
+// Compares the cost of getting the addresses out of a DNS reply with ldns, the
+// way the resolver used to, and with neat_dns_parse_reply.
+// Usage: neat_dns_parse_bench [iterations]
+
+#define DEFAULT_ITERATIONS 1000000
+
+// Reply to "www.example.com A": a CNAME to edge.example.com and four A records
+// for it, with compressed names
+static const uint8_t reply[] = {
+    0x12, 0x34, 0x81, 0x80, 0x00, 0x01, 0x00, 0x05, 0x00, 0x00, 0x00, 0x00,
+    // Question, at offset 12
+    0x03, 'w', 'w', 'w', 0x07, 'e', 'x', 'a', 'm', 'p', 'l', 'e',
+    0x03, 'c', 'o', 'm', 0x00, 0x00, 0x01, 0x00, 0x01,
+    // www.example.com CNAME edge.example.com, target at offset 45
+    0xc0, 0x0c, 0x00, 0x05, 0x00, 0x01, 0x00, 0x00, 0x01, 0x2c, 0x00, 0x07,
+    0x04, 'e', 'd', 'g', 'e', 0xc0, 0x10,
+    // edge.example.com A
+    0xc0, 0x2d, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x00, 0x3c, 0x00, 0x04,
+    192, 0, 2, 1,
+    0xc0, 0x2d, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x00, 0x3c, 0x00, 0x04,
+    192, 0, 2, 2,
+    0xc0, 0x2d, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x00, 0x3c, 0x00, 0x04,
+    192, 0, 2, 3,
+    0xc0, 0x2d, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x00, 0x3c, 0x00, 0x04,
+    192, 0, 2, 4,
+};
+
+// The query is the header and question of the reply
+#define QUERY_LEN (12 + 17 + 4)
+
+static uint32_t parse_ldns(struct in_addr *addrs)
+{
+    ldns_pkt *dns_reply;
+    ldns_rr_list *rr_list;
+    ldns_rdf *rdf_result;
+    ldns_buffer *host_addr;
+    uint32_t num_addrs = 0;
+    size_t i;
+
+    if (ldns_wire2pkt(&dns_reply, reply, sizeof(reply)) != LDNS_STATUS_OK)
+        return 0;
+
+    rr_list = ldns_pkt_rr_list_by_type(dns_reply, LDNS_RR_TYPE_A,
+                                       LDNS_SECTION_ANSWER);
+
+    for (i = 0; rr_list != NULL && i < ldns_rr_list_rr_count(rr_list); i++) {
+        rdf_result = ldns_rr_rdf(ldns_rr_list_rr(rr_list, i), 0);
+        host_addr = ldns_buffer_new(ldns_rdf_size(rdf_result));
+
+        if (host_addr == NULL)
+            continue;
+
+        ldns_rdf2buffer_str_a(host_addr, rdf_result);
+
+        if (inet_pton(AF_INET, (const char*) ldns_buffer_begin(host_addr),
+                      &addrs[num_addrs]) == 1)
+            num_addrs++;
+
+        ldns_buffer_free(host_addr);
+    }
+
+    if (rr_list != NULL)
+        ldns_rr_list_deep_free(rr_list);
+
+    ldns_pkt_free(dns_reply);
+    return num_addrs;
+}
+
+static uint32_t parse_neat(struct in_addr *addrs)
+{
+    struct neat_dns_reply dns_reply;
+    uint8_t i;
+
+    if (neat_dns_parse_reply(reply, sizeof(reply), reply, QUERY_LEN,
+                             LDNS_RR_TYPE_A, &dns_reply))
+        return 0;
+
+    for (i = 0; i < dns_reply.num_addrs; i++)
+        addrs[i] = dns_reply.answers[i].addr.v4;
+
+    return dns_reply.num_addrs;
+}
+
+static void run(const char *name, uint32_t (*parse)(struct in_addr *),
+                uint32_t iterations)
+{
+    struct in_addr addrs[DNS_MAX_ANSWERS];
+    uint64_t start, elapsed;
+    uint32_t i, num_addrs = 0;
+
+    start = uv_hrtime();
+
+    for (i = 0; i < iterations; i++)
+        num_addrs = parse(addrs);
+
+    elapsed = uv_hrtime() - start;
+
+    printf("%-5s %u addresses, %.1f ns per reply\n", name, num_addrs,
+           (double) elapsed / iterations);
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t iterations = DEFAULT_ITERATIONS;
+
+    if (argc > 1 && atoi(argv[1]) > 0)
+        iterations = atoi(argv[1]);
+
+    run("ldns", parse_ldns, iterations);
+    run("neat", parse_neat, iterations);
+
+    exit(EXIT_SUCCESS);
+}
@@ -26,7 +26,7 @@ static void resolver_handle(struct neat_resolver *resolver,
     }
 
     LIST_FOREACH(result, results, next_res) {
-        getnameinfo((struct sockaddr *)&result->src_addr, result->src_addr_len,
+        getnameinfo((struct sockaddr *)&result->src->addr, result->src->addr_len,
                     src_str, sizeof(src_str), NULL, 0,
                     NI_NUMERICHOST);
         getnameinfo((struct sockaddr *)&result->dst_addr, result->dst_addr_len,
@@ -39,6 +39,11 @@ static void resolver_handle(struct neat_resolver *resolver,
         case IPPROTO_TCP:
             fprintf(stderr, "TCP/");
             break;
+#ifdef IPPROTO_MPTCP
+        case IPPROTO_MPTCP:
+            fprintf(stderr, "MPTCP/");
+            break;
+#endif
 #ifdef IPPROTO_SCTP
         case IPPROTO_SCTP:
             fprintf(stderr, "SCTP/");
@@ -113,6 +113,11 @@ static neat_error_code on_connected(struct neat_flow_operations *opCB)
     case IPPROTO_TCP:
         printf("TCP ");
         break;
+#ifdef IPPROTO_MPTCP
+    case IPPROTO_MPTCP:
+        printf("MPTCP ");
+        break;
+#endif
     case IPPROTO_UDP:
         printf("UDP ");
         break;
@@ -233,6 +238,10 @@ int main(int argc, char *argv[])
             prop |= NEAT_PROPERTY_UDPLITE_REQUIRED;
         } else if (strcmp(arg_property_ptr,"NEAT_PROPERTY_UDPLITE_BANNED") == 0) {
             prop |= NEAT_PROPERTY_UDPLITE_BANNED;
+        } else if (strcmp(arg_property_ptr,"NEAT_PROPERTY_MPTCP_REQUIRED") == 0) {
+            prop |= NEAT_PROPERTY_MPTCP_REQUIRED;
+        } else if (strcmp(arg_property_ptr,"NEAT_PROPERTY_MPTCP_BANNED") == 0) {
+            prop |= NEAT_PROPERTY_MPTCP_BANNED;
         } else if (strcmp(arg_property_ptr,"NEAT_PROPERTY_CONGESTION_CONTROL_REQUIRED") == 0) {
             prop |= NEAT_PROPERTY_CONGESTION_CONTROL_REQUIRED;
         } else if (strcmp(arg_property_ptr,"NEAT_PROPERTY_CONGESTION_CONTROL_BANNED") == 0) {